@@ -0,0 +1,38 @@
+#ifndef _XBUS_ARENA_H_
+#define _XBUS_ARENA_H_ 1
+
+#include <memory_resource>
+#include <vector>
+
+#include <xbus/buffer.h>
+
+namespace xbus {
+
+/*
+  Monotonic allocator backed by BufferPool slabs.
+  Deallocation is a no-op, memory is reclaimed all at once by reset().
+  Meant to be scoped to a connection or a batch of reads,
+  not thread-safe.
+*/
+class Arena : public std::pmr::memory_resource {
+  BufferPool& m_pool;
+  std::vector<Buffer> m_slabs;
+  size_t m_offset = 0;
+
+ public:
+  Arena(BufferPool& pool = BufferPool::global());
+  Arena(const Arena&) = delete;
+  ~Arena() = default;
+
+  // Releases everything, but the first slab
+  void reset();
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_ARENA_H_ */
@@ -0,0 +1,70 @@
+#ifndef _XBUS_BUFFER_H_
+#define _XBUS_BUFFER_H_ 1
+
+#include <cstddef>
+#include <vector>
+#include <mutex>
+
+#include <xbus/socket.h>
+
+namespace xbus {
+
+class BufferPool;
+
+/*
+  Owning handle to a slab of memory.
+  Slabs acquired from a BufferPool are returned to it on destruction,
+  oversized ones are freed.
+*/
+class Buffer {
+  BufferPool* m_pool = nullptr;
+  char* m_data = nullptr;
+  size_t m_size = 0;
+
+ public:
+  Buffer() = default;
+  Buffer(BufferPool* pool, char* data, size_t size);
+  Buffer(Buffer&& rhs) noexcept;
+  Buffer(const Buffer&) = delete;
+  ~Buffer();
+
+  Buffer& operator=(Buffer&& rhs) noexcept;
+  Buffer& operator=(const Buffer&) = delete;
+
+  char* data();
+  const char* data() const;
+  size_t size() const;
+  bool empty() const;
+
+  void release();
+};
+
+/*
+  Thread-safe free list of fixed-size slabs.
+  Keeps at most maxFree slabs around, so that steady-state reads reuse memory
+  instead of going to the allocator.
+*/
+class BufferPool {
+  size_t m_slabSize;
+  size_t m_maxFree;
+  std::mutex m_mutex;
+  std::vector<char*> m_free;
+
+ public:
+  BufferPool(size_t slabSize = XBUS_READ_SIZE, size_t maxFree = 64);
+  BufferPool(const BufferPool&) = delete;
+  ~BufferPool();
+
+  size_t slabSize() const;
+
+  Buffer acquire();
+  Buffer acquire(size_t size);
+
+  void release(char* data, size_t size);
+
+  static BufferPool& global();
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_BUFFER_H_ */
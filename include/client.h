@@ -0,0 +1,91 @@
+#ifndef _XBUS_CLIENT_H_
+#define _XBUS_CLIENT_H_ 1
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+#include <xbus/request.h>
+#include <xbus/response.h>
+#include <xbus/socket.h>
+#include <xbus/frame.h>
+
+namespace xbus {
+
+class Client;
+
+/*
+  Partial responses of one streamed call, read from the socket as they are consumed,
+  so a slow consumer slows down the object instead of buffering everything.
+  Must be read to the end before the next call on the same Client.
+*/
+class ResponseStream {
+  Client* m_client;
+  int m_tag;
+  std::string m_direct; // Object whose direct link the call went over, empty if it went through xbusd
+  bool m_done = false;
+  Response m_result;
+
+ public:
+  ResponseStream(Client* client, int tag, const std::string& direct = "");
+  ~ResponseStream() = default;
+
+  // Returns false once final response arrived, it is then available from result()
+  bool next(Response& chunk);
+
+  const Response& result() const;
+};
+
+/*
+  Connection to xbusd for making calls.
+  Requests are tagged by the client, frames with other tags
+  (e.g. notifications) are skipped.
+*/
+class Client {
+  friend class ResponseStream;
+
+  // Connection straight to an object, brokered by xbusd
+  struct DirectLink {
+    Socket* socket;
+    FrameReader* reader;
+  };
+
+  Socket* m_socket;
+  FrameReader* m_reader;
+  std::map<std::string, DirectLink> m_direct; // By object name
+  int m_nextTag = 0;
+  bool m_compression = false; // xbusd forwards compressed responses as they came
+
+ public:
+  // Connecting is retried for connectTimeout milliseconds, for callers started before xbusd
+  Client(const std::string& path = SOCKET_PATH, int connectTimeout = 0);
+  Client(const Client&) = delete;
+  ~Client();
+
+  // Waits for final response, partial ones are dropped
+  Response call(Request request);
+
+  ResponseStream stream(Request request);
+
+  // Interned IDs of object or subject names, to address later requests by
+  // Request::objectId and subjectId instead of names. Empty if xbusd refused
+  std::vector<uint32_t> resolve(const std::vector<std::string>& names);
+
+  // Asks xbusd to forward compressed responses as they are, they are expanded
+  // on receipt. Returns false if xbusd doesn't support it
+  bool enableCompression();
+
+  // Asks xbusd for a socket connected straight to object, property calls to it then skip the daemon.
+  // Fields and notifications still go through xbusd. Once the link breaks, calls go through xbusd again,
+  // a call that was on it when it broke gets ERR,OBJECT GONE. Returns false if xbusd refused
+  bool connectDirect(const std::string& object);
+
+ private:
+  Response receive(int tag, const std::string& direct = "");
+  void closeDirect(const std::string& object);
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_CLIENT_H_ */
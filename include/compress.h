@@ -0,0 +1,42 @@
+#ifndef _XBUS_COMPRESS_H_
+#define _XBUS_COMPRESS_H_ 1
+
+#include <string>
+#include <string_view>
+
+#include <xbus/response.h>
+
+#define XBUS_COMPRESS_THRESHOLD 1024 // Bytes of response payload, shorter ones are sent as they are
+#define XBUS_COMPRESS_MARKER '\x02'  // First byte of the element that holds compressed payload
+#define XBUS_COMPRESSION "compress=lz" // Offered and accepted in +version
+
+namespace xbus {
+
+/*
+  Byte-oriented LZ77 codec, in the spirit of LZ4: sequences of literals and matches
+  within the last 64 KB, no entropy coding. Fast enough to pay off for long repetitive
+  payloads (configuration dumps, tables, logs), not meant to squeeze short frames.
+*/
+namespace lz {
+
+std::string compress(std::string_view data);
+// Returns false if data is corrupt
+bool decompress(std::string_view data, std::string& result);
+
+} /* namespace lz */
+
+/*
+  Payload of a response (everything after status) is replaced by one element with it compressed,
+  escaped so that it holds no '\0', ',' or '#'. Status and tag stay readable, so xbusd routes and
+  forwards such responses without expanding them.
+  Returns false if the payload is shorter than threshold or doesn't shrink, except for a payload
+  that already looks compressed, which is packed regardless so that expanding gives it back.
+*/
+bool compressResponse(Response& response, size_t threshold = XBUS_COMPRESS_THRESHOLD);
+bool isCompressed(const Response& response);
+// Puts back the original payload, returns false (leaving response as is) if it is corrupt
+bool expandResponse(Response& response);
+
+} /* namespace xbus */
+
+#endif /* _XBUS_COMPRESS_H_ */
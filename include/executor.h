@@ -0,0 +1,123 @@
+#ifndef _XBUS_EXECUTOR_H_
+#define _XBUS_EXECUTOR_H_ 1
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define XBUS_EXECUTOR_SPIN 2048          // Empty polls before an idle worker parks
+#define XBUS_EXECUTOR_ADAPT_INTERVAL 20  // Milliseconds between sizing decisions
+#define XBUS_EXECUTOR_SHRINK_AFTER 50    // Idle intervals before a worker is retired
+#define XBUS_EXECUTOR_BLOCKING_US 1000   // Jobs slower than that are assumed to block, not to use CPU
+#define XBUS_EXECUTOR_PRIORITY_WEIGHT 8  // High priority jobs a worker runs in a row, while normal ones wait
+
+namespace xbus {
+
+/*
+  Work-stealing thread pool.
+  Every worker owns a Chase-Lev deque, jobs submitted by a worker go to its own deque,
+  jobs submitted from other threads are spread between workers' inboxes.
+  Idle workers steal from others, spin for a while and then park.
+  Workers can be pinned to a set of CPUs, one CPU per worker, round-robin.
+
+  If maxThreads is greater than threads, the pool is adaptive: it grows while jobs
+  are queued and every worker is busy, and shrinks back after being idle for a while.
+  It grows past the number of CPUs only if jobs take long, as then they are likely blocked.
+  Queue depth, latency and current size are reported by stats().
+
+  High priority jobs go to a shared lane that workers check first. A worker takes a normal job
+  after every XBUS_EXECUTOR_PRIORITY_WEIGHT high priority ones, so that those can't starve the rest.
+  An adaptive pool grows right away if a high priority job finds every worker busy.
+*/
+class Executor {
+ public:
+  using Function = void (*)(void*);
+
+  enum Priority {
+    NORMAL,
+    HIGH
+  };
+
+  struct Job {
+    Function function = nullptr;
+    void* arg = nullptr;
+  };
+
+  struct Stats {
+    size_t threads;
+    size_t minThreads;
+    size_t maxThreads;
+    size_t busy;
+    size_t queued;
+    uint64_t jobs;
+    uint64_t latencyUs; // Moving average of job duration
+  };
+
+  struct Worker;
+
+ private:
+  std::vector<std::unique_ptr<Worker>> m_workers; // Slots for maxThreads workers
+  std::vector<int> m_cpus;
+  int m_spin;
+  size_t m_minThreads;
+  std::atomic<size_t> m_active = 0;
+  std::atomic<size_t> m_nextInbox = 0;
+  std::atomic<size_t> m_busy = 0;
+  std::atomic<uint64_t> m_jobs = 0;
+  std::atomic<uint64_t> m_latencyNs = 0;
+
+  std::mutex m_urgentMutex;
+  std::deque<Job> m_urgent; // High priority lane
+  std::atomic<size_t> m_urgentSize = 0;
+
+  std::mutex m_resizeMutex;
+  std::thread m_monitor;
+  std::condition_variable m_monitorWakeup;
+
+  std::mutex m_parkMutex;
+  std::condition_variable m_parked;
+  std::atomic<int> m_sleeping = 0;
+  int m_wakeups = 0;
+  std::atomic<bool> m_stopping = false;
+
+ public:
+  // threads = 0 uses hardware concurrency
+  Executor(size_t threads = 0, const std::vector<int>& cpus = {}, int spin = XBUS_EXECUTOR_SPIN, size_t maxThreads = 0);
+  Executor(const Executor&) = delete;
+  ~Executor();
+
+  size_t size() const;
+  Stats stats() const;
+
+  void submit(Function function, void* arg, Priority priority = NORMAL);
+
+  // Number of workers, within [threads, maxThreads] given to constructor
+  void resize(size_t threads);
+
+  // Waits for submitted jobs to finish and stops workers
+  void finishAll();
+
+  // Parses CPU list, like "0-3,6"
+  static std::vector<int> parseCpus(const std::string& str);
+
+ private:
+  void run(size_t index);
+  void adapt();
+  bool retire(size_t index);
+  bool blocked() const;
+  bool take(size_t index, Job& job);
+  bool takeUrgent(Job& job);
+  bool hasWork() const;
+  size_t queued() const;
+  void park(size_t index);
+  void wake();
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_EXECUTOR_H_ */
@@ -0,0 +1,51 @@
+#ifndef _XBUS_FRAME_H_
+#define _XBUS_FRAME_H_ 1
+
+#include <string_view>
+
+#include <xbus/buffer.h>
+#include <xbus/socket.h>
+
+namespace xbus {
+
+/*
+  Splits the byte stream of a socket into '\0' terminated frames.
+  Reads go straight into a pooled slab, returned frames are views into it
+  and stay valid until the next call to next().
+  A frame ends only at '\0', an incomplete tail stays buffered until the rest of it is read.
+*/
+class FrameReader {
+  Socket* m_socket;
+  BufferPool& m_pool;
+  Buffer m_buffer;
+  size_t m_begin = 0;
+  size_t m_end = 0;
+
+  void compact();
+
+ public:
+  FrameReader(Socket* socket, BufferPool& pool = BufferPool::global());
+  ~FrameReader() = default;
+
+  // Returns false when peer closed the connection
+  bool next(std::string_view& frame);
+
+  // Event-driven use: fill() does exactly one read, tryNext() never reads.
+  // fill() returns false when peer closed the connection
+  bool fill();
+  bool tryNext(std::string_view& frame);
+
+  size_t buffered() const;
+
+  // True if next() can return a frame without reading from the socket
+  bool ready() const;
+
+  // Bytes read but not yet returned, and a way to put them back into a new reader.
+  // Data received elsewhere is pushed as well
+  std::string_view pending() const;
+  void push(std::string_view data);
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_FRAME_H_ */
@@ -0,0 +1,69 @@
+#ifndef _XBUS_IO_H_
+#define _XBUS_IO_H_ 1
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+#include <xbus/socket.h>
+
+namespace xbus {
+
+// Number of I/O syscalls made through libxbus by this process
+uint64_t syscallCount();
+void countSyscalls(uint64_t count = 1);
+
+/*
+  Event returned by IoBackend::wait().
+  Backends that receive by themselves (io_uring) pass the data,
+  others only report that the descriptor is readable.
+*/
+struct IoEvent {
+  uint64_t key = 0;
+  bool readable = false; // Descriptor has to be read by the caller
+  const char* data = nullptr;
+  ssize_t size = 0;    // 0 on EOF, -errno on error
+  int buffer = -1;
+};
+
+/*
+  Event source for an event loop.
+  Registrations are identified by keys, which must not be reused for another descriptor.
+  wait(), release() and registrations are called from the loop thread,
+  remove() and broadcast() may be called from any thread.
+*/
+class IoBackend {
+ public:
+  virtual ~IoBackend() = default;
+
+  virtual const char* name() const = 0;
+
+  // Reports readiness only, for listening sockets and event descriptors
+  virtual void watch(int fd, uint64_t key) = 0;
+  // Reports readiness or received data
+  virtual void receive(int fd, uint64_t key) = 0;
+  virtual void pause(int fd, uint64_t key) = 0;
+  virtual void resume(int fd, uint64_t key) = 0;
+  virtual void remove(int fd, uint64_t key) = 0;
+
+  // Blocks until there is at least one event
+  virtual int wait(IoEvent* events, int max) = 0;
+  // Gives back receive buffer of a data event
+  virtual void release(const IoEvent& event);
+
+  // True once paused descriptors are no longer read by the backend,
+  // and everything it received was returned by wait()
+  virtual bool settled();
+
+  // Writes frame to every socket, failed ones are skipped
+  virtual void broadcast(const std::vector<Socket*>& sockets, std::string_view frame);
+
+  // "epoll" or "uring", nullptr if not supported by the system
+  static IoBackend* create(const std::string& name);
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_IO_H_ */
@@ -0,0 +1,82 @@
+#ifndef _XBUS_JOURNAL_H_
+#define _XBUS_JOURNAL_H_ 1
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <sys/uio.h>
+
+#define XBUS_JOURNAL_VERSION 1
+#define XBUS_JOURNAL_ALIGN   32 // Records start at multiples of that, so a skip record always fits before ring's end
+
+namespace xbus {
+
+/*
+  Append-only ring of timestamped frames in a memory-mapped file.
+  Writers reserve space with a single atomic add and copy the frame in,
+  no syscalls are made, pages are written back by the kernel.
+  Once the ring is full, oldest records are overwritten.
+  Record's size is stored last, so records that are still being written are not read.
+  Records larger than half of the ring are not stored, only counted.
+*/
+class Journal {
+ public:
+  enum Direction : char {
+    IN     = '<', // Frame received from connection
+    OUT    = '>', // Frame (or several) sent to connection
+    OPEN   = '+', // Connection accepted
+    CLOSE  = '-', // Connection closed
+  };
+
+  struct Record {
+    uint64_t position;    // Absolute offset in journal, grows monotonically
+    uint64_t timestampNs; // steady_clock
+    int connection;
+    char direction;
+    std::string_view data;
+  };
+
+  struct Header;
+  struct RecordHeader;
+
+ private:
+  Header* m_header = nullptr;
+  char* m_ring = nullptr;
+  size_t m_mapSize = 0;
+  bool m_writable = false;
+
+ public:
+  Journal() = default;
+  Journal(const Journal&) = delete;
+  ~Journal();
+
+  // Creates (or truncates) journal file with ring of given size
+  void create(const std::string& path, size_t capacity);
+  // Maps existing journal file for reading
+  void open(const std::string& path);
+  void close();
+
+  bool isOpen() const;
+  size_t capacity() const;
+  // Bytes written since journal was created, including overwritten ones
+  uint64_t written() const;
+  // Records that were larger than half of the ring and were not stored
+  uint64_t dropped() const;
+
+  // Data of several buffers is stored as one record
+  void record(Direction direction, int connection, const iovec* iov, int count);
+  void record(Direction direction, int connection, std::string_view data = {});
+
+  // Records that are still in the ring, oldest first. Data points into the mapping
+  std::vector<Record> records() const;
+
+  // Journal that frames written by Socket are recorded to, nullptr if none
+  static Journal* recording();
+  static void setRecording(Journal* journal);
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_JOURNAL_H_ */
@@ -3,36 +3,93 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
 
 #include <xbus/response.h>
 #include <xbus/request.h>
 #include <xbus/version.h>
 #include <xbus/socket.h>
+#include <xbus/frame.h>
+#include <xbus/compress.h>
+#include <xbus/executor.h>
+#include <xbus/exceptions.h>
 #include <xbus/log.h>
 #include <xbus/die.h>
 
-#include <mrt/threads/pool.h>
-#include <mrt/threads/task.h>
-
 namespace xbus {
 
+// How xbusd dispatches calls between replicas of an object
+enum class GroupBalance {
+  NONE,             // Not replicated
+  ROUND_ROBIN,
+  LEAST_IN_FLIGHT,
+  HASH              // Consistent hash on call argument
+};
+
 template <typename T>
 class Object {
  public:
-  using HandlerType = Response(T::*)(Request);
+  using HandlerType = Response(T::*)(const Request&);
 
  private:
   struct HandlingContext {
     Object* object;
+    Socket* socket; // Connection the request came on, response goes back on it
     Request request;
+    std::shared_ptr<Socket> link; // Direct link the request came on, kept open until it is answered
+  };
+
+  // Connection to xbusd past the first one, with its own reader thread
+  struct Channel {
+    Socket* socket;
+    FrameReader* reader;
+  };
+
+  // Property or field under ID interned by xbusd, requests addressed by ID are dispatched by index
+  struct Symbol {
+    std::string name;
+    HandlerType property = nullptr;
+    std::string* field = nullptr;
   };
 
  private:
   std::string m_name;
   bool m_running = false;
   Socket* m_socket = nullptr;
+  FrameReader* m_reader = nullptr;
+  std::vector<Channel> m_channels;
+  size_t m_channelCount = 1;
+  int m_connectionId = -1; // Of m_socket in xbusd, channels refer to it when registering
+  size_t m_compressThreshold = 0; // 0 - responses are sent as they are
+  bool m_compressing = false;     // Compression was offered and xbusd accepted it
+  // Direct links opened by callers with +connect_direct, each fetched and then read by a thread of its own,
+  // threads that are done are joined when the next link comes and the rest by listen()
+  bool m_directLinks = false;
+  std::mutex m_directMutex;
+  bool m_directStopped = false;
+  std::set<Socket*> m_direct;
+  std::map<uint64_t, std::thread> m_directThreads; // By token
+  std::vector<uint64_t> m_directDone;
+  std::mutex m_fieldsMutex; // Fields are read and set by handlers on every executor thread
   std::map<std::string, std::string> m_fields;
+  std::set<std::string> m_cachedFields;
+  std::set<std::string> m_coalesced;
   std::map<std::string, HandlerType> m_properties;
+  std::vector<Symbol> m_symbols; // By ID, resolved by listen()
+  GroupBalance m_balance = GroupBalance::NONE;
+  size_t m_hashArg = 0;
+  int m_maxInFlight = -1; // -1 leaves xbusd defaults
+  int m_maxWaiting = -1;
+  size_t m_threads = 0;
+  size_t m_maxThreads = 0;
+  std::vector<int> m_cpus;
 
  public:
   inline Object(const std::string& name) : m_name(name) {
@@ -40,30 +97,138 @@ class Object {
   }
 
   inline ~Object() {
+    for (auto& channel : m_channels) {
+      delete channel.reader;
+      delete channel.socket;
+    }
+    delete m_reader;
     delete m_socket;
   }
 
-  inline void addField(const std::string& field, const std::string& value = "") {
+  // Cached fields are served by xbusd without waking up the object,
+  // so they must only be changed through requests or setField()
+  inline void addField(const std::string& field, const std::string& value = "", bool cached = false) {
+    std::unique_lock lock(m_fieldsMutex);
+    m_fields[field] = value;
+    if (cached) {
+      m_cachedFields.insert(field);
+    }
+  }
+
+  // Cached value is pushed under the lock, so that xbusd sees concurrent sets in the order they were stored
+  inline void setField(const std::string& field, const std::string& value) {
+    std::unique_lock lock(m_fieldsMutex);
     m_fields[field] = value;
+    if (m_running && m_cachedFields.count(field)) {
+      m_socket->writeFrame("-" + field + "=" + value + "&");
+    }
   }
 
   inline void addProperty(const std::string& prop, HandlerType handler) {
     m_properties[prop] = handler;
   }
 
+  // Concurrent identical reads ('?') of property or field are answered by one call,
+  // only for reads without side effects. Must be called before listen()
+  inline void setCoalesced(const std::string& subject) {
+    m_coalesced.insert(subject);
+  }
+
+  // Sends a partial response to a call, from within its handler.
+  // Response returned by the handler ends the stream
+  inline void stream(const Request& request, const std::vector<std::string>& rest) {
+    Response response = {STATUS_MORE, rest};
+    response.tag = request.tag;
+    if (m_compressing && !s_direct) {
+      compressResponse(response, m_compressThreshold);
+    }
+    (s_socket ? s_socket : m_socket)->writeFrame(response.toString());
+  }
+
+  // Registers object as a replica in a group of objects with the same name,
+  // must be called before listen()
+  inline void setGroup(GroupBalance balance, size_t hashArg = 0) {
+    m_balance = balance;
+    m_hashArg = hashArg;
+  }
+
+  // Calls xbusd lets in flight to this object (0 is unlimited), and calls it lets wait
+  // for a free slot, before answering ERR,BUSY. -1 leaves xbusd defaults. Must be called before listen()
+  inline void setLimit(int maxInFlight, int maxWaiting = -1) {
+    m_maxInFlight = maxInFlight;
+    m_maxWaiting = maxWaiting;
+  }
+
+  // Number of connections to xbusd (at least 1), calls are striped over them by xbusd and every
+  // connection is read by its own thread. Must be called before listen()
+  inline void setChannels(size_t channels) {
+    m_channelCount = std::max<size_t>(channels, 1);
+  }
+
+  // Callers may ask xbusd for a link of their own to this object (Client::connectDirect), which bypasses
+  // xbusd entirely. xbusd refuses links to objects with limits, coalesced subjects or cached fields,
+  // as those are kept by xbusd. Must be called before listen()
+  inline void setDirect(bool enabled) {
+    m_directLinks = enabled;
+  }
+
+  // Responses (and stream parts) with payload of at least threshold bytes are sent compressed,
+  // if xbusd supports it. Callers that didn't ask for compression get them expanded by xbusd.
+  // Must be called before listen()
+  inline void setCompression(bool enabled, size_t threshold = XBUS_COMPRESS_THRESHOLD) {
+    m_compressThreshold = enabled ? std::max<size_t>(threshold, 1) : 0;
+  }
+
+  // Number of handler threads (0 - hardware concurrency) and CPUs to pin them to,
+  // pool grows up to maxThreads under load if it's greater. Must be called before listen()
+  inline void setExecutor(size_t threads, const std::vector<int>& cpus = {}, size_t maxThreads = 0) {
+    m_threads = threads;
+    m_cpus = cpus;
+    m_maxThreads = maxThreads;
+  }
+
   inline void listen() {
-    mrt::ThreadPool<mrt::Task<HandlingContext*>> pool;
+    m_compressing = checkVersion(m_socket, m_reader);
+    resolveSymbols();
+    if (m_channelCount > 1) {
+      queryConnectionId();
+    }
+    registerObject();
+    openChannels();
+
+    Executor executor(m_threads, m_cpus, XBUS_EXECUTOR_SPIN, m_maxThreads);
 
     m_running = true;
-    while (m_running) {
-      std::string data = m_socket->read(XBUS_READ_SIZE);
-      if (data.empty()) break;
-      // Request request = Request::fromString(data);
-      HandlingContext* ctx = new HandlingContext {this, Request::fromString(data)};
-      pool.addTask({handleRequestCb, ctx});
+    std::vector<std::thread> readers;
+    for (auto& channel : m_channels) {
+      readers.emplace_back([this, &channel, &executor]() {
+        readRequests(channel.socket, channel.reader, executor);
+      });
     }
+    readRequests(m_socket, m_reader, executor);
 
-    pool.finishAll();
+    // Channels stop being read, responses to calls already taken can still be written
+    for (auto& channel : m_channels) {
+      channel.socket->shutdown(SHUT_RD);
+    }
+    for (auto& reader : readers) {
+      reader.join();
+    }
+    // Links still being fetched see m_directStopped and are not read
+    std::map<uint64_t, std::thread> links;
+    {
+      std::lock_guard lock(m_directMutex);
+      m_directStopped = true;
+      for (auto link : m_direct) {
+        link->shutdown(SHUT_RD);
+      }
+      std::swap(links, m_directThreads);
+      m_directDone.clear();
+    }
+    for (auto& p : links) {
+      p.second.join();
+    }
+    executor.finishAll();
   }
 
   inline void stop() {
@@ -74,38 +239,243 @@ class Object {
     return m_running;
   }
 
-  virtual inline void onNotify(Request request) {}
+  // Request being handled by this thread came on a direct link
+  inline bool isDirect() const {
+    return s_direct;
+  }
+
+  virtual inline void onNotify(const Request& request) {}
 
  private:
+  // Connection of the request being handled by this thread, for stream()
+  static inline thread_local Socket* s_socket = nullptr;
+  // Request being handled came on a direct link, its caller didn't negotiate compression with xbusd
+  static inline thread_local bool s_direct = false;
+
+  inline void readRequests(Socket* socket, FrameReader* reader, Executor& executor, std::shared_ptr<Socket> link = nullptr) {
+    std::string_view frame;
+    while (m_running && reader->next(frame)) {
+      auto view = RequestView::fromString(frame);
+      if (!link && view.object.empty() && view.subject == "direct" && view.args.size() == 1) {
+        startDirect(std::string(view.args[0]), executor);
+        continue;
+      }
+      HandlingContext* ctx = new HandlingContext {this, socket, Request::fromString(frame), link};
+      auto id = ctx->request.subjectId;
+      if (id && id < m_symbols.size()) {
+        ctx->request.subject = m_symbols[id].name;
+      }
+      executor.submit(handleRequestCb, ctx, ctx->request.priority ? Executor::HIGH : Executor::NORMAL);
+    }
+  }
+
+  // Fetching the link blocks on xbusd, so it is left to the link's thread and the reader goes on
+  inline void startDirect(const std::string& token, Executor& executor) {
+    uint64_t id = std::strtoull(token.c_str(), nullptr, 10);
+    std::lock_guard lock(m_directMutex);
+    for (auto done : m_directDone) {
+      auto itr = m_directThreads.find(done);
+      if (itr != m_directThreads.end()) {
+        itr->second.join();
+        m_directThreads.erase(itr);
+      }
+    }
+    m_directDone.clear();
+    if (m_directStopped || m_directThreads.count(id)) {
+      return;
+    }
+    m_directThreads[id] = std::thread([this, token, id, &executor]() {
+      readDirect(token, executor);
+      std::lock_guard lock(m_directMutex);
+      m_directDone.push_back(id);
+    });
+  }
+
+  // Object end of a direct link is fetched over a connection of its own,
+  // so that the descriptor doesn't arrive in the middle of buffered frames
+  inline void readDirect(const std::string& token, Executor& executor) {
+    int fd = -1;
+    try {
+      Socket broker(SOCKET_PATH);
+      broker.connect();
+      broker.writeFrame("+accept_direct:" + token);
+      char buffer[XBUS_READ_SIZE];
+      size_t size = broker.recvFd(buffer, sizeof(buffer), fd);
+      auto response = Response::fromString(std::string_view(buffer, size && !buffer[size - 1] ? size - 1 : size));
+      if (response.status != "OK" || fd == -1) {
+        xbus::warning("direct link %s was not accepted: %s", token.c_str(), response.toString().c_str());
+        if (fd != -1) ::close(fd);
+        return;
+      }
+    } catch (IOException& e) {
+      e.print();
+      if (fd != -1) ::close(fd);
+      return;
+    }
+
+    auto link = std::make_shared<Socket>(fd);
+    {
+      std::lock_guard lock(m_directMutex);
+      if (m_directStopped) return;
+      m_direct.insert(link.get());
+    }
+    FrameReader reader(link.get());
+    try {
+      readRequests(link.get(), &reader, executor, link);
+    } catch (IOException& e) {
+      e.print();
+    }
+    std::lock_guard lock(m_directMutex);
+    m_direct.erase(link.get());
+  }
+
   inline void initialize() {
     m_socket = new Socket(SOCKET_PATH);
-    m_socket->connect();
-    registerObject();
+    m_socket->connect(XBUS_CONNECT_TIMEOUT);
+    m_reader = new FrameReader(m_socket);
   }
 
-  inline void checkVersion() const {
-    m_socket->write("+version:" + m_name);
-    auto response = Response::fromString(m_socket->read(XBUS_READ_SIZE));
-    if (response.rest.size() != 1) {
-      m_socket->write("+close");
+  // Offers compression along, returns true if xbusd accepted it for this connection
+  inline bool checkVersion(Socket* socket, FrameReader* reader) const {
+    socket->writeFrame("+version:" + m_name + (m_compressThreshold ? "," XBUS_COMPRESSION : ""));
+    std::string_view frame;
+    if (!reader->next(frame)) {
+      die("checkVersion: connection closed");
+    }
+    auto response = Response::fromString(frame);
+    if (response.rest.empty()) {
+      socket->writeFrame("+close");
       die("checkVersion: unexpected response");
     }
     if (response.status != "OK") {
-      m_socket->write("+close");
+      socket->writeFrame("+close");
       die("check version failed");
     }
     if (response.rest[0] != XBUS_VERSION) {
-      m_socket->write("+close");
+      socket->writeFrame("+close");
       die("wrong version: expected: %s, actual: %s", XBUS_VERSION, response.rest[0].c_str());
     }
+    return std::find(response.rest.begin() + 1, response.rest.end(), XBUS_COMPRESSION) != response.rest.end();
+  }
+
+  // Interns names of properties and fields in xbusd, so that callers can address them by ID.
+  // Done before registration, as requests may come right after it
+  inline void resolveSymbols() {
+    std::vector<std::string> names;
+    for (auto& p : m_properties) {
+      names.push_back(p.first);
+    }
+    std::unique_lock lock(m_fieldsMutex);
+    for (auto& p : m_fields) {
+      if (!m_properties.count(p.first)) names.push_back(p.first);
+    }
+    lock.unlock();
+    if (names.empty()) return;
+
+    Request request;
+    request.action = ACTION_PROPERTY;
+    request.subject = "intern";
+    request.args = names;
+    m_socket->writeFrame(request.toString());
+    std::string_view frame;
+    if (!m_reader->next(frame)) {
+      die("resolveSymbols: connection closed");
+    }
+    auto response = Response::fromString(frame);
+    if (response.status != "OK" || response.rest.size() != names.size()) {
+      xbus::warning("names were not resolved: %s", response.toString().c_str());
+      return;
+    }
+
+    lock.lock();
+    for (size_t i = 0; i < names.size(); i++) {
+      size_t id = std::stoul(response.rest[i]);
+      if (id >= m_symbols.size()) {
+        m_symbols.resize(id + 1);
+      }
+      auto& symbol = m_symbols[id];
+      symbol.name = names[i];
+      auto property = m_properties.find(names[i]);
+      symbol.property = property == m_properties.end() ? nullptr : property->second;
+      auto field = m_fields.find(names[i]);
+      symbol.field = field == m_fields.end() ? nullptr : &field->second;
+    }
+  }
+
+  // Asked before registration, as requests may come right after it
+  inline void queryConnectionId() {
+    m_socket->writeFrame("+fd");
+    std::string_view frame;
+    if (!m_reader->next(frame)) {
+      die("queryConnectionId: connection closed");
+    }
+    auto response = Response::fromString(frame);
+    if (response.status != "OK" || response.rest.size() != 1) {
+      die("connection id query failed: %s", response.toString().c_str());
+    }
+    m_connectionId = std::stoi(response.rest[0]);
+  }
+
+  // Opens the rest of connections and registers them as channels of the first one
+  inline void openChannels() {
+    for (size_t i = 1; i < m_channelCount; i++) {
+      Channel channel;
+      channel.socket = new Socket(SOCKET_PATH);
+      channel.socket->connect(XBUS_CONNECT_TIMEOUT);
+      channel.reader = new FrameReader(channel.socket);
+      m_channels.push_back(channel);
+      checkVersion(channel.socket, channel.reader);
+
+      channel.socket->writeFrame("+register:" + m_name + ",channel=" + std::to_string(m_connectionId));
+      std::string_view frame;
+      if (!channel.reader->next(frame)) {
+        die("openChannels: connection closed");
+      }
+      auto response = Response::fromString(frame);
+      if (response.status != "OK") {
+        die("channel register failed: %s", response.toString().c_str());
+      }
+    }
   }
 
   inline void registerObject() const {
-    m_socket->write("+register:" + m_name);
-    std::string result = m_socket->read(XBUS_READ_SIZE);
+    std::string request = "+register:" + m_name;
+    if (m_directLinks) {
+      request += ",direct";
+    }
+    if (!m_symbols.empty()) {
+      request += ",ids";
+    }
+    for (auto& field : m_cachedFields) {
+      request += ",cache=" + field;
+    }
+    for (auto& subject : m_coalesced) {
+      request += ",coalesce=" + subject;
+    }
+    switch (m_balance) {
+      case GroupBalance::ROUND_ROBIN:     request += ",group=rr"; break;
+      case GroupBalance::LEAST_IN_FLIGHT: request += ",group=least"; break;
+      case GroupBalance::HASH:            request += ",group=hash,key=" + std::to_string(m_hashArg); break;
+      default: break;
+    }
+    if (m_maxInFlight >= 0) {
+      request += ",limit=" + std::to_string(m_maxInFlight);
+    }
+    if (m_maxWaiting >= 0) {
+      request += ",queue=" + std::to_string(m_maxWaiting);
+    }
+    m_socket->writeFrame(request);
+    std::string_view frame;
+    if (!m_reader->next(frame)) {
+      die("registerObject: connection closed");
+    }
+    auto response = Response::fromString(frame);
+    if (response.status != "OK") {
+      die("register failed: %s", response.toString().c_str());
+    }
   }
 
-  inline Response handleRequest(Request request) {
+  inline Response handleRequest(const Request& request) {
     xbus::info("recv '%s'", request.toString().c_str());
 
     if (!request.isValid()) {
@@ -113,19 +483,32 @@ class Object {
       return {""};
     }
 
+    // Heartbeat from xbusd (+ping^) is answered by a handler thread on the high priority lane,
+    // so that an object whose handlers are all hung or busy stops answering it
+    if (request.object.empty() && request.subject == "ping") {
+      return {"OK"};
+    }
+
     if (request.action == xbus::ACTION_PROPERTY) {
       return dispatchMethod(request);
     } else if (request.action == xbus::ACTION_FIELD) {
-      if (m_fields.find(request.subject) == m_fields.end()) {
+      std::unique_lock lock(m_fieldsMutex);
+      std::string* field = nullptr;
+      if (request.subjectId) {
+        field = request.subjectId < m_symbols.size() ? m_symbols[request.subjectId].field : nullptr;
+      } else if (auto itr = m_fields.find(request.subject); itr != m_fields.end()) {
+        field = &itr->second;
+      }
+      if (!field) {
         return {"ERR", {"NO SUCH FIELD"}};
       }
       if (request.request) {
-        return {"OK", {m_fields[request.subject]}};
+        return {"OK", {*field}};
       } else {
         if (request.args.size() != 1) {
           return {"ERR", {"ARGUMENT MISMATCH"}};
         }
-        m_fields[request.subject] = request.args[0];
+        *field = request.args[0];
         return {"OK"};
       }
     } else if (request.action == xbus::ACTION_NOTIFY) {
@@ -137,20 +520,38 @@ class Object {
     return {""};
   }
 
-  inline Response dispatchMethod(Request request) {
-    if (m_properties.find(request.subject) == m_properties.end()) {
+  inline Response dispatchMethod(const Request& request) {
+    HandlerType handler = nullptr;
+    if (request.subjectId) {
+      handler = request.subjectId < m_symbols.size() ? m_symbols[request.subjectId].property : nullptr;
+    } else if (auto itr = m_properties.find(request.subject); itr != m_properties.end()) {
+      handler = itr->second;
+    }
+    if (!handler) {
       return {"ERR", {"NO SUCH PROPERTY"}};
     }
-    return (((T*)this)->*m_properties[request.subject])(request);
+    return (((T*)this)->*handler)(request);
   }
 
   static inline void handleRequestCb(void* ctx) {
     HandlingContext* context = (HandlingContext*)ctx;
-    Response response = context->object->handleRequest(context->request);
-    response.tag = context->request.tag;
-    if (!response.status.empty()) {
-      context->object->m_socket->write(response.toString());
+    s_socket = context->socket;
+    s_direct = context->link != nullptr;
+    try {
+      Response response = context->object->handleRequest(context->request);
+      response.tag = context->request.tag;
+      if (!response.status.empty()) {
+        if (context->object->m_compressing && !s_direct) {
+          compressResponse(response, context->object->m_compressThreshold);
+        }
+        context->socket->writeFrame(response.toString());
+      }
+    } catch (IOException& e) {
+      // Caller on a direct link went away, or xbusd did
+      e.print();
     }
+    s_socket = nullptr;
+    s_direct = false;
     delete context;
   }
 };
@@ -2,7 +2,10 @@
 #define _XBUS_REQUEST_H_ 1
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <cstdint>
+#include <memory_resource>
 
 namespace xbus {
 
@@ -12,11 +15,13 @@ constexpr char ACTION_METHOD[]   = "+";
 constexpr char ACTION_FIELD[]    = "-";
 
 /*
-  Format: [object] action subject [args] [async] [request] [tag]
+  Format: [object] action subject [args] [async] [request] [priority] [tag]
+  object and subject may be interned IDs: $ID (see +resolve)
   actions: - + !
   args: : arg , ...
   async: &
   request: ?
+  priority: ^
   tag: # sender_id
 */
 class Request {
@@ -27,20 +32,58 @@ class Request {
   std::vector<std::string> args;
   bool request = false;
   bool async = false;
+  bool priority = false; // Handled ahead of other requests by xbusd and objects
   int tag = 0;
+  uint32_t objectId = 0;  // Set if object is addressed by interned ID, written as '$ID' if object is empty
+  uint32_t subjectId = 0; // Same for subject
 
  public:
   Request() = default;
   Request(const Request& rhs) = default;
+  Request(Request&& rhs) = default;
   ~Request() = default;
 
+  Request& operator=(const Request& rhs) = default;
+  Request& operator=(Request&& rhs) = default;
+
   bool isValid() const;
   std::string toString() const;
 
-  static Request fromString(const std::string& str);
+  static Request fromString(std::string_view str);
+};
+
+/*
+  Non-owning parse of a request frame.
+  All strings are views into the frame, args are allocated
+  from provided memory resource (usually a per-connection xbus::Arena).
+  Valid only as long as both the frame and the resource are.
+*/
+class RequestView {
+ public:
+  std::string_view frame;
+  std::string_view object;
+  std::string_view action;
+  std::string_view subject;
+  std::pmr::vector<std::string_view> args;
+  bool request = false;
+  bool async = false;
+  bool priority = false;
+  int tag = 0;
+  uint32_t objectId = 0;
+  uint32_t subjectId = 0;
+  size_t tagOffset = 0; // Offset of '#' in frame, or frame size if there is no tag
+
+ public:
+  RequestView(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+  ~RequestView() = default;
+
+  bool isValid() const;
+  Request toRequest() const;
+
+  static RequestView fromString(std::string_view str, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 };
 
-bool isRequest(const std::string& str);
+bool isRequest(std::string_view str);
 
 } /* namespace xbus */
 
@@ -2,10 +2,15 @@
 #define _XBUS_RESPONSE_H_ 1
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory_resource>
 
 namespace xbus {
 
+// Partial response of a streamed call, more frames with the same tag follow
+constexpr char STATUS_MORE[] = "MORE";
+
 /*
   Format: STATUS [rest] [tag]
   rest: , arg ...
@@ -20,13 +25,38 @@ class Response {
 
  public:
   Response() = default;
-  Response(const std::string& status);
-  Response(const std::string& status, std::vector<std::string> rest);
+  Response(std::string status);
+  Response(std::string status, std::vector<std::string> rest);
+  Response(const Response& rhs) = default;
+  Response(Response&& rhs) = default;
   ~Response() = default;
 
+  Response& operator=(const Response& rhs) = default;
+  Response& operator=(Response&& rhs) = default;
+
   std::string toString() const;
 
-  static Response fromString(const std::string& str);
+  static Response fromString(std::string_view str);
+};
+
+/*
+  Non-owning parse of a response frame, see RequestView
+*/
+class ResponseView {
+ public:
+  std::string_view frame;
+  std::string_view status;
+  std::pmr::vector<std::string_view> rest;
+  int tag = 0;
+  size_t tagOffset = 0; // Offset of '#' in frame, or frame size if there is no tag
+
+ public:
+  ResponseView(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+  ~ResponseView() = default;
+
+  Response toResponse() const;
+
+  static ResponseView fromString(std::string_view str, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 };
 
 } /* namespace xbus */
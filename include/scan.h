@@ -0,0 +1,84 @@
+#ifndef _XBUS_SCAN_H_
+#define _XBUS_SCAN_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#define XBUS_SCAN_BLOCK 64 // Bytes classified at once, one bit per byte
+#define XBUS_SCAN_CHARS 8  // Most delimiters a scanner looks for
+
+namespace xbus {
+
+/*
+  Finds delimiters in frames 32 (AVX2) or 16 (SSE2) bytes at a time, falling back to
+  a scalar loop on other CPUs and for tails shorter than a vector.
+  Implementation is picked once, from what the CPU supports.
+*/
+enum class ScanLevel { SCALAR, SSE2, AVX2 };
+
+ScanLevel scanLevel();
+const char* scanLevelName(ScanLevel level);
+// Returns false if the CPU doesn't support it, used by benchmarks
+bool setScanLevel(ScanLevel level);
+
+// Delimiters broadcast for vector compares, and as a bitmap for the scalar loop
+struct Delimiters {
+  const char* chars;
+  size_t count;
+  uint64_t bits[4] = {};
+
+  Delimiters(std::string_view chars);
+
+  inline bool contains(char c) const {
+    return bits[(unsigned char) c >> 6] >> ((unsigned char) c & 63) & 1;
+  }
+};
+
+/*
+  Yields offsets of bytes of str that are one of chars, in order, in one pass over str.
+  A block of str is classified into a bitmask, next() pops offsets from it
+  and classifies the next block once it is empty.
+*/
+class DelimiterScanner {
+  std::string_view m_str;
+  Delimiters m_delimiters;
+  size_t m_block = 0; // Offset of the block in m_mask
+  uint64_t m_mask = 0;
+
+ public:
+  // chars must outlive the scanner, 1 to XBUS_SCAN_CHARS of them
+  DelimiterScanner(std::string_view str, std::string_view chars, size_t from = 0);
+
+  // Offset of next delimiter, str.size() once there are no more
+  size_t next();
+};
+
+// Offset of first byte of str that is one of chars, or str.size()
+size_t findDelimiter(std::string_view str, std::string_view chars, size_t from = 0);
+
+namespace detail {
+
+struct NameChars {
+  bool table[256] = {};
+
+  constexpr NameChars() {
+    for (int c = '0'; c <= '9'; c++) table[c] = true;
+    for (int c = 'A'; c <= 'Z'; c++) table[c] = true;
+    for (int c = 'a'; c <= 'z'; c++) table[c] = true;
+    table[(unsigned char) '_'] = true;
+  }
+};
+
+inline constexpr NameChars NAME_CHARS;
+
+} /* namespace detail */
+
+// Bytes of object and subject names, [A-Za-z0-9_], without locale lookups of isalnum
+inline bool isNameChar(char c) {
+  return detail::NAME_CHARS.table[(unsigned char) c];
+}
+
+} /* namespace xbus */
+
+#endif /* _XBUS_SCAN_H_ */
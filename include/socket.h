@@ -2,11 +2,16 @@
 #define _XBUS_SOCKET_H_ 1
 
 #include <string>
+#include <string_view>
+#include <mutex>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #define XBUS_READ_SIZE 1024
+#define XBUS_CONNECT_TIMEOUT 10000 // Milliseconds objects keep retrying to connect while xbusd starts
+#define XBUS_CONNECT_RETRY 50      // Milliseconds between attempts
 
 namespace xbus {
 
@@ -17,24 +22,40 @@ class Socket {
   std::string m_path;
   sockaddr_un m_addr;
   int m_fd = -1;
+  std::mutex m_writeMutex; // Frames from different threads must not interleave
 
  public:
   Socket();
   Socket(const std::string& path);
+  explicit Socket(int fd);
   ~Socket();
 
   std::string path();
   int fd();
 
   void bind();
-  void connect();
+  // With timeout, retries while the socket doesn't exist or nobody listens on it yet
+  void connect(int timeout = 0);
   void listen();
   void close();
+  void shutdown(int how = SHUT_RDWR);
 
   Socket* accept();
 
-  void write(const std::string& data);
+  void write(std::string_view data);
+  void writeFrame(std::string_view data);
+  void writev(iovec* iov, int count);
+
+  // Held by writers for the duration of a frame, for writes made outside of Socket.
+  // Without wait, the lock isn't owned if another writer holds it
+  std::unique_lock<std::mutex> lockWrites(bool wait = true);
+
+  size_t read(char* buffer, size_t size);
   std::string read(size_t size);
+
+  // Passes file descriptor along with data (SCM_RIGHTS), fd of -1 sends data only
+  void sendFd(std::string_view data, int fd);
+  size_t recvFd(char* buffer, size_t size, int& fd);
 };
 
 } /* namespace xbus */
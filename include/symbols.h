@@ -0,0 +1,44 @@
+#ifndef _XBUS_SYMBOLS_H_
+#define _XBUS_SYMBOLS_H_ 1
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace xbus {
+
+/*
+  Interns names into small integer IDs, dense and starting from 1, 0 means no symbol.
+  IDs are never reused or freed, so names returned by name() stay valid as long as the table.
+  Frames address interned names as '$ID', see Request::objectId.
+*/
+class SymbolTable {
+  mutable std::mutex m_mutex;
+  std::map<std::string, uint32_t, std::less<>> m_ids;
+  std::deque<std::string> m_names; // Index is ID - 1, elements never move
+  size_t m_limit;
+
+ public:
+  SymbolTable(size_t limit = UINT32_MAX);
+  SymbolTable(const SymbolTable&) = delete;
+  ~SymbolTable() = default;
+
+  // Returns ID of name, adding it if it isn't known yet. 0 if the table is full
+  uint32_t intern(std::string_view name);
+  // 0 if name isn't interned
+  uint32_t find(std::string_view name) const;
+  // Empty if ID isn't known
+  std::string_view name(uint32_t id) const;
+
+  size_t size() const;
+  // Names in order of their IDs
+  std::vector<std::string> names() const;
+};
+
+} /* namespace xbus */
+
+#endif /* _XBUS_SYMBOLS_H_ */
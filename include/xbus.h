@@ -7,6 +7,15 @@
 #include <xbus/version.h>
 #include <xbus/object.h>
 #include <xbus/socket.h>
+#include <xbus/buffer.h>
+#include <xbus/frame.h>
+#include <xbus/arena.h>
+#include <xbus/client.h>
+#include <xbus/executor.h>
+#include <xbus/journal.h>
+#include <xbus/symbols.h>
+#include <xbus/scan.h>
+#include <xbus/compress.h>
 
 namespace xbus {} /* namespace xbus */
 
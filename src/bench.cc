@@ -0,0 +1,430 @@
+#include <xbus/xbus.h>
+#include <xbus/compress.h>
+#include <xbus/frame.h>
+#include <xbus/io.h>
+#include <xbus/executor.h>
+#include <mrt/threads/pool.h>
+#include <mrt/threads/task.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Connections read by one event loop in the syscall benchmark, like a busy xbusd
+#define BENCH_CONNECTIONS 64
+// Jobs each job submits in the fan-out workload of the executor benchmark
+#define BENCH_FANOUT 64
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Frames that a backend delivers per syscall, reading from many connections at once and broadcasting to them.
+// Frames are written with plain send(), so that only syscalls made by the reading side are counted
+static bool benchBackend(const char* name, size_t rounds) {
+  std::unique_ptr<xbus::IoBackend> io(xbus::IoBackend::create(name));
+  if (!io) {
+    printf("%-8s %10s\n", name, "unsupported");
+    return true;
+  }
+
+  struct Connection {
+    int writer = -1;
+    xbus::Socket* socket = nullptr;
+    std::unique_ptr<xbus::FrameReader> reader;
+  };
+  std::vector<Connection> connections(BENCH_CONNECTIONS);
+  for (size_t i = 0; i < connections.size(); i++) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+      xbus::error("socketpair() failed");
+      return false;
+    }
+    connections[i].writer = fds[0];
+    connections[i].socket = new xbus::Socket(fds[1]);
+    connections[i].reader = std::make_unique<xbus::FrameReader>(connections[i].socket);
+    io->receive(fds[1], i + 1);
+  }
+
+  size_t total = rounds * connections.size();
+  std::thread writer([&connections, rounds]() {
+    for (size_t round = 0; round < rounds; round++) {
+      std::string frame = "sensor+status#" + std::to_string(round + 1);
+      for (auto& connection : connections) {
+        ::send(connection.writer, frame.c_str(), frame.size() + 1, MSG_NOSIGNAL);
+      }
+    }
+  });
+
+  xbus::IoEvent events[BENCH_CONNECTIONS];
+  size_t received = 0;
+  uint64_t before = xbus::syscallCount();
+  auto start = std::chrono::steady_clock::now();
+  while (received < total) {
+    int count = io->wait(events, BENCH_CONNECTIONS);
+    for (int i = 0; i < count; i++) {
+      auto& connection = connections[events[i].key - 1];
+      if (events[i].readable) {
+        connection.reader->fill();
+      } else if (events[i].size > 0) {
+        connection.reader->push({events[i].data, (size_t) events[i].size});
+      }
+      io->release(events[i]);
+      std::string_view frame;
+      while (connection.reader->tryNext(frame)) {
+        received++;
+      }
+    }
+  }
+  double elapsed = secondsSince(start);
+  uint64_t receiving = xbus::syscallCount() - before;
+  writer.join();
+
+  // Recipients don't read, a few broadcasts fit in their socket buffers
+  std::vector<xbus::Socket*> sockets;
+  for (auto& connection : connections) {
+    sockets.push_back(connection.socket);
+  }
+  size_t broadcasts = 100;
+  before = xbus::syscallCount();
+  for (size_t i = 0; i < broadcasts; i++) {
+    io->broadcast(sockets, "!sensor:status,1");
+  }
+  uint64_t broadcasting = xbus::syscallCount() - before;
+
+  printf("%-8s %10zu %12.3f %12.0f %14.3f\n", name, total, (double) receiving / total, total / elapsed,
+    (double) broadcasting / (broadcasts * sockets.size()));
+
+  for (size_t i = 0; i < connections.size(); i++) {
+    io->remove(connections[i].socket->fd(), i + 1);
+  }
+  io.reset();
+  for (auto& connection : connections) {
+    connection.reader.reset();
+    delete connection.socket;
+    ::close(connection.writer);
+  }
+  return true;
+}
+
+static int benchSyscalls(size_t rounds) {
+  printf("%d connections, %zu frames each\n", BENCH_CONNECTIONS, rounds);
+  printf("%-8s %10s %12s %12s %14s\n", "backend", "frames", "syscalls/in", "frames/s", "syscalls/out");
+  for (auto name : {"epoll", "uring"}) {
+    if (!benchBackend(name, rounds)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static std::atomic<size_t> g_done = 0;
+static xbus::Executor* g_executor = nullptr;
+static mrt::ThreadPool<mrt::Task<void*>>* g_mrtPool = nullptr;
+
+static void countJob(void*) {
+  g_done.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void spawnOnExecutor(void*) {
+  for (int i = 0; i < BENCH_FANOUT; i++) {
+    g_executor->submit(countJob, nullptr);
+  }
+}
+
+static void spawnOnMrt(void*) {
+  for (int i = 0; i < BENCH_FANOUT; i++) {
+    g_mrtPool->addTask({countJob, nullptr});
+  }
+}
+
+// Runs submit() for a batch of jobs and returns jobs finished per second, once all of them are done
+template <typename Submit>
+static double measureJobs(size_t jobs, Submit submit) {
+  g_done = 0;
+  auto start = std::chrono::steady_clock::now();
+  submit();
+  while (g_done.load() < jobs) {
+    std::this_thread::yield();
+  }
+  return jobs / secondsSince(start);
+}
+
+// Tiny jobs submitted from outside the pool, like requests read by an object, and jobs that submit
+// more jobs from a worker, like xbusd handing calls between workers
+static int benchExecutor(size_t jobs) {
+  size_t threads = std::max(std::thread::hardware_concurrency(), 2u);
+  size_t roots = std::max<size_t>(jobs / BENCH_FANOUT, 1);
+  printf("%zu threads, %zu jobs\n", threads, jobs);
+  printf("%-10s %14s %14s\n", "pool", "external/s", "fan-out/s");
+
+  {
+    xbus::Executor executor(threads);
+    g_executor = &executor;
+    double external = measureJobs(jobs, [&executor, jobs]() {
+      for (size_t i = 0; i < jobs; i++) {
+        executor.submit(countJob, nullptr);
+      }
+    });
+    double fanout = measureJobs(roots * BENCH_FANOUT, [&executor, roots]() {
+      for (size_t i = 0; i < roots; i++) {
+        executor.submit(spawnOnExecutor, nullptr);
+      }
+    });
+    printf("%-10s %14.0f %14.0f\n", "executor", external, fanout);
+    executor.finishAll();
+    g_executor = nullptr;
+  }
+
+  {
+    mrt::ThreadPool<mrt::Task<void*>> pool(threads);
+    g_mrtPool = &pool;
+    double external = measureJobs(jobs, [&pool, jobs]() {
+      for (size_t i = 0; i < jobs; i++) {
+        pool.addTask({countJob, nullptr});
+      }
+    });
+    double fanout = measureJobs(roots * BENCH_FANOUT, [&pool, roots]() {
+      for (size_t i = 0; i < roots; i++) {
+        pool.addTask({spawnOnMrt, nullptr});
+      }
+    });
+    printf("%-10s %14.0f %14.0f\n", "mrt", external, fanout);
+    pool.finishAll();
+    g_mrtPool = nullptr;
+  }
+  return 0;
+}
+
+// Frames like ones seen on a busy bus: mostly short calls and replies, some with long arguments
+static std::vector<std::string> sampleFrames() {
+  std::vector<std::string> frames;
+  std::string value(240, 'v'), list;
+  for (int i = 0; i < 100; i++) {
+    list += ",object_" + std::to_string(i);
+  }
+  for (int i = 0; i < 1000; i++) {
+    std::string tag = "#" + std::to_string(i + 1);
+    switch (i % 20) {
+      case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+        frames.push_back("sensor+status" + tag);
+        break;
+      case 8: case 9: case 10: case 11:
+        frames.push_back("$12+$40:" + std::to_string(i) + tag);
+        break;
+      case 12: case 13: case 14:
+        frames.push_back("motor+move:left,12.5,fast,ramp=200,retries=3,profile=smooth?" + tag);
+        break;
+      case 15: case 16:
+        frames.push_back("config-blob=" + value + tag);
+        break;
+      case 17: case 18:
+        frames.push_back((i % 2 ? "OK,SENT" : "MORE,17,chunk") + tag);
+        break;
+      default:
+        frames.push_back("OK" + list + tag);
+        break;
+    }
+  }
+  return frames;
+}
+
+// Parses the sample mix with every frame scanner the CPU supports
+static int benchParse(size_t rounds) {
+  auto frames = sampleFrames();
+  size_t bytes = 0;
+  for (auto& frame : frames) {
+    bytes += frame.size() + 1;
+  }
+  printf("%zu frames of %zu bytes on average, %zu rounds\n", frames.size(), bytes / frames.size(), rounds);
+  printf("%-8s %10s %10s\n", "scanner", "ns/frame", "MB/s");
+
+  xbus::Arena arena;
+  for (auto level : {xbus::ScanLevel::SCALAR, xbus::ScanLevel::SSE2, xbus::ScanLevel::AVX2}) {
+    if (!xbus::setScanLevel(level)) continue;
+    size_t fields = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+      for (auto& frame : frames) {
+        arena.reset();
+        if (xbus::isRequest(frame)) {
+          fields += xbus::RequestView::fromString(frame, &arena).args.size();
+        } else {
+          fields += xbus::ResponseView::fromString(frame, &arena).rest.size();
+        }
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double parsed = (double) frames.size() * rounds;
+    printf("%-8s %10.1f %10.1f\n", xbus::scanLevelName(level), elapsed * 1e9 / parsed, bytes * rounds / elapsed / 1e6);
+    if (!fields) {
+      return 1;
+    }
+  }
+
+  // Frame boundaries: the same frames back to back, as a read buffer holds them
+  std::string buffer;
+  for (auto& frame : frames) {
+    buffer.append(frame.data(), frame.size() + 1);
+  }
+  printf("%-8s %10s %10s\n", "split", "ns/frame", "MB/s");
+  auto split = [&](const char* name, auto find) {
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+      for (size_t offset = 0; offset < buffer.size(); offset = find(offset) + 1) {
+        found++;
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-8s %10.1f %10.1f\n", name, elapsed * 1e9 / found, bytes * rounds / elapsed / 1e6);
+    return found == frames.size() * rounds;
+  };
+  bool ok = split("memchr", [&buffer](size_t from) {
+    return (size_t) ((const char*) memchr(buffer.data() + from, '\0', buffer.size() - from) - buffer.data());
+  });
+  for (auto level : {xbus::ScanLevel::SCALAR, xbus::ScanLevel::SSE2, xbus::ScanLevel::AVX2}) {
+    if (!xbus::setScanLevel(level)) continue;
+    ok = split(xbus::scanLevelName(level), [&buffer](size_t from) {
+      return xbus::findDelimiter(buffer, std::string_view("\0", 1), from);
+    }) && ok;
+  }
+  return ok ? 0 : 1;
+}
+
+// Payload of size bytes, elements of rest joined by ',' as compressResponse() sees them
+static std::vector<std::string> samplePayload(const std::string& kind, size_t size) {
+  std::vector<std::string> rest;
+  std::mt19937 random(size);
+  size_t total = 0;
+  for (size_t i = 0; total < size; i++) {
+    std::string element;
+    if (kind == "config") {
+      element = "motor_" + std::to_string(i % 16) + ".limit_" + std::to_string(i % 7) + "=" + std::to_string(100 + i % 50);
+    } else if (kind == "table") {
+      element = std::to_string(i) + " | sensor_" + std::to_string(i % 32) + " | " + std::to_string(i * 37 % 1000) + ".5 | OK";
+    } else if (kind == "log") {
+      element = "2026-01-01 12:00:" + std::to_string(10 + i % 50) + " INFO worker " + std::to_string(i % 8) + ": request done";
+    } else {
+      element.resize(64);
+      for (auto& c : element) {
+        c = 'A' + random() % 58;
+      }
+    }
+    total += element.size() + 1;
+    rest.push_back(std::move(element));
+  }
+  return rest;
+}
+
+// Compresses and expands repetitive and random payloads of growing size, to show where compression pays off
+static int benchCompress(size_t megabytes) {
+  printf("%-7s %8s %8s %7s %12s %12s\n", "payload", "bytes", "packed", "ratio", "pack MB/s", "expand MB/s");
+  for (auto kind : {"config", "table", "log", "random"}) {
+    for (size_t size : {256, 1024, 4096, 16384, 65536, 262144, 1048576}) {
+      xbus::Response original = {"OK", samplePayload(kind, size)};
+      size_t bytes = original.toString().size();
+      size_t rounds = std::max<size_t>(megabytes * 1000000 / bytes, 1);
+
+      // Responses are consumed, copies of them for every round are made outside of the measured time
+      double compressing = 0, expanding = 0;
+      xbus::Response packed, expanded;
+      for (size_t round = 0; round < rounds; round++) {
+        packed = original;
+        auto start = std::chrono::steady_clock::now();
+        xbus::compressResponse(packed, 0);
+        compressing += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      }
+      for (size_t round = 0; round < rounds; round++) {
+        expanded = packed;
+        auto start = std::chrono::steady_clock::now();
+        xbus::expandResponse(expanded);
+        expanding += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      }
+
+      if (expanded.rest != original.rest) {
+        xbus::error("Payload '%s' of %zu bytes didn't survive the round trip", kind, size);
+        return 1;
+      }
+      // Payloads that don't shrink are sent as they are, there is nothing to expand
+      size_t packedBytes = packed.toString().size();
+      std::string expandSpeed = "-";
+      if (xbus::isCompressed(packed)) {
+        char speed[32];
+        snprintf(speed, sizeof(speed), "%.1f", bytes * rounds / expanding / 1e6);
+        expandSpeed = speed;
+      }
+      printf("%-7s %8zu %8zu %7.2f %12.1f %12s\n", kind, bytes, packedBytes, (double) bytes / packedBytes,
+        bytes * rounds / compressing / 1e6, expandSpeed.c_str());
+    }
+  }
+  return 0;
+}
+
+struct Benchmark {
+  const char* name;
+  int (*run)(size_t arg);
+  size_t arg;
+  const char* help;
+};
+
+static const Benchmark BENCHMARKS[] = {
+  {"syscalls", benchSyscalls, 2000, "syscalls [FRAMES]   - Syscalls per frame of each event loop backend, reading\n"
+                                    "                      64 connections and broadcasting to them (default is 2000)"},
+  {"executor", benchExecutor, 1000000, "executor [JOBS]     - Jobs per second of xbus::Executor and mrt::ThreadPool, submitted\n"
+                                       "                      from outside and from workers (default is 1000000)"},
+  {"parse", benchParse, 2000, "parse [ROUNDS]      - Frame parsing on a mix of frame sizes, with every delimiter\n"
+                              "                      scanner the CPU supports, and splitting frames on '\\0' with\n"
+                              "                      memchr and each scanner (default is 2000 rounds)"},
+  {"compress", benchCompress, 20, "compress [MB]       - Response compression ratio and speed on repetitive and random\n"
+                                 "                      payloads of 256 B to 1 MB (default is 20 MB each)"},
+};
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [BENCHMARK [ARG]]\nRuns every benchmark if none is given\nBenchmarks:\n", argv0);
+  for (auto& benchmark : BENCHMARKS) {
+    fprintf(stderr, "  %s\n", benchmark.help);
+  }
+}
+
+int main(int argc, char** argv) {
+  xbus::setLogLevel(xbus::LogLevel::WARNING);
+  if (argc > 3 || (argc > 1 && (std::string(argv[1]) == "-h" || std::string(argv[1]) == "help"))) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  bool found = false;
+  for (auto& benchmark : BENCHMARKS) {
+    if (argc > 1 && argv[1] != std::string(benchmark.name)) continue;
+    found = true;
+    size_t arg = benchmark.arg;
+    if (argc > 2) {
+      try {
+        arg = std::stoul(argv[2]);
+      } catch (...) {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    printf("== %s\n", benchmark.name);
+    failed += benchmark.run(arg);
+  }
+  if (!found) {
+    xbus::error("Unknown benchmark: '%s'", argv[1]);
+    usage(argv[0]);
+    return 1;
+  }
+  return failed;
+}
@@ -0,0 +1,38 @@
+#include <xbus/arena.h>
+#include <cstdint>
+
+xbus::Arena::Arena(BufferPool& pool) : m_pool(pool) {
+  m_slabs.reserve(4);
+}
+
+void xbus::Arena::reset() {
+  if (m_slabs.size() > 1) {
+    m_slabs.erase(m_slabs.begin() + 1, m_slabs.end());
+  }
+  m_offset = 0;
+}
+
+void* xbus::Arena::do_allocate(size_t bytes, size_t alignment) {
+  if (!m_slabs.empty()) {
+    Buffer& slab = m_slabs.back();
+    uintptr_t base = (uintptr_t) slab.data();
+    uintptr_t aligned = (base + m_offset + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    if (aligned + bytes <= base + slab.size()) {
+      m_offset = aligned + bytes - base;
+      return (void*) aligned;
+    }
+  }
+
+  m_slabs.push_back(m_pool.acquire(bytes + alignment));
+  Buffer& slab = m_slabs.back();
+  uintptr_t base = (uintptr_t) slab.data();
+  uintptr_t aligned = (base + alignment - 1) & ~(uintptr_t) (alignment - 1);
+  m_offset = aligned + bytes - base;
+  return (void*) aligned;
+}
+
+void xbus::Arena::do_deallocate(void* p, size_t bytes, size_t alignment) {}
+
+bool xbus::Arena::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+  return this == &other;
+}
@@ -0,0 +1,101 @@
+#include <xbus/buffer.h>
+#include <utility>
+
+xbus::Buffer::Buffer(BufferPool* pool, char* data, size_t size) : m_pool(pool), m_data(data), m_size(size) {}
+
+xbus::Buffer::Buffer(Buffer&& rhs) noexcept : m_pool(rhs.m_pool), m_data(rhs.m_data), m_size(rhs.m_size) {
+  rhs.m_pool = nullptr;
+  rhs.m_data = nullptr;
+  rhs.m_size = 0;
+}
+
+xbus::Buffer::~Buffer() {
+  release();
+}
+
+xbus::Buffer& xbus::Buffer::operator=(Buffer&& rhs) noexcept {
+  if (this != &rhs) {
+    release();
+    std::swap(m_pool, rhs.m_pool);
+    std::swap(m_data, rhs.m_data);
+    std::swap(m_size, rhs.m_size);
+  }
+  return *this;
+}
+
+char* xbus::Buffer::data() {
+  return m_data;
+}
+
+const char* xbus::Buffer::data() const {
+  return m_data;
+}
+
+size_t xbus::Buffer::size() const {
+  return m_size;
+}
+
+bool xbus::Buffer::empty() const {
+  return m_data == nullptr;
+}
+
+void xbus::Buffer::release() {
+  if (!m_data) return;
+  if (m_pool) {
+    m_pool->release(m_data, m_size);
+  } else {
+    delete [] m_data;
+  }
+  m_pool = nullptr;
+  m_data = nullptr;
+  m_size = 0;
+}
+
+xbus::BufferPool::BufferPool(size_t slabSize, size_t maxFree) : m_slabSize(slabSize), m_maxFree(maxFree) {
+  m_free.reserve(maxFree);
+}
+
+xbus::BufferPool::~BufferPool() {
+  for (auto slab : m_free) {
+    delete [] slab;
+  }
+}
+
+size_t xbus::BufferPool::slabSize() const {
+  return m_slabSize;
+}
+
+xbus::Buffer xbus::BufferPool::acquire() {
+  {
+    std::unique_lock lock(m_mutex);
+    if (!m_free.empty()) {
+      char* slab = m_free.back();
+      m_free.pop_back();
+      return {this, slab, m_slabSize};
+    }
+  }
+  return {this, new char[m_slabSize], m_slabSize};
+}
+
+xbus::Buffer xbus::BufferPool::acquire(size_t size) {
+  if (size <= m_slabSize) {
+    return acquire();
+  }
+  return {nullptr, new char[size], size};
+}
+
+void xbus::BufferPool::release(char* data, size_t size) {
+  if (size == m_slabSize) {
+    std::unique_lock lock(m_mutex);
+    if (m_free.size() < m_maxFree) {
+      m_free.push_back(data);
+      return;
+    }
+  }
+  delete [] data;
+}
+
+xbus::BufferPool& xbus::BufferPool::global() {
+  static BufferPool pool;
+  return pool;
+}
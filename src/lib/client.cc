@@ -0,0 +1,155 @@
+#include <xbus/client.h>
+#include <xbus/exceptions.h>
+#include <xbus/compress.h>
+#include <algorithm>
+#include <unistd.h>
+
+xbus::ResponseStream::ResponseStream(Client* client, int tag, const std::string& direct)
+  : m_client(client), m_tag(tag), m_direct(direct) {}
+
+bool xbus::ResponseStream::next(Response& chunk) {
+  if (m_done) return false;
+  chunk = m_client->receive(m_tag, m_direct);
+  if (chunk.status == STATUS_MORE) {
+    return true;
+  }
+  m_result = std::move(chunk);
+  m_done = true;
+  return false;
+}
+
+const xbus::Response& xbus::ResponseStream::result() const {
+  return m_result;
+}
+
+xbus::Client::Client(const std::string& path, int connectTimeout) : m_socket(new Socket(path)) {
+  m_socket->connect(connectTimeout);
+  m_reader = new FrameReader(m_socket);
+}
+
+xbus::Client::~Client() {
+  for (auto& p : m_direct) {
+    delete p.second.reader;
+    delete p.second.socket;
+  }
+  delete m_reader;
+  delete m_socket;
+}
+
+xbus::Response xbus::Client::call(Request request) {
+  ResponseStream responses = stream(std::move(request));
+  Response chunk;
+  while (responses.next(chunk)) {}
+  return responses.result();
+}
+
+xbus::ResponseStream xbus::Client::stream(Request request) {
+  request.tag = ++m_nextTag;
+  auto frame = request.toString();
+  if (request.action == ACTION_PROPERTY && !m_direct.empty()) {
+    if (auto itr = m_direct.find(request.object); itr != m_direct.end()) {
+      try {
+        itr->second.socket->writeFrame(frame);
+        return ResponseStream(this, request.tag, request.object);
+      } catch (IOException& e) {
+        // Object closed the link, it is called through xbusd from now on
+        closeDirect(request.object);
+      }
+    }
+  }
+  m_socket->writeFrame(frame);
+  return ResponseStream(this, request.tag);
+}
+
+std::vector<uint32_t> xbus::Client::resolve(const std::vector<std::string>& names) {
+  Request request;
+  request.action = ACTION_PROPERTY;
+  request.subject = "resolve";
+  request.args = names;
+  Response response = call(std::move(request));
+
+  std::vector<uint32_t> ids;
+  if (response.status != "OK" || response.rest.size() != names.size()) {
+    return ids;
+  }
+  for (auto& id : response.rest) {
+    ids.push_back(std::stoul(id));
+  }
+  return ids;
+}
+
+bool xbus::Client::enableCompression() {
+  Request request;
+  request.action = ACTION_PROPERTY;
+  request.subject = "version";
+  request.args = {XBUS_COMPRESSION};
+  Response response = call(std::move(request));
+  m_compression = response.status == "OK" &&
+    std::find(response.rest.begin(), response.rest.end(), XBUS_COMPRESSION) != response.rest.end();
+  return m_compression;
+}
+
+bool xbus::Client::connectDirect(const std::string& object) {
+  if (m_direct.count(object)) {
+    return true;
+  }
+
+  // Asked over a connection of its own, so that the descriptor doesn't arrive in the middle of buffered frames
+  Socket broker(m_socket->path());
+  broker.connect();
+  broker.writeFrame("+connect_direct:" + object);
+  char buffer[XBUS_READ_SIZE];
+  int fd = -1;
+  size_t size = broker.recvFd(buffer, sizeof(buffer), fd);
+  auto response = Response::fromString(std::string_view(buffer, size && !buffer[size - 1] ? size - 1 : size));
+  if (response.status != "OK" || fd == -1) {
+    if (fd != -1) ::close(fd);
+    return false;
+  }
+
+  Socket* socket = new Socket(fd);
+  m_direct[object] = {socket, new FrameReader(socket)};
+  return true;
+}
+
+void xbus::Client::closeDirect(const std::string& object) {
+  auto itr = m_direct.find(object);
+  if (itr != m_direct.end()) {
+    delete itr->second.reader;
+    delete itr->second.socket;
+    m_direct.erase(itr);
+  }
+}
+
+xbus::Response xbus::Client::receive(int tag, const std::string& direct) {
+  FrameReader* reader = m_reader;
+  if (!direct.empty()) {
+    auto itr = m_direct.find(direct);
+    if (itr == m_direct.end()) {
+      return {"ERR", {"OBJECT GONE"}};
+    }
+    reader = itr->second.reader;
+  }
+
+  std::string_view frame;
+  try {
+    while (reader->next(frame)) {
+      auto response = Response::fromString(frame);
+      if (response.tag == tag) {
+        // Only responses that came through xbusd after negotiation may be compressed,
+        // a payload of anyone else that happens to start with the marker is left alone
+        if (m_compression && direct.empty()) {
+          expandResponse(response);
+        }
+        return response;
+      }
+    }
+  } catch (IOException& e) {
+    if (direct.empty()) throw;
+  }
+  if (!direct.empty()) {
+    closeDirect(direct);
+    return {"ERR", {"OBJECT GONE"}};
+  }
+  throw IOException("connection closed");
+}
@@ -0,0 +1,232 @@
+#include <xbus/compress.h>
+#include <xbus/log.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_MAX_RATIO 256 // Bound on expanded size, so that corrupt input can't make us allocate gigabytes
+#define LZ_WILD_COPY 16  // Short copies are done in fixed chunks, output has that much slack for overruns
+
+#define ESCAPE '\x01' // Escaped byte follows, xor-ed with ESCAPE_MASK
+#define ESCAPE_MASK 0x40
+#define FLIP_MASK 0x80 // Every byte is flipped first, so that ',' of text in literals doesn't need escaping
+
+static inline uint32_t load32(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t hash32(uint32_t value) {
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths past what fits into a token nibble are continued in bytes of 255
+static char* putLength(char* out, size_t length) {
+  for (; length >= 255; length -= 255) {
+    *out++ = (char) 255;
+  }
+  *out++ = (char) length;
+  return out;
+}
+
+static bool getLength(std::string_view data, size_t& pos, size_t& length) {
+  uint8_t byte;
+  do {
+    if (pos == data.size()) return false;
+    byte = data[pos++];
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Match of 0 ends the stream, with literals only
+static char* putSequence(char* out, std::string_view literals, size_t offset, size_t match) {
+  size_t extra = match ? match - LZ_MIN_MATCH : 0;
+  *out++ = (char) (std::min<size_t>(literals.size(), 15) << 4 | std::min<size_t>(extra, 15));
+  if (literals.size() >= 15) {
+    out = putLength(out, literals.size() - 15);
+  }
+  memcpy(out, literals.data(), literals.size());
+  out += literals.size();
+  if (!match) return out;
+  *out++ = (char) (offset & 0xff);
+  *out++ = (char) (offset >> 8);
+  if (extra >= 15) {
+    out = putLength(out, extra - 15);
+  }
+  return out;
+}
+
+std::string xbus::lz::compress(std::string_view data) {
+  // Worst case is all literals, with a length byte per 255 of them
+  std::string result(data.size() + data.size() / 255 + 16, '\0');
+  char* out = result.data();
+  for (size_t size = data.size(); ; size >>= 7) {
+    *out++ = (char) ((size & 0x7f) | (size > 0x7f ? 0x80 : 0));
+    if (size <= 0x7f) break;
+  }
+
+  std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0); // Position + 1 of last sequence with that hash
+  const char* in = data.data();
+  size_t anchor = 0, i = 0;
+  while (i + LZ_MIN_MATCH <= data.size()) {
+    uint32_t sequence = load32(in + i);
+    uint32_t& slot = table[hash32(sequence)];
+    size_t candidate = slot;
+    slot = i + 1;
+    if (!candidate || i - (candidate - 1) > LZ_MAX_OFFSET || load32(in + candidate - 1) != sequence) {
+      // Incompressible data is skipped faster the longer it goes
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+    size_t from = candidate - 1, length = LZ_MIN_MATCH;
+    while (i + length < data.size() && in[from + length] == in[i + length]) {
+      length++;
+    }
+    out = putSequence(out, data.substr(anchor, i - anchor), i - from, length);
+    i += length;
+    anchor = i;
+  }
+  if (anchor < data.size() || data.empty()) {
+    out = putSequence(out, data.substr(anchor), 0, 0);
+  }
+  result.resize(out - result.data());
+  return result;
+}
+
+bool xbus::lz::decompress(std::string_view data, std::string& result) {
+  size_t pos = 0, size = 0;
+  for (int shift = 0; ; shift += 7) {
+    if (pos == data.size() || shift > 56) return false;
+    uint8_t byte = data[pos++];
+    size |= (size_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) break;
+  }
+  if (size > data.size() * LZ_MAX_RATIO) {
+    return false;
+  }
+
+  result.resize(size + LZ_WILD_COPY);
+  char* out = result.data();
+  size_t written = 0;
+  while (pos < data.size()) {
+    uint8_t token = data[pos++];
+    size_t literals = token >> 4;
+    if (literals == 15 && !getLength(data, pos, literals)) return false;
+    if (literals > data.size() - pos || literals > size - written) return false;
+    if (literals < LZ_WILD_COPY && data.size() - pos >= LZ_WILD_COPY) {
+      memcpy(out + written, data.data() + pos, LZ_WILD_COPY);
+    } else {
+      memcpy(out + written, data.data() + pos, literals);
+    }
+    pos += literals;
+    written += literals;
+    if (pos == data.size()) break;
+
+    if (data.size() - pos < 2) return false;
+    size_t offset = (uint8_t) data[pos] | (uint8_t) data[pos + 1] << 8;
+    pos += 2;
+    size_t length = token & 15;
+    if (length == 15 && !getLength(data, pos, length)) return false;
+    length += LZ_MIN_MATCH;
+    if (!offset || offset > written || length > size - written) return false;
+    if (offset >= LZ_WILD_COPY) {
+      for (size_t i = 0; i < length; i += LZ_WILD_COPY) {
+        memcpy(out + written + i, out + written + i - offset, LZ_WILD_COPY);
+      }
+      written += length;
+    } else {
+      // Byte by byte, as the match overlaps what it produces
+      for (size_t i = 0; i < length; i++, written++) {
+        out[written] = out[written - offset];
+      }
+    }
+  }
+  result.resize(size);
+  return written == size;
+}
+
+static inline bool needsEscape(char c) {
+  return c == '\0' || c == ',' || c == '#' || c == ESCAPE;
+}
+
+bool xbus::compressResponse(Response& response, size_t threshold) {
+  if (response.rest.empty()) {
+    return false;
+  }
+  // Payload that already starts with the marker is always packed, or it would be taken for compressed
+  bool marked = isCompressed(response);
+  size_t size = response.rest.size() - 1;
+  for (auto& element : response.rest) {
+    size += element.size();
+  }
+  if (size < threshold && !marked) {
+    return false;
+  }
+
+  std::string payload;
+  payload.reserve(size);
+  for (size_t i = 0; i < response.rest.size(); i++) {
+    if (i) payload += ',';
+    payload += response.rest[i];
+  }
+
+  std::string packed = lz::compress(payload);
+  std::string element(1, XBUS_COMPRESS_MARKER);
+  element.reserve(packed.size() + packed.size() / 32 + 1);
+  for (char c : packed) {
+    c ^= FLIP_MASK;
+    if (needsEscape(c)) {
+      element += ESCAPE;
+      c ^= ESCAPE_MASK;
+    }
+    element += c;
+  }
+  if (element.size() >= size && !marked) {
+    return false;
+  }
+  response.rest.assign(1, std::move(element));
+  return true;
+}
+
+bool xbus::isCompressed(const Response& response) {
+  return response.rest.size() == 1 && !response.rest[0].empty() && response.rest[0][0] == XBUS_COMPRESS_MARKER;
+}
+
+bool xbus::expandResponse(Response& response) {
+  if (!isCompressed(response)) {
+    return true;
+  }
+  auto& element = response.rest[0];
+  std::string packed;
+  packed.reserve(element.size());
+  for (size_t i = 1; i < element.size(); i++) {
+    char c = element[i];
+    if (c == ESCAPE) {
+      if (++i == element.size()) return false;
+      c = element[i] ^ ESCAPE_MASK;
+    }
+    packed += c ^ FLIP_MASK;
+  }
+
+  std::string payload;
+  if (!lz::decompress(packed, payload)) {
+    error("Response parsing failed: corrupt compressed payload");
+    return false;
+  }
+  std::vector<std::string> rest;
+  size_t start = 0;
+  for (size_t i = 0; i <= payload.size(); i++) {
+    if (i == payload.size() || payload[i] == ',') {
+      rest.emplace_back(payload, start, i - start);
+      start = i + 1;
+    }
+  }
+  response.rest = std::move(rest);
+  return true;
+}
@@ -0,0 +1,469 @@
+#include <xbus/executor.h>
+#include <xbus/utils.h>
+#include <xbus/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <pthread.h>
+#include <sched.h>
+
+#define EXECUTOR_DEQUE_CAPACITY 256
+
+static thread_local xbus::Executor* t_executor = nullptr;
+static thread_local size_t t_worker = 0;
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+namespace {
+
+/*
+  Chase-Lev deque (with C11 memory model from Le et al., 2013).
+  Owner pushes and pops at the bottom, thieves take from the top.
+  Arrays replaced by growth are kept until destruction, as thieves may still read them.
+*/
+class Deque {
+  struct Slot {
+    std::atomic<xbus::Executor::Function> function;
+    std::atomic<void*> arg;
+  };
+
+  struct Array {
+    int64_t capacity;
+    std::unique_ptr<Slot[]> slots;
+
+    Array(int64_t capacity) : capacity(capacity), slots(new Slot[capacity]) {}
+
+    void put(int64_t index, const xbus::Executor::Job& job) {
+      Slot& slot = slots[index & (capacity - 1)];
+      slot.function.store(job.function, std::memory_order_relaxed);
+      slot.arg.store(job.arg, std::memory_order_relaxed);
+    }
+
+    xbus::Executor::Job get(int64_t index) const {
+      Slot& slot = slots[index & (capacity - 1)];
+      return {slot.function.load(std::memory_order_relaxed), slot.arg.load(std::memory_order_relaxed)};
+    }
+  };
+
+  std::atomic<int64_t> m_top = 0;
+  std::atomic<int64_t> m_bottom = 0;
+  std::atomic<Array*> m_array;
+  std::vector<std::unique_ptr<Array>> m_arrays;
+
+ public:
+  Deque() {
+    m_arrays.emplace_back(new Array(EXECUTOR_DEQUE_CAPACITY));
+    m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  size_t size() const {
+    int64_t size = m_bottom.load(std::memory_order_relaxed) - m_top.load(std::memory_order_relaxed);
+    return size > 0 ? size : 0;
+  }
+
+  void push(const xbus::Executor::Job& job) {
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+    int64_t top = m_top.load(std::memory_order_acquire);
+    Array* array = m_array.load(std::memory_order_relaxed);
+    if (bottom - top > array->capacity - 1) {
+      array = grow(array, top, bottom);
+    }
+    array->put(bottom, job);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  bool pop(xbus::Executor::Job& job) {
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+    Array* array = m_array.load(std::memory_order_relaxed);
+    m_bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = m_top.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+      m_bottom.store(bottom + 1, std::memory_order_relaxed);
+      return false;
+    }
+    job = array->get(bottom);
+    if (top == bottom) {
+      // Last job, racing with thieves
+      bool won = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      m_bottom.store(bottom + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  bool steal(xbus::Executor::Job& job) {
+    int64_t top = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = m_bottom.load(std::memory_order_acquire);
+    if (top >= bottom) {
+      return false;
+    }
+    Array* array = m_array.load(std::memory_order_acquire);
+    job = array->get(top);
+    return m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+  }
+
+ private:
+  Array* grow(Array* array, int64_t top, int64_t bottom) {
+    Array* bigger = new Array(array->capacity * 2);
+    for (int64_t i = top; i < bottom; i++) {
+      bigger->put(i, array->get(i));
+    }
+    m_arrays.emplace_back(bigger);
+    m_array.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+};
+
+} /* namespace */
+
+struct xbus::Executor::Worker {
+  Deque deque;
+  std::mutex inboxMutex;
+  std::deque<Job> inbox; // Jobs submitted from outside of the executor
+  std::atomic<size_t> inboxSize = 0;
+  std::atomic<int64_t> jobStart = 0; // Steady clock nanoseconds, 0 when idle
+  int urgentRun = 0; // High priority jobs taken in a row
+  std::thread thread;
+  bool running = false; // Guarded by m_resizeMutex
+};
+
+static int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+xbus::Executor::Executor(size_t threads, const std::vector<int>& cpus, int spin, size_t maxThreads)
+  : m_cpus(cpus), m_spin(spin) {
+  if (!threads) {
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  m_minThreads = threads;
+  for (size_t i = 0; i < std::max(threads, maxThreads); i++) {
+    m_workers.emplace_back(new Worker);
+  }
+  resize(threads);
+  if (maxThreads > threads) {
+    m_monitor = std::thread(&Executor::adapt, this);
+  }
+}
+
+xbus::Executor::~Executor() {
+  finishAll();
+}
+
+size_t xbus::Executor::size() const {
+  return m_active;
+}
+
+xbus::Executor::Stats xbus::Executor::stats() const {
+  return {m_active, m_minThreads, m_workers.size(), m_busy, queued(), m_jobs, m_latencyNs / 1000};
+}
+
+void xbus::Executor::submit(Function function, void* arg, Priority priority) {
+  if (priority == HIGH) {
+    {
+      std::unique_lock lock(m_urgentMutex);
+      m_urgent.push_back({function, arg});
+      m_urgentSize++;
+    }
+    // Doesn't wait for the next sizing tick if nobody can take it
+    if (m_monitor.joinable() && m_busy >= m_active) {
+      m_monitorWakeup.notify_one();
+    }
+  } else if (t_executor == this) {
+    m_workers[t_worker]->deque.push({function, arg});
+  } else {
+    Worker& worker = *m_workers[m_nextInbox++ % m_active];
+    std::unique_lock lock(worker.inboxMutex);
+    worker.inbox.push_back({function, arg});
+    worker.inboxSize++;
+  }
+  wake();
+}
+
+void xbus::Executor::resize(size_t threads) {
+  std::unique_lock lock(m_resizeMutex);
+  threads = std::clamp(threads, m_minThreads, m_workers.size());
+  if (m_stopping || threads == m_active) return;
+
+  size_t active = m_active;
+  m_active = threads;
+  if (threads < active) {
+    // Workers above the limit retire once their queues are empty
+    std::unique_lock parkLock(m_parkMutex);
+    m_parked.notify_all();
+    return;
+  }
+  for (size_t i = active; i < threads; i++) {
+    Worker& worker = *m_workers[i];
+    if (worker.running) continue;
+    if (worker.thread.joinable()) {
+      worker.thread.join();
+    }
+    worker.running = true;
+    worker.thread = std::thread(&Executor::run, this, i);
+  }
+}
+
+void xbus::Executor::finishAll() {
+  {
+    std::unique_lock lock(m_parkMutex);
+    if (m_stopping) return;
+    m_stopping = true;
+  }
+  m_parked.notify_all();
+  if (m_monitor.joinable()) {
+    {
+      std::unique_lock lock(m_resizeMutex);
+      m_monitorWakeup.notify_all();
+    }
+    m_monitor.join();
+  }
+  {
+    // Waits for resize in progress, no worker is started after that
+    std::unique_lock lock(m_resizeMutex);
+  }
+  for (auto& worker : m_workers) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+std::vector<int> xbus::Executor::parseCpus(const std::string& str) {
+  std::vector<int> cpus;
+  for (auto& range : splitString(str, ',')) {
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+void xbus::Executor::run(size_t index) {
+  t_executor = this;
+  t_worker = index;
+
+  if (!m_cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(m_cpus[index % m_cpus.size()], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+      xbus::warning("failed to pin worker %zu to cpu %d", index, m_cpus[index % m_cpus.size()]);
+    }
+  }
+
+  Worker& self = *m_workers[index];
+  int idle = 0;
+  Job job;
+  while (1) {
+    if (take(index, job)) {
+      idle = 0;
+      m_busy++;
+      int64_t start = nowNs();
+      self.jobStart = start;
+      job.function(job.arg);
+      uint64_t ns = nowNs() - start;
+      self.jobStart = 0;
+      // Updates from concurrent workers may be lost, it's only an estimate
+      uint64_t average = m_latencyNs.load(std::memory_order_relaxed);
+      m_latencyNs.store(average - average / 8 + ns / 8, std::memory_order_relaxed);
+      m_jobs++;
+      m_busy--;
+      continue;
+    }
+    if (index >= m_active && retire(index)) {
+      return;
+    }
+    if (idle < m_spin) {
+      idle++;
+      cpuRelax();
+      continue;
+    }
+    {
+      std::unique_lock lock(m_parkMutex);
+      if (m_stopping && !hasWork()) break;
+    }
+    park(index);
+    idle = 0;
+  }
+}
+
+// Grows the pool when workers can't keep up, shrinks it when some stay idle
+void xbus::Executor::adapt() {
+  int idleIntervals = 0;
+  std::unique_lock lock(m_resizeMutex);
+  while (!m_stopping) {
+    m_monitorWakeup.wait_for(lock, std::chrono::milliseconds(XBUS_EXECUTOR_ADAPT_INTERVAL));
+    if (m_stopping) break;
+
+    size_t active = m_active, busy = m_busy, waiting = queued();
+    size_t target = active;
+    if (waiting && busy >= active) {
+      idleIntervals = 0;
+      if (m_urgentSize || active < std::thread::hardware_concurrency() || m_latencyNs / 1000 >= XBUS_EXECUTOR_BLOCKING_US || blocked()) {
+        target = active + std::max<size_t>(1, std::min(waiting, active));
+      }
+    } else if (!waiting && busy + 1 < active) {
+      if (++idleIntervals >= XBUS_EXECUTOR_SHRINK_AFTER) {
+        idleIntervals = 0;
+        target = active - 1;
+      }
+    } else {
+      idleIntervals = 0;
+    }
+
+    if (target != active) {
+      lock.unlock();
+      resize(target);
+      lock.lock();
+    }
+  }
+}
+
+// True if some job has been running for longer than a blocking one would
+bool xbus::Executor::blocked() const {
+  int64_t since = nowNs() - (int64_t) XBUS_EXECUTOR_BLOCKING_US * 1000;
+  for (auto& worker : m_workers) {
+    int64_t start = worker->jobStart;
+    if (start && start < since) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Retired worker leaves once nothing is left in its queues
+bool xbus::Executor::retire(size_t index) {
+  Worker& self = *m_workers[index];
+  std::unique_lock lock(m_resizeMutex);
+  if (index < m_active || m_stopping || !self.deque.empty() || self.inboxSize) {
+    return false;
+  }
+  self.running = false;
+  return true;
+}
+
+// High priority lane first (unless a normal job is due), then own deque, own inbox, and other workers
+bool xbus::Executor::take(size_t index, Job& job) {
+  Worker& self = *m_workers[index];
+  if (self.urgentRun < XBUS_EXECUTOR_PRIORITY_WEIGHT && takeUrgent(job)) {
+    self.urgentRun++;
+    return true;
+  }
+  self.urgentRun = 0;
+
+  if (self.deque.pop(job)) {
+    return true;
+  }
+
+  if (self.inboxSize) {
+    std::unique_lock lock(self.inboxMutex);
+    for (auto& queued : self.inbox) {
+      self.deque.push(queued);
+    }
+    self.inboxSize -= self.inbox.size();
+    self.inbox.clear();
+    lock.unlock();
+    if (self.deque.pop(job)) {
+      return true;
+    }
+  }
+
+  // Retired slots are checked too, jobs may have been submitted to them while they were leaving
+  for (size_t i = 1; i < m_workers.size(); i++) {
+    Worker& victim = *m_workers[(index + i) % m_workers.size()];
+    if (victim.deque.steal(job)) {
+      return true;
+    }
+    // Inbox of a worker that is busy or parked
+    if (victim.inboxSize) {
+      std::unique_lock lock(victim.inboxMutex, std::try_to_lock);
+      if (lock.owns_lock() && !victim.inbox.empty()) {
+        job = victim.inbox.front();
+        victim.inbox.pop_front();
+        victim.inboxSize--;
+        return true;
+      }
+    }
+  }
+  return takeUrgent(job);
+}
+
+bool xbus::Executor::takeUrgent(Job& job) {
+  if (!m_urgentSize) {
+    return false;
+  }
+  std::unique_lock lock(m_urgentMutex);
+  if (m_urgent.empty()) {
+    return false;
+  }
+  job = m_urgent.front();
+  m_urgent.pop_front();
+  m_urgentSize--;
+  return true;
+}
+
+bool xbus::Executor::hasWork() const {
+  if (m_urgentSize) {
+    return true;
+  }
+  for (auto& worker : m_workers) {
+    if (worker->inboxSize || !worker->deque.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t xbus::Executor::queued() const {
+  size_t count = m_urgentSize;
+  for (auto& worker : m_workers) {
+    count += worker->inboxSize + worker->deque.size();
+  }
+  return count;
+}
+
+void xbus::Executor::park(size_t index) {
+  std::unique_lock lock(m_parkMutex);
+  m_sleeping++;
+  // Pairs with the fence in wake(): either the job is seen here, or the sleeper is seen there
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!hasWork() && !m_stopping && index < m_active) {
+    m_parked.wait(lock, [this, index]() { return m_wakeups > 0 || m_stopping || index >= m_active; });
+    if (m_wakeups > 0) {
+      m_wakeups--;
+    }
+  }
+  m_sleeping--;
+}
+
+void xbus::Executor::wake() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_sleeping.load() == 0) {
+    return;
+  }
+  {
+    std::unique_lock lock(m_parkMutex);
+    if (m_wakeups >= m_sleeping) return;
+    m_wakeups++;
+  }
+  m_parked.notify_one();
+}
@@ -0,0 +1,557 @@
+#include <xbus/io.h>
+#include <xbus/exceptions.h>
+#include <xbus/log.h>
+#include <xbus/journal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define URING_ENTRIES      256
+#define URING_BUFFERS      256
+#define URING_BUFFER_SIZE  4096
+#define URING_SEND_ENTRIES 64
+#define URING_IGNORE_KEY   (~0ull) // Completions of cancellations and provided buffers
+
+static std::atomic<uint64_t> s_syscalls = 0;
+
+uint64_t xbus::syscallCount() {
+  return s_syscalls.load(std::memory_order_relaxed);
+}
+
+void xbus::countSyscalls(uint64_t count) {
+  s_syscalls.fetch_add(count, std::memory_order_relaxed);
+}
+
+void xbus::IoBackend::release(const IoEvent& event) {}
+
+bool xbus::IoBackend::settled() {
+  return true;
+}
+
+void xbus::IoBackend::broadcast(const std::vector<Socket*>& sockets, std::string_view frame) {
+  for (auto socket : sockets) {
+    try {
+      socket->writeFrame(frame);
+    } catch (IOException& e) {
+      warning("broadcast to %d failed", socket->fd());
+    }
+  }
+}
+
+namespace {
+
+class EpollBackend : public xbus::IoBackend {
+  int m_fd;
+
+  void control(int op, int fd, uint32_t events, uint64_t key) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.u64 = key;
+    xbus::countSyscalls();
+    if (epoll_ctl(m_fd, op, fd, &event) == -1 && op != EPOLL_CTL_DEL) {
+      throw xbus::IOException("epoll_ctl failed");
+    }
+  }
+
+ public:
+  EpollBackend() : m_fd(epoll_create1(EPOLL_CLOEXEC)) {}
+
+  ~EpollBackend() {
+    close(m_fd);
+  }
+
+  bool valid() const {
+    return m_fd != -1;
+  }
+
+  const char* name() const override {
+    return "epoll";
+  }
+
+  void watch(int fd, uint64_t key) override {
+    control(EPOLL_CTL_ADD, fd, EPOLLIN, key);
+  }
+
+  void receive(int fd, uint64_t key) override {
+    control(EPOLL_CTL_ADD, fd, EPOLLIN, key);
+  }
+
+  void pause(int fd, uint64_t key) override {
+    control(EPOLL_CTL_MOD, fd, 0, key);
+  }
+
+  void resume(int fd, uint64_t key) override {
+    control(EPOLL_CTL_MOD, fd, EPOLLIN, key);
+  }
+
+  void remove(int fd, uint64_t key) override {
+    control(EPOLL_CTL_DEL, fd, 0, key);
+  }
+
+  int wait(xbus::IoEvent* events, int max) override {
+    epoll_event ready[max];
+    xbus::countSyscalls();
+    int count = epoll_wait(m_fd, ready, max, -1);
+    if (count == -1) {
+      if (errno == EINTR) return 0;
+      throw xbus::IOException("epoll_wait failed");
+    }
+    for (int i = 0; i < count; i++) {
+      events[i] = {};
+      events[i].key = ready[i].data.u64;
+      events[i].readable = true;
+    }
+    return count;
+  }
+};
+
+// Submission and completion queues of one io_uring instance, without liburing
+class Ring {
+  int m_fd = -1;
+  unsigned m_entries = 0;
+  void* m_sqRing = MAP_FAILED;
+  void* m_cqRing = MAP_FAILED;
+  size_t m_sqRingSize = 0;
+  size_t m_cqRingSize = 0;
+  io_uring_sqe* m_sqes = (io_uring_sqe*) MAP_FAILED;
+  unsigned* m_sqHead;
+  unsigned* m_sqTail;
+  unsigned* m_sqMask;
+  unsigned* m_sqArray;
+  unsigned* m_cqHead;
+  unsigned* m_cqTail;
+  unsigned* m_cqMask;
+  io_uring_cqe* m_cqes;
+  unsigned m_localTail = 0;
+
+ public:
+  Ring() = default;
+  Ring(const Ring&) = delete;
+
+  ~Ring() {
+    if (m_sqes != MAP_FAILED) munmap(m_sqes, m_entries * sizeof(io_uring_sqe));
+    if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+    if (m_sqRing != MAP_FAILED) munmap(m_sqRing, m_sqRingSize);
+    if (m_fd != -1) close(m_fd);
+  }
+
+  bool init(unsigned entries) {
+    io_uring_params params = {};
+    m_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (m_fd == -1) {
+      return false;
+    }
+    m_entries = params.sq_entries;
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) return false;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      m_cqRing = m_sqRing;
+    } else {
+      m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+      if (m_cqRing == MAP_FAILED) return false;
+    }
+    m_sqes = (io_uring_sqe*) mmap(nullptr, m_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) return false;
+
+    char* sq = (char*) m_sqRing;
+    char* cq = (char*) m_cqRing;
+    m_sqHead = (unsigned*) (sq + params.sq_off.head);
+    m_sqTail = (unsigned*) (sq + params.sq_off.tail);
+    m_sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    m_sqArray = (unsigned*) (sq + params.sq_off.array);
+    m_cqHead = (unsigned*) (cq + params.cq_off.head);
+    m_cqTail = (unsigned*) (cq + params.cq_off.tail);
+    m_cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+    m_localTail = *m_sqTail;
+    return true;
+  }
+
+  int fd() const {
+    return m_fd;
+  }
+
+  // Returns nullptr if submission queue is full
+  io_uring_sqe* sqe() {
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_localTail - head >= m_entries) {
+      return nullptr;
+    }
+    unsigned index = m_localTail & *m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    m_sqArray[index] = index;
+    m_localTail++;
+    return sqe;
+  }
+
+  // Makes queued entries visible to the kernel
+  void publish() {
+    __atomic_store_n(m_sqTail, m_localTail, __ATOMIC_RELEASE);
+  }
+
+  int enter(unsigned submit, unsigned wait) {
+    xbus::countSyscalls();
+    int result = syscall(__NR_io_uring_enter, m_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (result == -1 && errno != EINTR && errno != EBUSY) {
+      throw xbus::IOException("io_uring_enter failed");
+    }
+    return result;
+  }
+
+  io_uring_cqe* peek() {
+    unsigned head = *m_cqHead;
+    if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+      return nullptr;
+    }
+    return &m_cqes[head & *m_cqMask];
+  }
+
+  void advance() {
+    __atomic_store_n(m_cqHead, *m_cqHead + 1, __ATOMIC_RELEASE);
+  }
+};
+
+/*
+  Connections are read with multishot receive into provided buffers,
+  so a single io_uring_enter collects data of every connection that had any.
+  Fan-out is submitted as one batch of sends from a per-thread ring.
+*/
+class UringBackend : public xbus::IoBackend {
+  struct Registration {
+    int fd;
+    bool poll;   // Readiness only
+    bool paused = false;
+    bool armed = false;
+  };
+
+  Ring m_ring;
+  std::mutex m_mutex; // Submission queue and registrations
+  std::map<uint64_t, Registration> m_registrations;
+  unsigned m_unsubmitted = 0;
+  std::thread::id m_loop;
+
+  char* m_buffers = nullptr;
+
+  io_uring_sqe* sqe() {
+    io_uring_sqe* sqe = m_ring.sqe();
+    if (!sqe) {
+      m_ring.publish();
+      m_ring.enter(m_unsubmitted, 0);
+      m_unsubmitted = 0;
+      sqe = m_ring.sqe();
+    }
+    m_unsubmitted++;
+    return sqe;
+  }
+
+  // Loop thread submits with its next wait, others right away
+  void submit() {
+    m_ring.publish();
+    if (std::this_thread::get_id() != m_loop) {
+      m_ring.enter(m_unsubmitted, 0);
+      m_unsubmitted = 0;
+    }
+  }
+
+  void arm(uint64_t key, Registration& registration) {
+    io_uring_sqe* entry = sqe();
+    entry->fd = registration.fd;
+    entry->user_data = key;
+    if (registration.poll) {
+      // One-shot, re-armed after each completion, so that readiness is level-triggered as with epoll
+      entry->opcode = IORING_OP_POLL_ADD;
+      entry->poll32_events = POLLIN;
+    } else {
+      entry->opcode = IORING_OP_RECV;
+      entry->ioprio = IORING_RECV_MULTISHOT;
+      entry->flags = IOSQE_BUFFER_SELECT;
+      entry->buf_group = 0;
+    }
+    registration.armed = true;
+  }
+
+  void cancel(uint64_t key) {
+    io_uring_sqe* entry = sqe();
+    entry->opcode = IORING_OP_ASYNC_CANCEL;
+    entry->fd = -1;
+    entry->addr = key;
+    entry->user_data = URING_IGNORE_KEY;
+  }
+
+  // Gives count buffers starting with id back to the kernel
+  void provideBuffers(int id, int count = 1) {
+    io_uring_sqe* entry = sqe();
+    entry->opcode = IORING_OP_PROVIDE_BUFFERS;
+    entry->fd = count;
+    entry->addr = (uint64_t) (m_buffers + (size_t) id * URING_BUFFER_SIZE);
+    entry->len = URING_BUFFER_SIZE;
+    entry->buf_group = 0;
+    entry->off = id;
+    entry->user_data = URING_IGNORE_KEY;
+  }
+
+ public:
+  UringBackend() : m_loop(std::this_thread::get_id()) {}
+
+  ~UringBackend() {
+    delete[] m_buffers;
+  }
+
+  bool init() {
+    if (!m_ring.init(URING_ENTRIES)) {
+      return false;
+    }
+
+    // Multishot receive is checked here, so that older kernels fall back to epoll
+    int probe[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, probe) == -1) {
+      return false;
+    }
+    m_buffers = new char[(size_t) URING_BUFFERS * URING_BUFFER_SIZE];
+    provideBuffers(0, URING_BUFFERS);
+    Registration registration = {probe[0], false};
+    arm(URING_IGNORE_KEY - 1, registration);
+    m_ring.publish();
+    xbus::countSyscalls();
+    ::write(probe[1], "", 1);
+    m_ring.enter(m_unsubmitted, 2);
+    m_unsubmitted = 0;
+
+    bool received = false;
+    while (io_uring_cqe* cqe = m_ring.peek()) {
+      if (cqe->user_data == URING_IGNORE_KEY - 1) {
+        received = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+          provideBuffers(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+      }
+      m_ring.advance();
+    }
+    ::close(probe[0]);
+    ::close(probe[1]);
+    // Probe ends with EOF, its completion is dropped by wait()
+    submit();
+    return received;
+  }
+
+  const char* name() const override {
+    return "uring";
+  }
+
+  void watch(int fd, uint64_t key) override {
+    std::unique_lock lock(m_mutex);
+    arm(key, m_registrations[key] = {fd, true});
+    submit();
+  }
+
+  void receive(int fd, uint64_t key) override {
+    std::unique_lock lock(m_mutex);
+    arm(key, m_registrations[key] = {fd, false});
+    submit();
+  }
+
+  void pause(int fd, uint64_t key) override {
+    std::unique_lock lock(m_mutex);
+    auto itr = m_registrations.find(key);
+    if (itr == m_registrations.end() || itr->second.paused) return;
+    itr->second.paused = true;
+    cancel(key);
+    submit();
+  }
+
+  void resume(int fd, uint64_t key) override {
+    std::unique_lock lock(m_mutex);
+    auto itr = m_registrations.find(key);
+    if (itr == m_registrations.end() || !itr->second.paused) return;
+    itr->second.paused = false;
+    // Otherwise it's re-armed when cancellation completes
+    if (!itr->second.armed) {
+      arm(key, itr->second);
+      submit();
+    }
+  }
+
+  // Completions that are still in flight are dropped
+  void remove(int fd, uint64_t key) override {
+    std::unique_lock lock(m_mutex);
+    if (m_registrations.erase(key)) {
+      cancel(key);
+      submit();
+    }
+  }
+
+  int wait(xbus::IoEvent* events, int max) override {
+    std::unique_lock lock(m_mutex);
+    unsigned submit = m_unsubmitted;
+    m_unsubmitted = 0;
+    lock.unlock();
+
+    if (!m_ring.peek()) {
+      m_ring.enter(submit, 1);
+    } else if (submit) {
+      m_ring.enter(submit, 0);
+    }
+
+    int count = 0;
+    lock.lock();
+    while (count < max) {
+      io_uring_cqe* cqe = m_ring.peek();
+      if (!cqe) break;
+      uint64_t key = cqe->user_data;
+      int result = cqe->res;
+      uint32_t flags = cqe->flags;
+      m_ring.advance();
+
+      int buffer = flags & IORING_CQE_F_BUFFER ? flags >> IORING_CQE_BUFFER_SHIFT : -1;
+      auto itr = m_registrations.find(key);
+      if (key == URING_IGNORE_KEY || itr == m_registrations.end()) {
+        if (buffer != -1) {
+          provideBuffers(buffer);
+        }
+        continue;
+      }
+
+      auto& registration = itr->second;
+      bool more = flags & IORING_CQE_F_MORE;
+      if (!more) {
+        registration.armed = false;
+      }
+
+      // Multishot ended because it was cancelled or ran out of buffers, data is still coming
+      if (result == -ECANCELED || result == -ENOBUFS) {
+        if (!registration.paused) {
+          arm(key, registration);
+        }
+        continue;
+      }
+
+      xbus::IoEvent& event = events[count++];
+      event = {};
+      event.key = key;
+      event.readable = registration.poll;
+      if (!registration.poll) {
+        event.size = result;
+        event.buffer = buffer;
+        if (buffer != -1) {
+          event.data = m_buffers + (size_t) buffer * URING_BUFFER_SIZE;
+        }
+      }
+
+      if (result <= 0 && !registration.poll) {
+        m_registrations.erase(itr);
+      } else if (!more && !registration.paused) {
+        arm(key, registration);
+      }
+    }
+    if (m_unsubmitted) {
+      m_ring.publish();
+    }
+    return count;
+  }
+
+  bool settled() override {
+    std::unique_lock lock(m_mutex);
+    for (auto& p : m_registrations) {
+      if (!p.second.poll && p.second.armed) {
+        return false;
+      }
+    }
+    return !m_ring.peek();
+  }
+
+  void release(const xbus::IoEvent& event) override {
+    if (event.buffer == -1) return;
+    std::unique_lock lock(m_mutex);
+    provideBuffers(event.buffer);
+    submit();
+  }
+
+  void broadcast(const std::vector<xbus::Socket*>& sockets, std::string_view frame) override {
+    thread_local Ring ring;
+    thread_local bool ready = ring.init(URING_SEND_ENTRIES);
+    if (!ready) {
+      IoBackend::broadcast(sockets, frame);
+      return;
+    }
+
+    std::string data(frame);
+    data.push_back('\0');
+
+    // Frames on a socket must not interleave, writers are locked in fd order to avoid deadlocks
+    std::vector<xbus::Socket*> targets(sockets);
+    std::sort(targets.begin(), targets.end(), [](auto a, auto b) { return a->fd() < b->fd(); });
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto socket : targets) {
+      locks.push_back(socket->lockWrites());
+    }
+    if (xbus::Journal* journal = xbus::Journal::recording()) {
+      for (auto socket : targets) {
+        journal->record(xbus::Journal::OUT, socket->fd(), data);
+      }
+    }
+
+    for (size_t begin = 0; begin < targets.size(); begin += URING_SEND_ENTRIES) {
+      unsigned count = std::min<size_t>(URING_SEND_ENTRIES, targets.size() - begin);
+      for (unsigned i = 0; i < count; i++) {
+        io_uring_sqe* entry = ring.sqe();
+        entry->opcode = IORING_OP_SEND;
+        entry->fd = targets[begin + i]->fd();
+        entry->addr = (uint64_t) data.data();
+        entry->len = data.size();
+        entry->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        entry->user_data = begin + i;
+      }
+      ring.publish();
+      ring.enter(count, count);
+
+      for (unsigned done = 0; done < count;) {
+        io_uring_cqe* cqe = ring.peek();
+        if (!cqe) {
+          ring.enter(0, count - done);
+          continue;
+        }
+        if (cqe->res != (int) data.size()) {
+          xbus::warning("broadcast to %d failed", targets[cqe->user_data]->fd());
+        }
+        ring.advance();
+        done++;
+      }
+    }
+  }
+};
+
+} /* namespace */
+
+xbus::IoBackend* xbus::IoBackend::create(const std::string& name) {
+  if (name == "epoll") {
+    EpollBackend* backend = new EpollBackend;
+    if (backend->valid()) return backend;
+    delete backend;
+  } else if (name == "uring") {
+    UringBackend* backend = new UringBackend;
+    if (backend->init()) return backend;
+    delete backend;
+  }
+  return nullptr;
+}
@@ -0,0 +1,231 @@
+#include <xbus/journal.h>
+#include <xbus/exceptions.h>
+
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "XBUSJRNL"
+#define JOURNAL_SKIP  0 // Direction of records that pad ring's end
+
+struct xbus::Journal::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t capacity;
+  std::atomic<uint64_t> head; // Absolute offset of next reservation
+  std::atomic<uint64_t> dropped; // Records that didn't fit, zero in journals of older writers
+  char padding[24];
+};
+
+struct xbus::Journal::RecordHeader {
+  std::atomic<uint32_t> size; // Whole record, aligned. Stored last
+  char direction;
+  char reserved[3];
+  int32_t connection;
+  uint32_t length;
+  uint64_t position; // Tells current record from leftovers of previous laps
+  uint64_t timestampNs;
+};
+
+static_assert(sizeof(xbus::Journal::Header) == 64, "journal header must keep ring aligned");
+static_assert(sizeof(xbus::Journal::RecordHeader) == XBUS_JOURNAL_ALIGN, "record header must fit into skip record");
+
+static std::atomic<xbus::Journal*> g_recording = nullptr;
+
+static uint64_t alignRecord(uint64_t size) {
+  return (size + XBUS_JOURNAL_ALIGN - 1) & ~(uint64_t) (XBUS_JOURNAL_ALIGN - 1);
+}
+
+xbus::Journal::~Journal() {
+  close();
+}
+
+void xbus::Journal::create(const std::string& path, size_t capacity) {
+  close();
+  capacity = capacity & ~(size_t) (XBUS_JOURNAL_ALIGN - 1);
+  if (capacity < XBUS_JOURNAL_ALIGN * 2) {
+    throw IOException("journal is too small");
+  }
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    throw IOException("can't create journal '" + path + "'");
+  }
+  size_t size = sizeof(Header) + capacity;
+  if (ftruncate(fd, size) == -1) {
+    ::close(fd);
+    throw IOException("can't resize journal '" + path + "'");
+  }
+  void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    throw IOException("can't map journal '" + path + "'");
+  }
+
+  m_header = (Header*) map;
+  m_ring = (char*) map + sizeof(Header);
+  m_mapSize = size;
+  m_writable = true;
+
+  memcpy(m_header->magic, JOURNAL_MAGIC, sizeof(m_header->magic));
+  m_header->version = XBUS_JOURNAL_VERSION;
+  m_header->capacity = capacity;
+  m_header->head.store(0);
+}
+
+void xbus::Journal::open(const std::string& path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw IOException("can't open journal '" + path + "'");
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(Header)) {
+    ::close(fd);
+    throw IOException("'" + path + "' is not a journal");
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    throw IOException("can't map journal '" + path + "'");
+  }
+
+  m_header = (Header*) map;
+  m_ring = (char*) map + sizeof(Header);
+  m_mapSize = st.st_size;
+  m_writable = false;
+
+  if (memcmp(m_header->magic, JOURNAL_MAGIC, sizeof(m_header->magic))
+   || m_header->version != XBUS_JOURNAL_VERSION
+   || m_header->capacity + sizeof(Header) != m_mapSize) {
+    close();
+    throw IOException("'" + path + "' is not a journal");
+  }
+}
+
+void xbus::Journal::close() {
+  if (!m_header) return;
+  if (g_recording == this) {
+    setRecording(nullptr);
+  }
+  munmap(m_header, m_mapSize);
+  m_header = nullptr;
+  m_ring = nullptr;
+  m_mapSize = 0;
+  m_writable = false;
+}
+
+bool xbus::Journal::isOpen() const {
+  return m_header != nullptr;
+}
+
+size_t xbus::Journal::capacity() const {
+  return m_header ? m_header->capacity : 0;
+}
+
+uint64_t xbus::Journal::written() const {
+  return m_header ? m_header->head.load(std::memory_order_acquire) : 0;
+}
+
+uint64_t xbus::Journal::dropped() const {
+  return m_header ? m_header->dropped.load(std::memory_order_relaxed) : 0;
+}
+
+void xbus::Journal::record(Direction direction, int connection, const iovec* iov, int count) {
+  if (!m_writable) return;
+
+  size_t length = 0;
+  for (int i = 0; i < count; i++) {
+    length += iov[i].iov_len;
+  }
+  uint64_t capacity = m_header->capacity;
+  uint64_t size = alignRecord(sizeof(RecordHeader) + length);
+  if (size > capacity / 2) {
+    m_header->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  while (1) {
+    uint64_t position = m_header->head.fetch_add(size, std::memory_order_relaxed);
+    uint64_t offset = position % capacity;
+    RecordHeader* record = (RecordHeader*) (m_ring + offset);
+    record->size.store(0, std::memory_order_relaxed);
+    record->position = position;
+    record->connection = connection;
+    record->timestampNs = timestamp;
+
+    // Reservation that crosses ring's end is wasted, readers jump over it
+    if (offset + size > capacity) {
+      record->direction = JOURNAL_SKIP;
+      record->length = 0;
+      record->size.store(size, std::memory_order_release);
+      continue;
+    }
+
+    record->direction = direction;
+    record->length = length;
+    char* data = (char*) (record + 1);
+    for (int i = 0; i < count; i++) {
+      memcpy(data, iov[i].iov_base, iov[i].iov_len);
+      data += iov[i].iov_len;
+    }
+    record->size.store(size, std::memory_order_release);
+    return;
+  }
+}
+
+void xbus::Journal::record(Direction direction, int connection, std::string_view data) {
+  iovec iov = {(void*) data.data(), data.size()};
+  record(direction, connection, &iov, 1);
+}
+
+std::vector<xbus::Journal::Record> xbus::Journal::records() const {
+  std::vector<Record> result;
+  if (!m_header) return result;
+
+  uint64_t capacity = m_header->capacity;
+  uint64_t head = m_header->head.load(std::memory_order_acquire);
+  auto valid = [this, capacity, head](uint64_t position) {
+    const RecordHeader* record = (const RecordHeader*) (m_ring + position % capacity);
+    uint32_t size = record->size.load(std::memory_order_acquire);
+    return record->position == position && size >= sizeof(RecordHeader) && size % XBUS_JOURNAL_ALIGN == 0
+        && position + size <= head && record->length <= size - sizeof(RecordHeader);
+  };
+
+  // Oldest records were overwritten, the first intact one follows them
+  uint64_t position = head > capacity ? head - capacity : 0;
+  while (position < head && !valid(position)) {
+    position += XBUS_JOURNAL_ALIGN;
+  }
+
+  while (position < head && valid(position)) {
+    const RecordHeader* record = (const RecordHeader*) (m_ring + position % capacity);
+    if (record->direction != JOURNAL_SKIP) {
+      result.push_back({
+        position,
+        record->timestampNs,
+        record->connection,
+        record->direction,
+        std::string_view((const char*) (record + 1), record->length)
+      });
+    }
+    position += record->size.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+xbus::Journal* xbus::Journal::recording() {
+  return g_recording.load(std::memory_order_acquire);
+}
+
+void xbus::Journal::setRecording(Journal* journal) {
+  g_recording.store(journal, std::memory_order_release);
+}
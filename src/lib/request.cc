@@ -1,64 +1,131 @@
 #include <xbus/request.h>
 #include <xbus/log.h>
-#include <mrt/format.h>
+#include <xbus/scan.h>
 #include <mrt/container_utils.h>
 #include <cctype>
+#include <climits>
 #include <cstdio>
 
-bool xbus::isRequest(const std::string& str) {
-  return Request::fromString(str).isValid();
+// Interned ID of '$ID', 0 if str is a name
+static uint32_t parseId(std::string_view str) {
+  if (str.size() < 2 || str[0] != '$') {
+    return 0;
+  }
+  uint32_t id = 0;
+  for (size_t i = 1; i < str.size(); i++) {
+    if (!isdigit(str[i])) return 0;
+    id = id * 10 + (str[i] - '0');
+  }
+  return id;
+}
+
+bool xbus::isRequest(std::string_view str) {
+  char buffer[256];
+  std::pmr::monotonic_buffer_resource resource(buffer, sizeof(buffer));
+  return RequestView::fromString(str, &resource).isValid();
 }
 
 bool xbus::Request::isValid() const {
-  return action != "" && subject != "";
+  return action != "" && (subject != "" || subjectId);
 }
 
 std::string xbus::Request::toString() const {
-  std::string argsstr = mrt::reduce(args,
-    [](auto result, auto element) {
-      return result + element + ",";
-    }, std::string());
-  argsstr.pop_back();
-
-  return mrt::format("{}{}{}{}{}{}{}",
-    object,
-    action,
-    subject,
-    args.size() ? (action == ACTION_FIELD ? "=" : ":") + argsstr : "",
-    async ? "&" : "",
-    request ? "?" : "",
-    tag ? "#" + std::to_string(tag) : ""
-  );
+  std::string result;
+  result.reserve(object.size() + action.size() + subject.size() + 16);
+  if (object.empty() && objectId) {
+    result += '$' + std::to_string(objectId);
+  } else {
+    result += object;
+  }
+  result += action;
+  if (subject.empty() && subjectId) {
+    result += '$' + std::to_string(subjectId);
+  } else {
+    result += subject;
+  }
+  for (size_t i = 0; i < args.size(); i++) {
+    result += i ? "," : (action == ACTION_FIELD ? "=" : ":");
+    result += args[i];
+  }
+  if (async) result += '&';
+  if (request) result += '?';
+  if (priority) result += '^';
+  if (tag) {
+    result += '#';
+    result += std::to_string(tag);
+  }
+  return result;
+}
+
+xbus::Request xbus::Request::fromString(std::string_view str) {
+  char buffer[256];
+  std::pmr::monotonic_buffer_resource resource(buffer, sizeof(buffer));
+  return RequestView::fromString(str, &resource).toRequest();
 }
 
-xbus::Request xbus::Request::fromString(const std::string& str) {
-  Request request;
+xbus::RequestView::RequestView(std::pmr::memory_resource* resource) : args(resource) {}
 
-  size_t index = 0;
-  while (index < str.size() && !mrt::isIn(str[index], '+', '-', '!')) {
-    request.object += str[index++];
+bool xbus::RequestView::isValid() const {
+  return !action.empty() && !subject.empty();
+}
+
+xbus::Request xbus::RequestView::toRequest() const {
+  Request result;
+  result.object = object;
+  result.action = action;
+  result.subject = subject;
+  result.args.reserve(args.size());
+  for (auto arg : args) {
+    result.args.emplace_back(arg);
   }
+  result.request = request;
+  result.async = async;
+  result.priority = priority;
+  result.tag = tag;
+  result.objectId = objectId;
+  result.subjectId = subjectId;
+  return result;
+}
+
+xbus::RequestView xbus::RequestView::fromString(std::string_view str, std::pmr::memory_resource* resource) {
+  RequestView request(resource);
+  request.frame = str;
 
-  while (index < str.size() && !isalnum(str[index]) && str[index] != '_') {
-    request.action += str[index++];
+  // Delimiters are searched a vector at a time, names and actions are short enough for a loop
+  size_t index = findDelimiter(str, "+-!"), start = 0;
+  request.object = str.substr(start, index - start);
+  request.objectId = parseId(request.object);
+
+  start = index;
+  while (index < str.size() && !isNameChar(str[index]) && str[index] != '$') {
+    index++;
   }
+  request.action = str.substr(start, index - start);
 
-  while (index < str.size() && (isalnum(str[index]) || str[index] == '_')) {
-    request.subject += str[index++];
+  start = index;
+  if (index < str.size() && str[index] == '$') {
+    index++;
   }
+  while (index < str.size() && isNameChar(str[index])) {
+    index++;
+  }
+  request.subject = str.substr(start, index - start);
+  request.subjectId = parseId(request.subject);
 
   if (index < str.size() && mrt::isIn(str[index], ':', '=')) {
-    index++;
-    std::string arg;
-    while (index < str.size() && !mrt::isIn(str[index], '?', '&', '#')) {
-      arg += str[index++];
-      if (str[index] == ',') {
-        request.args.push_back(arg);
-        arg = "";
-        index++;
-      }
+    start = ++index;
+    DelimiterScanner scanner(str, ",?&#", index);
+    while ((index = scanner.next()) < str.size() && str[index] == ',') {
+      request.args.push_back(str.substr(start, index - start));
+      start = index + 1;
     }
-    request.args.push_back(arg);
+    // '^' is only the priority flag right before the tag, or at the end, elsewhere it belongs to the argument
+    auto last = str.substr(start, index - start);
+    if (!last.empty() && last.back() == '^' && (index == str.size() || str[index] == '#')) {
+      last.remove_suffix(1);
+      request.priority = true;
+    }
+    request.args.push_back(last);
   }
 
   if (index < str.size() && str[index] == '&') {
@@ -71,17 +138,30 @@ xbus::Request xbus::Request::fromString(const std::string& str) {
     index++;
   }
 
+  if (index < str.size() && str[index] == '^') {
+    request.priority = true;
+    index++;
+  }
+
+  request.tagOffset = index;
   if (index < str.size() && str[index] == '#') {
     index++;
-    std::string tag;
-    while (index < str.size() && isnumber(str[index])) {
-      tag += str[index++];
-    }
-    try {
-      request.tag = std::stoi(tag);
-    } catch (...) {
+    if (index == str.size() || !isdigit(str[index])) {
       error("Request parsing failed: invalid tag");
     }
+    while (index < str.size() && isdigit(str[index])) {
+      int digit = str[index++] - '0';
+      // Tag that doesn't fit could wrap onto a real one, the frame is rejected
+      if (request.tag > (INT_MAX - digit) / 10) {
+        error("Request parsing failed: tag too long");
+        request.tag = 0;
+        request.action = {};
+        break;
+      }
+      request.tag = request.tag * 10 + digit;
+    }
+  } else {
+    request.tagOffset = str.size();
   }
 
   return request;
@@ -1,53 +1,82 @@
 #include <xbus/response.h>
 #include <xbus/log.h>
-#include <mrt/container_utils.h>
+#include <xbus/scan.h>
+#include <cctype>
+#include <climits>
 
-xbus::Response::Response(const std::string& status) : status(status) {}
+xbus::Response::Response(std::string status) : status(std::move(status)) {}
 
-xbus::Response::Response(const std::string& status, std::vector<std::string> rest) : status(status), rest(rest) {}
+xbus::Response::Response(std::string status, std::vector<std::string> rest) : status(std::move(status)), rest(std::move(rest)) {}
 
 std::string xbus::Response::toString() const {
-  std::string result = mrt::reduce(rest,
-    [](auto result, auto element) {
-      return result + "," + element;
-    }, status);
-  if (tag) result += "#" + std::to_string(tag);
+  std::string result = status;
+  for (auto& element : rest) {
+    result += ',';
+    result += element;
+  }
+  if (tag) {
+    result += '#';
+    result += std::to_string(tag);
+  }
   return result;
 }
 
-xbus::Response xbus::Response::fromString(const std::string& str) {
-  Response response;
+xbus::Response xbus::Response::fromString(std::string_view str) {
+  char buffer[256];
+  std::pmr::monotonic_buffer_resource resource(buffer, sizeof(buffer));
+  return ResponseView::fromString(str, &resource).toResponse();
+}
+
+xbus::ResponseView::ResponseView(std::pmr::memory_resource* resource) : rest(resource) {}
 
-  size_t index = 0;
-  while (index < str.size() && !mrt::isIn(str[index], ',', '#')) {
-    response.status += str[index++];
+xbus::Response xbus::ResponseView::toResponse() const {
+  Response result;
+  result.status = status;
+  result.rest.reserve(rest.size());
+  for (auto element : rest) {
+    result.rest.emplace_back(element);
   }
+  result.tag = tag;
+  return result;
+}
+
+xbus::ResponseView xbus::ResponseView::fromString(std::string_view str, std::pmr::memory_resource* resource) {
+  ResponseView response(resource);
+  response.frame = str;
+
+  // Status and elements are split in one pass over the frame
+  DelimiterScanner scanner(str, ",#");
+  size_t index = scanner.next(), start = 0;
+  response.status = str.substr(start, index - start);
 
   if (index < str.size() && str[index] == ',') {
-    index++;
-    std::string s;
-    while (index < str.size() && str[index] != '#') {
-      s += str[index++];
-      if (str[index] == ',') {
-        response.rest.push_back(s);
-        s = "";
-        index++;
-      }
+    start = index + 1;
+    while ((index = scanner.next()) < str.size() && str[index] == ',') {
+      response.rest.push_back(str.substr(start, index - start));
+      start = index + 1;
     }
-    response.rest.push_back(s);
+    response.rest.push_back(str.substr(start, index - start));
   }
 
+  response.tagOffset = index;
   if (index < str.size() && str[index] == '#') {
     index++;
-    std::string tag;
-    while (index < str.size() && isnumber(str[index])) {
-      tag += str[index++];
-    }
-    try {
-      response.tag = std::stoi(tag);
-    } catch (...) {
+    if (index == str.size() || !isdigit(str[index])) {
       error("Response parsing failed: invalid tag");
     }
+    while (index < str.size() && isdigit(str[index])) {
+      int digit = str[index++] - '0';
+      // Tag that doesn't fit could wrap onto a real one, the frame is rejected
+      if (response.tag > (INT_MAX - digit) / 10) {
+        error("Response parsing failed: tag too long");
+        response.tag = 0;
+        response.status = {};
+        break;
+      }
+      response.tag = response.tag * 10 + digit;
+    }
+  } else {
+    response.tagOffset = str.size();
   }
 
   return response;
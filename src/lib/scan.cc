@@ -0,0 +1,177 @@
+#include <xbus/scan.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XBUS_SCAN_X86 1
+#endif
+
+namespace {
+
+using ScanBlock = uint64_t (*)(const char* data, size_t size, const xbus::Delimiters& delimiters);
+
+uint64_t scanScalar(const char* data, size_t size, const xbus::Delimiters& delimiters) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < size; i++) {
+    mask |= (uint64_t) delimiters.contains(data[i]) << i;
+  }
+  return mask;
+}
+
+#ifdef XBUS_SCAN_X86
+
+// Inlined into both vector scanners, so that the AVX2 one doesn't mix in legacy SSE encoding
+__attribute__((target("sse2"), always_inline))
+inline uint64_t match16(const char* data, const __m128i* needles, size_t count) {
+  __m128i bytes = _mm_loadu_si128((const __m128i*) data);
+  __m128i found = _mm_cmpeq_epi8(bytes, needles[0]);
+  for (size_t c = 1; c < count; c++) {
+    found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, needles[c]));
+  }
+  return (uint32_t) _mm_movemask_epi8(found);
+}
+
+__attribute__((target("sse2")))
+uint64_t scanSse2(const char* data, size_t size, const xbus::Delimiters& delimiters) {
+  __m128i needles[XBUS_SCAN_CHARS];
+  size_t count = delimiters.count;
+  for (size_t c = 0; c < count; c++) {
+    needles[c] = _mm_set1_epi8(delimiters.chars[c]);
+  }
+  uint64_t mask = 0;
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    mask |= match16(data + i, needles, count) << i;
+  }
+  return i < size ? mask | scanScalar(data + i, size - i, delimiters) << i : mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t scanAvx2(const char* data, size_t size, const xbus::Delimiters& delimiters) {
+  __m256i needles[XBUS_SCAN_CHARS];
+  __m128i halves[XBUS_SCAN_CHARS];
+  size_t count = delimiters.count;
+  for (size_t c = 0; c < count; c++) {
+    needles[c] = _mm256_set1_epi8(delimiters.chars[c]);
+    halves[c] = _mm256_castsi256_si128(needles[c]);
+  }
+  uint64_t mask = 0;
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*) (data + i));
+    __m256i found = _mm256_cmpeq_epi8(bytes, needles[0]);
+    for (size_t c = 1; c < count; c++) {
+      found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, needles[c]));
+    }
+    mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(found) << i;
+  }
+  // Tail of a block is shorter than 32 bytes, but may still fill a 16 byte vector
+  if (i + 16 <= size) {
+    mask |= match16(data + i, halves, count) << i;
+    i += 16;
+  }
+  return i < size ? mask | scanScalar(data + i, size - i, delimiters) << i : mask;
+}
+
+#endif
+
+bool supported(xbus::ScanLevel level) {
+  switch (level) {
+    case xbus::ScanLevel::SCALAR:
+      return true;
+#ifdef XBUS_SCAN_X86
+    case xbus::ScanLevel::SSE2:
+      return __builtin_cpu_supports("sse2");
+    case xbus::ScanLevel::AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+xbus::ScanLevel detect() {
+#ifdef XBUS_SCAN_X86
+  // Runs before main, CPU model may not be initialized yet
+  __builtin_cpu_init();
+#endif
+  if (supported(xbus::ScanLevel::AVX2)) return xbus::ScanLevel::AVX2;
+  if (supported(xbus::ScanLevel::SSE2)) return xbus::ScanLevel::SSE2;
+  return xbus::ScanLevel::SCALAR;
+}
+
+ScanBlock blockScanner(xbus::ScanLevel level) {
+  switch (level) {
+#ifdef XBUS_SCAN_X86
+    case xbus::ScanLevel::AVX2:
+      return scanAvx2;
+    case xbus::ScanLevel::SSE2:
+      return scanSse2;
+#endif
+    default:
+      return scanScalar;
+  }
+}
+
+// Scalar until detection runs, for frames parsed by static initializers of other files
+xbus::ScanLevel g_level = xbus::ScanLevel::SCALAR;
+ScanBlock g_scanBlock = scanScalar;
+const bool g_detected = xbus::setScanLevel(detect());
+
+} /* namespace */
+
+xbus::ScanLevel xbus::scanLevel() {
+  return g_level;
+}
+
+const char* xbus::scanLevelName(ScanLevel level) {
+  switch (level) {
+    case ScanLevel::AVX2: return "avx2";
+    case ScanLevel::SSE2: return "sse2";
+    default: return "scalar";
+  }
+}
+
+bool xbus::setScanLevel(ScanLevel level) {
+  if (!supported(level)) {
+    return false;
+  }
+  g_level = level;
+  g_scanBlock = blockScanner(level);
+  return true;
+}
+
+xbus::Delimiters::Delimiters(std::string_view chars)
+  : chars(chars.data()), count(std::min<size_t>(chars.size(), XBUS_SCAN_CHARS)) {
+  for (size_t c = 0; c < count; c++) {
+    unsigned char byte = chars[c];
+    bits[byte >> 6] |= 1ull << (byte & 63);
+  }
+}
+
+xbus::DelimiterScanner::DelimiterScanner(std::string_view str, std::string_view chars, size_t from)
+  : m_str(str), m_delimiters(chars), m_block(from) {
+  if (m_block < m_str.size()) {
+    size_t size = m_str.size() - m_block;
+    m_mask = g_scanBlock(m_str.data() + m_block, std::min<size_t>(size, XBUS_SCAN_BLOCK), m_delimiters);
+  }
+}
+
+size_t xbus::DelimiterScanner::next() {
+  while (!m_mask) {
+    m_block += XBUS_SCAN_BLOCK;
+    if (m_block >= m_str.size()) {
+      m_block = m_str.size();
+      return m_str.size();
+    }
+    size_t size = m_str.size() - m_block;
+    m_mask = g_scanBlock(m_str.data() + m_block, std::min<size_t>(size, XBUS_SCAN_BLOCK), m_delimiters);
+  }
+  size_t offset = m_block + __builtin_ctzll(m_mask);
+  m_mask &= m_mask - 1;
+  return offset;
+}
+
+size_t xbus::findDelimiter(std::string_view str, std::string_view chars, size_t from) {
+  return DelimiterScanner(str, chars, from).next();
+}
@@ -1,7 +1,12 @@
 #include <xbus/socket.h>
 #include <xbus/exceptions.h>
 #include <xbus/die.h>
+#include <xbus/io.h>
+#include <xbus/journal.h>
 #include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <thread>
 
 #define BACKLOG 10
 
@@ -14,6 +19,8 @@ xbus::Socket::Socket(const std::string& path) : m_path(path) {
   strncpy(m_addr.sun_path, path.c_str(), sizeof(m_addr.sun_path) - 1);
 }
 
+xbus::Socket::Socket(int fd) : m_fd(fd) {}
+
 xbus::Socket::~Socket() {
   if (m_fd != -1) {
     close();
@@ -36,10 +43,20 @@ void xbus::Socket::bind() {
   }
 }
 
-void xbus::Socket::connect() {
+void xbus::Socket::connect(int timeout) {
   if (m_fd == -1) return;
-  if (::connect(m_fd, (sockaddr*) &m_addr, sizeof(sockaddr_un)) == -1) {
-    throw SocketException("connect failed");
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  while (::connect(m_fd, (sockaddr*) &m_addr, sizeof(sockaddr_un)) == -1) {
+    if ((errno != ENOENT && errno != ECONNREFUSED) || std::chrono::steady_clock::now() >= deadline) {
+      throw SocketException("connect failed");
+    }
+    // Socket that failed to connect is not reused
+    ::close(m_fd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(XBUS_CONNECT_RETRY));
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_fd == -1) {
+      throw SocketException("connect failed");
+    }
   }
 }
 
@@ -55,6 +72,11 @@ void xbus::Socket::close() {
   m_fd = -1;
 }
 
+void xbus::Socket::shutdown(int how) {
+  if (m_fd == -1) return;
+  ::shutdown(m_fd, how);
+}
+
 xbus::Socket* xbus::Socket::accept() {
   if (m_fd == -1) return nullptr;
   Socket* socket = new Socket;
@@ -62,22 +84,133 @@ xbus::Socket* xbus::Socket::accept() {
   return socket;
 }
 
-void xbus::Socket::write(const std::string& data) {
+void xbus::Socket::write(std::string_view data) {
+  iovec iov = {(void*) data.data(), data.size()};
+  writev(&iov, 1);
+}
+
+void xbus::Socket::writeFrame(std::string_view data) {
+  iovec iov[2] = {
+    {(void*) data.data(), data.size()},
+    {(void*) "", 1}
+  };
+  writev(iov, 2);
+}
+
+void xbus::Socket::writev(iovec* iov, int count) {
   if (m_fd == -1) return;
-  if(::write(m_fd, data.c_str(), data.size()) == -1) {
-    throw IOException("write failed");
+  std::unique_lock lock(m_writeMutex);
+  if (Journal* journal = Journal::recording()) {
+    journal->record(Journal::OUT, m_fd, iov, count);
+  }
+  // Peer that closed the connection (e.g. the other end of a direct link) is reported as IOException, not SIGPIPE
+  msghdr msg = {};
+  while (count > 0) {
+    countSyscalls();
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t written = ::sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      throw IOException("write failed");
+    }
+    while (count > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
   }
 }
 
-std::string xbus::Socket::read(size_t size) {
-  if (m_fd == -1) return "";
-  char* buffer = new char[size+1];
-  size_t readSize = ::read(m_fd, buffer, size);
+std::unique_lock<std::mutex> xbus::Socket::lockWrites(bool wait) {
+  if (!wait) {
+    return std::unique_lock(m_writeMutex, std::try_to_lock);
+  }
+  return std::unique_lock(m_writeMutex);
+}
+
+size_t xbus::Socket::read(char* buffer, size_t size) {
+  if (m_fd == -1) return 0;
+  ssize_t readSize;
+  do {
+    countSyscalls();
+    readSize = ::read(m_fd, buffer, size);
+  } while (readSize == -1 && errno == EINTR);
   if (readSize == -1) {
     throw IOException("read failed");
   }
-  buffer[size] = 0;
-  std::string data(buffer, readSize);
-  delete [] buffer;
+  return readSize;
+}
+
+std::string xbus::Socket::read(size_t size) {
+  std::string data(size, '\0');
+  data.resize(read(data.data(), size));
   return data;
 }
+
+void xbus::Socket::sendFd(std::string_view data, int fd) {
+  if (m_fd == -1) return;
+  std::unique_lock lock(m_writeMutex);
+
+  char control[CMSG_SPACE(sizeof(int))] = {0};
+  iovec iov = {(void*) data.data(), data.size()};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd != -1) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  // Descriptor goes with the first chunk, rest is plain data
+  while (iov.iov_len > 0) {
+    countSyscalls();
+    ssize_t written = ::sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      throw IOException("sendmsg failed");
+    }
+    iov.iov_base = (char*) iov.iov_base + written;
+    iov.iov_len -= written;
+    msg.msg_control = nullptr;
+    msg.msg_controllen = 0;
+  }
+}
+
+size_t xbus::Socket::recvFd(char* buffer, size_t size, int& fd) {
+  fd = -1;
+  if (m_fd == -1) return 0;
+
+  char control[CMSG_SPACE(sizeof(int))];
+  iovec iov = {buffer, size};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t readSize;
+  do {
+    countSyscalls();
+    readSize = ::recvmsg(m_fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (readSize == -1 && errno == EINTR);
+  if (readSize == -1) {
+    throw IOException("recvmsg failed");
+  }
+
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  return readSize;
+}
@@ -0,0 +1,42 @@
+#include <xbus/symbols.h>
+
+xbus::SymbolTable::SymbolTable(size_t limit) : m_limit(limit) {}
+
+uint32_t xbus::SymbolTable::intern(std::string_view name) {
+  std::unique_lock lock(m_mutex);
+  auto itr = m_ids.find(name);
+  if (itr != m_ids.end()) {
+    return itr->second;
+  }
+  if (m_names.size() >= m_limit) {
+    return 0;
+  }
+  m_names.emplace_back(name);
+  uint32_t id = m_names.size();
+  m_ids.emplace(m_names.back(), id);
+  return id;
+}
+
+uint32_t xbus::SymbolTable::find(std::string_view name) const {
+  std::unique_lock lock(m_mutex);
+  auto itr = m_ids.find(name);
+  return itr == m_ids.end() ? 0 : itr->second;
+}
+
+std::string_view xbus::SymbolTable::name(uint32_t id) const {
+  std::unique_lock lock(m_mutex);
+  if (id == 0 || id > m_names.size()) {
+    return {};
+  }
+  return m_names[id - 1];
+}
+
+size_t xbus::SymbolTable::size() const {
+  std::unique_lock lock(m_mutex);
+  return m_names.size();
+}
+
+std::vector<std::string> xbus::SymbolTable::names() const {
+  std::unique_lock lock(m_mutex);
+  return std::vector<std::string>(m_names.begin(), m_names.end());
+}
@@ -1,24 +1,56 @@
 #include <xbus/xbus.h>
+#include <xbus/compress.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <set>
 #include <thread>
+#include <vector>
 #include <chrono>
 #include <string>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Heap allocations made by the counting thread, for checks of allocation-free paths
+static thread_local bool t_countAllocations = false;
+static thread_local size_t t_allocations = 0;
+
+void* operator new(size_t size) {
+  if (t_countAllocations) t_allocations++;
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
 
 class Test : public xbus::Object<Test> {
   std::string m_status = "0";
 
  public:
   Test(const std::string& s) : Object(s) {
-    addField("value", "0");
+    addField("value", "0", true);
     addProperty("status", &Test::status);
     addProperty("wait", &Test::wait);
     addProperty("stop", &Test::pstop);
+    addProperty("count", &Test::count);
   }
 
-  void onNotify(xbus::Request request) override {}
+  void onNotify(const xbus::Request& request) override {}
 
-  xbus::Response status(xbus::Request request) {
+  xbus::Response status(const xbus::Request& request) {
     if (request.request) {
       return {"OK", {m_status}};
     } else {
@@ -30,7 +62,7 @@ class Test : public xbus::Object<Test> {
     }
   }
 
-  xbus::Response wait(xbus::Request request) {
+  xbus::Response wait(const xbus::Request& request) {
     if (request.request) {
       return {"OK"};
     } else {
@@ -46,7 +78,25 @@ class Test : public xbus::Object<Test> {
     }
   }
 
-  xbus::Response pstop(xbus::Request request) {
+  // Streams numbers from 1 to N, one every 100ms
+  xbus::Response count(const xbus::Request& request) {
+    if (request.args.size() != 1) {
+      return {"ERR", {"ARGUMENT MISMATCH"}};
+    }
+    int n;
+    try {
+      n = std::stoi(request.args[0]);
+    } catch (...) {
+      return {"ERR", {"INVALID ARGUMENT"}};
+    }
+    for (int i = 1; i <= n; i++) {
+      stream(request, {std::to_string(i)});
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return {"OK", {"COUNT", request.args[0]}};
+  }
+
+  xbus::Response pstop(const xbus::Request& request) {
     if (request.request) {
       return {"OK", { isRunning() ? "1" : "0" }};
     } else {
@@ -57,13 +107,778 @@ class Test : public xbus::Object<Test> {
 
 };
 
+/*
+  Checks, run with 'test check [CASE ...]'. Cases marked as needing xbusd talk to a daemon
+  on the default socket and are skipped if there is none, they run objects of their own
+  in this process, named chk_*.
+*/
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      return false; \
+    } \
+  } while (0)
+
+// Connected pair of sockets, for checks of the I/O layer without xbusd
+struct SocketPair {
+  xbus::Socket* a;
+  xbus::Socket* b;
+
+  SocketPair() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+      throw xbus::IOException("socketpair failed");
+    }
+    a = new xbus::Socket(fds[0]);
+    b = new xbus::Socket(fds[1]);
+  }
+
+  ~SocketPair() {
+    delete a;
+    delete b;
+  }
+};
+
+// Frames end only at '\0', however the bytes are split between reads
+static bool checkFrameSplit() {
+  SocketPair pair;
+  xbus::FrameReader reader(pair.b);
+  std::string_view frame;
+
+  pair.a->write("obj+sta");
+  CHECK(reader.fill());
+  CHECK(!reader.tryNext(frame));
+  CHECK(!reader.ready());
+  pair.a->write(std::string_view("tus?#1\0obj-va", 13));
+  CHECK(reader.fill());
+  CHECK(reader.tryNext(frame) && frame == "obj+status?#1");
+  CHECK(!reader.tryNext(frame));
+
+  // Frame many times larger than a read, sent in pieces
+  std::string large(20 * XBUS_READ_SIZE + 7, 'x');
+  std::thread writer([&pair, &large]() {
+    pair.a->write("lue=");
+    for (size_t i = 0; i < large.size(); i += 100) {
+      pair.a->write(std::string_view(large).substr(i, 100));
+    }
+    pair.a->writeFrame("");
+    pair.a->writeFrame("OK");
+  });
+  bool read = reader.next(frame);
+  CHECK(read && frame == "obj-value=" + large);
+  read = reader.next(frame);
+  writer.join();
+  CHECK(read && frame == "OK");
+
+  // Pushed data (as received by io_uring) is split the same way
+  xbus::FrameReader pushed(pair.b);
+  pushed.push("OK,a");
+  CHECK(!pushed.tryNext(frame));
+  pushed.push(std::string_view("b\0", 2));
+  CHECK(pushed.tryNext(frame) && frame == "OK,ab");
+  return true;
+}
+
+// Tags up to INT_MAX are taken, frames with longer ones are rejected instead of wrapping
+static bool checkTagOverflow() {
+  CHECK(xbus::Request::fromString("obj+status#2147483647").tag == 2147483647);
+  CHECK(xbus::Response::fromString("OK,1#2147483647").tag == 2147483647);
+  auto request = xbus::Request::fromString("obj+status#2147483648");
+  CHECK(!request.isValid() && request.tag == 0);
+  request = xbus::Request::fromString("obj+status#99999999999999999999");
+  CHECK(!request.isValid() && request.tag == 0);
+  auto response = xbus::Response::fromString("OK,1#4294967297");
+  CHECK(response.status.empty() && response.tag == 0);
+  return true;
+}
+
+// Writing frames, reading them and parsing into views reuses pooled memory once warmed up
+static bool checkFrameAllocations() {
+  SocketPair pair;
+  xbus::FrameReader reader(pair.b);
+  xbus::Arena arena;
+  std::string value(300, 'v');
+  std::string frames[] = {"obj+status?#1", "obj+move:left,12.5,fast#2", "obj-value=" + value + "#3", "OK,SENT#4"};
+
+  auto roundTrip = [&]() {
+    size_t args = 0;
+    for (int i = 0; i < 100; i++) {
+      for (auto& sent : frames) {
+        pair.a->writeFrame(sent);
+        std::string_view frame;
+        if (!reader.next(frame) || frame != sent) return false;
+        arena.reset();
+        if (xbus::isRequest(frame)) {
+          args += xbus::RequestView::fromString(frame, &arena).args.size();
+        } else {
+          args += xbus::ResponseView::fromString(frame, &arena).rest.size();
+        }
+      }
+    }
+    return args > 0;
+  };
+
+  CHECK(roundTrip());
+  t_allocations = 0;
+  t_countAllocations = true;
+  bool ok = roundTrip();
+  t_countAllocations = false;
+  CHECK(ok);
+  if (t_allocations) {
+    fprintf(stderr, "  %zu allocations for 400 frames\n", t_allocations);
+  }
+  CHECK(t_allocations == 0);
+  return true;
+}
+
+// Ring keeps the newest records as it wraps around, records too large for it are counted instead
+static bool checkJournalWrap() {
+  std::string path = "/tmp/xbus_check_" + std::to_string(getpid()) + ".journal";
+  xbus::Journal journal;
+  journal.create(path, 1024);
+  unlink(path.c_str());
+
+  for (int i = 0; i < 200; i++) {
+    journal.record(xbus::Journal::IN, 3, "frame " + std::to_string(i));
+  }
+  CHECK(journal.written() > journal.capacity());
+  auto records = journal.records();
+  CHECK(records.size() >= 8 && records.size() <= 16);
+  for (size_t i = 0; i < records.size(); i++) {
+    CHECK(records[i].data == "frame " + std::to_string(200 - records.size() + i));
+    CHECK(records[i].connection == 3 && records[i].direction == xbus::Journal::IN);
+    CHECK(i == 0 || records[i].position > records[i - 1].position);
+  }
+
+  CHECK(journal.dropped() == 0);
+  journal.record(xbus::Journal::OUT, 3, std::string(600, 'x'));
+  CHECK(journal.dropped() == 1);
+  CHECK(journal.records().back().data == "frame 199");
+
+  // Second one doesn't fit before ring's end, it is stored from the start after a skip record
+  std::string before(160, 's'), after(352, 't');
+  journal.record(xbus::Journal::OUT, 4, before);
+  journal.record(xbus::Journal::OUT, 4, after);
+  records = journal.records();
+  CHECK(records.size() >= 2);
+  CHECK(records[records.size() - 2].data == before);
+  CHECK(records.back().data == after && records.back().connection == 4);
+
+  // Largest record that is stored takes half of the ring
+  std::string half(512 - XBUS_JOURNAL_ALIGN, 'y');
+  journal.record(xbus::Journal::OUT, 4, half);
+  CHECK(journal.records().back().data == half);
+  CHECK(journal.dropped() == 1);
+  return true;
+}
+
+// Object of a check, run on a thread of its own until stopped
+class CheckObject : public xbus::Object<CheckObject> {
+  std::thread m_thread;
+
+ public:
+  std::atomic<int> calls = 0;
+
+  CheckObject(const std::string& name) : Object(name) {
+    addProperty("slow", &CheckObject::slow);
+    addProperty("read", &CheckObject::read);
+    addProperty("stop", &CheckObject::pstop);
+    addProperty("echo", &CheckObject::echo);
+    addProperty("via", &CheckObject::via);
+  }
+
+  // Returns how the call came, direct or bus
+  xbus::Response via(const xbus::Request& request) {
+    return {"OK", {isDirect() ? "direct" : "bus"}};
+  }
+
+  // Returns its arguments
+  xbus::Response echo(const xbus::Request& request) {
+    return {"OK", request.args};
+  }
+
+  // Answers reads (?) only
+  xbus::Response read(const xbus::Request& request) {
+    if (!request.request) {
+      return {"ERR", {"NOT A READ"}};
+    }
+    return {"OK", {"value"}};
+  }
+
+  // Sleeps for args[0] ms, returns number of calls so far
+  xbus::Response slow(const xbus::Request& request) {
+    int n = ++calls;
+    if (!request.args.empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(std::stoi(request.args[0])));
+    }
+    return {"OK", {std::to_string(n)}};
+  }
+
+  xbus::Response pstop(const xbus::Request& request) {
+    stop();
+    return {"OK"};
+  }
+
+  // Returns once xbusd knows the object
+  void start(const std::string& name) {
+    m_thread = std::thread([this]() { listen(); });
+    xbus::Client client;
+    client.call(xbus::Request::fromString("+await:" + name + ",timeout=2000"));
+  }
+
+  // Reader only notices stop() on the next frame, so a notification follows. xbusd answers it, not the object,
+  // which may have stopped reading already. Does nothing if not started
+  void finish(const std::string& name) {
+    if (!m_thread.joinable()) return;
+    xbus::Client client;
+    client.call(xbus::Request::fromString(name + "+stop"));
+    client.call(xbus::Request::fromString(name + "!stop"));
+    m_thread.join();
+  }
+};
+
+// Response without its tag, for comparisons
+static xbus::Response call(xbus::Client& client, const std::string& frame) {
+  auto response = client.call(xbus::Request::fromString(frame));
+  response.tag = 0;
+  return response;
+}
+
+// Cached field is filled by a read, then kept up to date by sets through xbusd and by pushes
+// from the object. A failed set is read back from the object
+static bool checkFieldCache() {
+  CheckObject object("chk_cache");
+  object.addField("value", "0", true);
+  object.start("chk_cache");
+  xbus::Client client;
+
+  bool ok = [&]() {
+    CHECK(call(client, "chk_cache-value?").toString() == "OK,0");
+    CHECK(call(client, "chk_cache-value=5").status == "OK");
+    CHECK(call(client, "chk_cache-value?").toString() == "OK,5");
+
+    object.setField("value", "7");
+    std::string value;
+    for (int i = 0; i < 100 && value != "OK,7"; i++) {
+      value = call(client, "chk_cache-value?").toString();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    CHECK(value == "OK,7");
+
+    CHECK(call(client, "chk_cache-value=1,2").status == "ERR");
+    CHECK(call(client, "chk_cache-value?").toString() == "OK,7");
+    return true;
+  }();
+  object.finish("chk_cache");
+  return ok;
+}
+
+// Value of a NAME=VALUE element of +stats
+static long busStat(xbus::Client& client, const std::string& name) {
+  for (auto& element : call(client, "+stats").rest) {
+    if (element.compare(0, name.size() + 1, name + "=") == 0) {
+      return std::stol(element.substr(name.size() + 1));
+    }
+  }
+  return -1;
+}
+
+// Identical concurrent reads of a coalesced subject reach the object once and share its response,
+// reads with other arguments and calls that aren't reads are not coalesced
+static bool checkCoalescing() {
+  CheckObject object("chk_co");
+  object.setExecutor(4);
+  object.setCoalesced("slow");
+  object.start("chk_co");
+  xbus::Client client;
+
+  bool ok = [&]() {
+    long coalesced = busStat(client, "coalesced");
+    std::vector<std::string> responses(8);
+    std::vector<std::thread> callers;
+    for (auto& response : responses) {
+      callers.emplace_back([&response]() {
+        xbus::Client caller;
+        response = call(caller, "chk_co+slow:300?").toString();
+      });
+    }
+    for (auto& caller : callers) {
+      caller.join();
+    }
+    CHECK(object.calls == 1);
+    for (auto& response : responses) {
+      CHECK(response == "OK,1");
+    }
+    CHECK(busStat(client, "coalesced") == coalesced + 7);
+
+    std::thread other([]() {
+      xbus::Client caller;
+      call(caller, "chk_co+slow:200?");
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(call(client, "chk_co+slow:0").toString() == "OK,3");
+    CHECK(call(client, "chk_co+slow:0?").toString() == "OK,4");
+    other.join();
+    CHECK(object.calls == 4);
+    return true;
+  }();
+  object.finish("chk_co");
+  return ok;
+}
+
+// Gathered read reaches every matching object as a read, and each one's value is streamed back
+static bool checkGatherRead() {
+  CheckObject first("chk_g1"), second("chk_g2");
+  first.start("chk_g1");
+  second.start("chk_g2");
+  xbus::Client client;
+
+  bool ok = [&]() {
+    auto responses = client.stream(xbus::Request::fromString("+gather:chk_g*,read?"));
+    std::set<std::string> replies;
+    xbus::Response chunk;
+    while (responses.next(chunk)) {
+      chunk.tag = 0;
+      replies.insert(chunk.toString());
+    }
+    CHECK(replies == std::set<std::string>({"MORE,chk_g1,OK,value", "MORE,chk_g2,OK,value"}));
+    CHECK(responses.result().status == "OK" && responses.result().rest == std::vector<std::string>({"2"}));
+
+    // Options before the flag apply, a reduced gather streams nothing
+    size_t streamed = 0;
+    auto reduced = client.stream(xbus::Request::fromString("+gather:chk_g*,read,reduce=count?"));
+    while (reduced.next(chunk)) {
+      streamed++;
+    }
+    CHECK(streamed == 0);
+    CHECK(reduced.result().status == "OK" && reduced.result().rest == std::vector<std::string>({"2"}));
+    CHECK(call(client, "+gather:chk_g*,read,reduce=count").toString() == "OK,0");
+    return true;
+  }();
+  first.finish("chk_g1");
+  second.finish("chk_g2");
+  return ok;
+}
+
+// Only names that objects interned are resolved, and a connection can't intern names without bound
+static bool checkResolveNames() {
+  CheckObject object("chk_res");
+  object.start("chk_res");
+  xbus::Client client;
+
+  bool ok = [&]() {
+    auto ids = client.resolve({"chk_res", "slow"});
+    CHECK(ids.size() == 2);
+    CHECK(call(client, "$" + std::to_string(ids[0]) + "+$" + std::to_string(ids[1]) + ":0").toString() == "OK,1");
+
+    std::string unknown = "chk_unknown_" + std::to_string(getpid());
+    CHECK(call(client, "+resolve:" + unknown).toString() == "ERR,UNKNOWN NAME," + unknown);
+    CHECK(client.resolve({"chk_res", unknown}).empty());
+
+    std::string names;
+    for (int i = 0; i <= 1024; i++) {
+      names += (names.empty() ? "" : ",") + unknown + "_" + std::to_string(i);
+    }
+    CHECK(call(client, "+intern:" + names).toString() == "ERR,TOO MANY NAMES");
+    CHECK(call(client, "+resolve:" + unknown + "_0").status == "ERR");
+    return true;
+  }();
+  object.finish("chk_res");
+  return ok;
+}
+
+// Reads frames of a raw connection until the final response, skipping notifications
+static std::string nextResponse(xbus::FrameReader& reader) {
+  std::string_view frame;
+  while (reader.next(frame)) {
+    if (!xbus::isRequest(frame)) return std::string(frame);
+  }
+  return "";
+}
+
+// Tagged priority request overtakes a slow call sent before it, untagged one is answered in order
+static bool checkPriorityOrder() {
+  CheckObject object("chk_prio");
+  object.setExecutor(4);
+  object.start("chk_prio");
+  xbus::Socket socket(xbus::SOCKET_PATH);
+  socket.connect();
+  xbus::FrameReader reader(&socket);
+
+  bool ok = [&]() {
+    socket.writeFrame("chk_prio+slow:300#1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    socket.writeFrame("chk_prio+slow:0^#2");
+    CHECK(nextResponse(reader) == "OK,2#2");
+    CHECK(nextResponse(reader) == "OK,1#1");
+
+    socket.writeFrame("chk_prio+slow:300");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    socket.writeFrame("chk_prio+slow:0^");
+    CHECK(nextResponse(reader) == "OK,3");
+    CHECK(nextResponse(reader) == "OK,4");
+    return true;
+  }();
+  object.finish("chk_prio");
+  return ok;
+}
+
+// Large payload of a compressing object arrives whole whether or not the caller negotiated compression,
+// and a payload that merely starts with the marker is never taken for compressed
+static bool checkCompression() {
+  CheckObject packing("chk_zip"), plain("chk_nozip");
+  packing.setCompression(true);
+  packing.start("chk_zip");
+  plain.start("chk_nozip");
+  xbus::Client negotiated, other;
+
+  bool ok = [&]() {
+    CHECK(negotiated.enableCompression());
+    std::string args;
+    std::vector<std::string> payload;
+    for (int i = 0; i < 200; i++) {
+      payload.push_back("motor_" + std::to_string(i % 16) + ".limit=" + std::to_string(100 + i % 7));
+      args += (args.empty() ? "" : ",") + payload.back();
+    }
+    CHECK(call(negotiated, "chk_zip+echo:" + args).rest == payload);
+    CHECK(call(other, "chk_zip+echo:" + args).rest == payload);
+
+    // Forwarded as the object sent it to a caller that negotiated compression
+    xbus::Socket socket(xbus::SOCKET_PATH);
+    socket.connect();
+    xbus::FrameReader reader(&socket);
+    socket.writeFrame("+version:" XBUS_COMPRESSION);
+    CHECK(nextResponse(reader) == "OK," XBUS_VERSION "," XBUS_COMPRESSION);
+    socket.writeFrame("chk_zip+echo:" + args);
+    CHECK(nextResponse(reader).compare(0, 4, "OK,\x02") == 0);
+
+    // Valid compressed element passed around as data
+    xbus::Response packed = {"OK", payload};
+    CHECK(xbus::compressResponse(packed));
+    for (auto object : {"chk_zip", "chk_nozip"}) {
+      CHECK(call(negotiated, std::string(object) + "+echo:" + packed.rest[0]).rest == packed.rest);
+      CHECK(call(other, std::string(object) + "+echo:" + packed.rest[0]).rest == packed.rest);
+    }
+    return true;
+  }();
+  packing.finish("chk_zip");
+  plain.finish("chk_nozip");
+  return ok;
+}
+
+// Link is only given to objects that take links and have nothing kept by xbusd, calls on it skip xbusd
+// until the object goes away, then they go through xbusd again
+static bool checkDirectLink() {
+  auto direct = std::make_unique<CheckObject>("chk_direct");
+  CheckObject plain("chk_nodirect"), limited("chk_limited");
+  direct->setDirect(true);
+  limited.setDirect(true);
+  limited.setLimit(4);
+  direct->start("chk_direct");
+  plain.start("chk_nodirect");
+  limited.start("chk_limited");
+  xbus::Client client;
+
+  bool ok = [&]() {
+    CHECK(client.connectDirect("chk_direct"));
+    CHECK(call(client, "chk_direct+via").toString() == "OK,direct");
+    CHECK(call(client, "chk_direct+slow:0").toString() == "OK,1");
+    CHECK(!client.connectDirect("chk_nodirect"));
+    CHECK(call(client, "chk_nodirect+via").toString() == "OK,bus");
+    CHECK(!client.connectDirect("chk_limited"));
+    CHECK(call(client, "chk_limited+via").toString() == "OK,bus");
+
+    // Object is gone from xbusd once its connection is closed
+    direct->finish("chk_direct");
+    direct.reset();
+    for (int i = 0; i < 100 && call(client, "+stats:chk_direct").status == "OK"; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    direct = std::make_unique<CheckObject>("chk_direct");
+    direct->setDirect(true);
+    direct->start("chk_direct");
+    CHECK(call(client, "chk_direct+via").toString() == "OK,bus");
+    return true;
+  }();
+  direct->finish("chk_direct");
+  plain.finish("chk_nodirect");
+  limited.finish("chk_limited");
+  return ok;
+}
+
+// '^' inside arguments and field values is kept, only one that ends the last argument before the tag is the flag
+static bool checkCaretArgs() {
+  auto request = xbus::Request::fromString("obj+status:a^b,^c^d#5");
+  CHECK(request.args == std::vector<std::string>({"a^b", "^c^d"}) && !request.priority && request.tag == 5);
+  CHECK(xbus::Request::fromString(request.toString()).args == request.args);
+  request = xbus::Request::fromString("obj+status:a^b^#5");
+  CHECK(request.args == std::vector<std::string>({"a^b"}) && request.priority && request.tag == 5);
+  request = xbus::Request::fromString("obj-value=x^y&");
+  CHECK(request.args == std::vector<std::string>({"x^y"}) && request.async && !request.priority);
+
+  CheckObject object("chk_caret");
+  object.addField("value", "0", true);
+  object.start("chk_caret");
+  xbus::Client client;
+  bool ok = [&]() {
+    CHECK(call(client, "chk_caret+echo:a^b,^c").toString() == "OK,a^b,^c");
+    CHECK(call(client, "chk_caret+echo:a^b^").toString() == "OK,a^b");
+    object.setField("value", "x^y");
+    std::string value;
+    for (int i = 0; i < 100 && value != "OK,x^y"; i++) {
+      value = call(client, "chk_caret-value?").toString();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    CHECK(value == "OK,x^y");
+    return true;
+  }();
+  object.finish("chk_caret");
+  return ok;
+}
+
+// Replica joins a group only with the same cached fields and direct links as the replicas already in it
+static bool checkGroupMismatch() {
+  CheckObject object("chk_grp");
+  object.setGroup(xbus::GroupBalance::ROUND_ROBIN);
+  object.addField("value", "0", true);
+  object.start("chk_grp");
+
+  bool ok = [&]() {
+    for (auto options : {"", ",cache=other", ",cache=value,cache=other", ",cache=value,direct"}) {
+      xbus::Socket socket(xbus::SOCKET_PATH);
+      socket.connect();
+      xbus::FrameReader reader(&socket);
+      socket.writeFrame(std::string("+register:chk_grp,ids,group=rr") + options);
+      CHECK(nextResponse(reader) == "ERR,GROUP MISMATCH,chk_grp");
+    }
+    xbus::Socket socket(xbus::SOCKET_PATH);
+    socket.connect();
+    xbus::FrameReader reader(&socket);
+    socket.writeFrame("+register:chk_grp,ids,group=rr,cache=value");
+    CHECK(nextResponse(reader).compare(0, 2, "OK") == 0);
+    return true;
+  }();
+  object.finish("chk_grp");
+  return ok;
+}
+
+// Next notification of a raw connection without its tag, skipping everything else
+static std::string nextNotification(xbus::FrameReader& reader) {
+  std::string_view frame;
+  while (reader.next(frame)) {
+    if (!xbus::isRequest(frame)) continue;
+    auto request = xbus::Request::fromString(frame);
+    if (request.action == xbus::ACTION_NOTIFY) {
+      request.tag = 0;
+      return request.toString();
+    }
+  }
+  return "";
+}
+
+// Another xbusd from the directory of this binary, linked to the given daemons
+struct PeerDaemon {
+  std::string path;
+  pid_t pid = -1;
+
+  PeerDaemon(const std::string& path, const std::vector<std::string>& peers) : path(path) {
+    char self[4096] = {};
+    if (readlink("/proc/self/exe", self, sizeof(self) - 1) <= 0) {
+      throw xbus::IOException("can't find own binary");
+    }
+    std::string binary = self;
+    binary = binary.substr(0, binary.rfind('/') + 1) + "xbusd";
+    std::vector<std::string> args = {"xbusd", "-s", path, "-l", "error"};
+    for (auto& peer : peers) {
+      args.insert(args.end(), {"-p", peer});
+    }
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+      argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    unlink(path.c_str());
+    pid = fork();
+    if (pid == 0) {
+      execv(binary.c_str(), argv.data());
+      _exit(127);
+    }
+  }
+
+  ~PeerDaemon() {
+    if (pid > 0) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+    }
+    unlink(path.c_str());
+  }
+
+  // Returns once the daemon takes connections
+  bool wait() {
+    for (int i = 0; i < 200; i++) {
+      try {
+        xbus::Socket socket(path);
+        socket.connect();
+        return true;
+      } catch (std::exception& e) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    return false;
+  }
+};
+
+// Raw connection that has made a round trip, so the daemon has accepted it and delivers notifications to it
+struct Listener {
+  xbus::Socket socket;
+  xbus::FrameReader reader;
+
+  Listener(const std::string& path) : socket(path), reader(&socket) {
+    socket.connect();
+    socket.writeFrame("+ping");
+    nextResponse(reader);
+  }
+};
+
+// Three daemons linked in a full mesh. Objects are called across a link, a notification reaches every client
+// once, since it's neither sent back over the link it came on nor passed on to other peers, and a daemon is
+// linked at most once
+static bool checkFederation() {
+  CheckObject object("chk_fed");
+  object.start("chk_fed");
+  // Far daemon dials the near one right away, so it has to be up by then
+  PeerDaemon near("/tmp/xbus_chk_near.sock", {xbus::SOCKET_PATH});
+  bool started = near.wait();
+  PeerDaemon far("/tmp/xbus_chk_far.sock", {xbus::SOCKET_PATH, near.path});
+
+  bool ok = [&]() {
+    CHECK(started && far.wait());
+    xbus::Client local, remote(near.path), farther(far.path);
+    CHECK(call(remote, "+await:chk_fed,timeout=2000").status == "OK");
+    CHECK(call(remote, "chk_fed+slow:0").toString() == "OK,1");
+    CHECK(call(remote, "chk_fed+echo:a,b").toString() == "OK,a,b");
+
+    // Far daemon learns of an object on the near one once they are linked
+    Listener nearObject(near.path);
+    nearObject.socket.writeFrame("+register:chk_fed_near");
+    CHECK(nextResponse(nearObject.reader).compare(0, 2, "OK") == 0);
+    CHECK(call(farther, "+await:chk_fed,chk_fed_near,timeout=3000").status == "OK");
+
+    // Notifications are passed on with the tag of their sender, so they are sent untagged on raw connections,
+    // where they can't be taken for the response
+    auto notify = [](const std::string& path, const std::string& frame) {
+      Listener sender(path);
+      sender.socket.writeFrame(frame);
+      return nextResponse(sender.reader).compare(0, 7, "OK,SENT") == 0;
+    };
+    Listener onLocal(xbus::SOCKET_PATH), onNear(near.path), onFar(far.path);
+    CHECK(notify(xbus::SOCKET_PATH, "!chk_fed_note:1"));
+    CHECK(notify(near.path, "!chk_fed_note:2"));
+    CHECK(notify(far.path, "!chk_fed_note:3"));
+    // Copies that shouldn't be sent would come before the last one
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(notify(xbus::SOCKET_PATH, "!chk_fed_note:4"));
+    for (auto listener : {&onLocal, &onNear, &onFar}) {
+      std::vector<std::string> notes;
+      for (auto note = nextNotification(listener->reader); !note.empty(); note = nextNotification(listener->reader)) {
+        notes.push_back(note);
+        if (note == "!chk_fed_note:4") break;
+      }
+      std::sort(notes.begin(), notes.end());
+      CHECK(notes == std::vector<std::string>({"!chk_fed_note:1", "!chk_fed_note:2", "!chk_fed_note:3", "!chk_fed_note:4"}));
+    }
+
+    CHECK(call(local, "+peer:" + near.path).toString() == "ERR,ALREADY PEERED," + near.path);
+    return true;
+  }();
+  object.finish("chk_fed");
+  return ok;
+}
+
+struct CheckCase {
+  const char* name;
+  bool (*run)();
+  bool daemon; // Needs xbusd
+};
+
+static const CheckCase CHECK_CASES[] = {
+  {"frame_split", checkFrameSplit, false},
+  {"tag_overflow", checkTagOverflow, false},
+  {"frame_allocations", checkFrameAllocations, false},
+  {"journal_wrap", checkJournalWrap, false},
+  {"field_cache", checkFieldCache, true},
+  {"priority_order", checkPriorityOrder, true},
+  {"coalescing", checkCoalescing, true},
+  {"gather_read", checkGatherRead, true},
+  {"resolve_names", checkResolveNames, true},
+  {"compression", checkCompression, true},
+  {"direct_link", checkDirectLink, true},
+  {"caret_args", checkCaretArgs, true},
+  {"group_mismatch", checkGroupMismatch, true},
+  {"federation", checkFederation, true},
+};
+
+static bool daemonRunning() {
+  try {
+    xbus::Socket socket(xbus::SOCKET_PATH);
+    socket.connect();
+    return true;
+  } catch (std::exception& e) {
+    return false;
+  }
+}
+
+static int runChecks(int argc, char** argv) {
+  xbus::setLogLevel(xbus::LogLevel::WARNING);
+  bool daemon = daemonRunning();
+  int failed = 0, passed = 0, skipped = 0;
+  for (auto& check : CHECK_CASES) {
+    bool selected = argc == 0;
+    for (int i = 0; i < argc; i++) {
+      selected |= !strcmp(argv[i], check.name);
+    }
+    if (!selected) continue;
+    if (check.daemon && !daemon) {
+      printf("SKIP %s (xbusd is not running)\n", check.name);
+      skipped++;
+      continue;
+    }
+    bool ok = false;
+    try {
+      ok = check.run();
+    } catch (std::exception& e) {
+      fprintf(stderr, "  exception: %s\n", e.what());
+    }
+    printf("%s %s\n", ok ? "PASS" : "FAIL", check.name);
+    fflush(stdout);
+    (ok ? passed : failed)++;
+  }
+  printf("%d passed, %d failed, %d skipped\n", passed, failed, skipped);
+  return failed;
+}
+
 int main(int argc, char ** argv) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s OBJECT\n", argv[0]);
+  if (argc >= 2 && !strcmp(argv[1], "check")) {
+    return runChecks(argc - 2, argv + 2);
+  }
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s OBJECT [rr|least|hash]\n", argv[0]);
+    fprintf(stderr, "       %s check [CASE ...]\n", argv[0]);
     return 1;
   }
 
   Test test(argv[1]);
+  if (argc == 3) {
+    std::string balance = argv[2];
+    if (balance == "rr") {
+      test.setGroup(xbus::GroupBalance::ROUND_ROBIN);
+    } else if (balance == "least") {
+      test.setGroup(xbus::GroupBalance::LEAST_IN_FLIGHT);
+    } else if (balance == "hash") {
+      test.setGroup(xbus::GroupBalance::HASH);
+    }
+  }
   test.listen();
 
   return 0;
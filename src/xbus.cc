@@ -1,8 +1,16 @@
 #include <xbus/xbus.h>
 #include <xbus/utils.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <deque>
+#include <memory>
 #include <string>
+#include <thread>
+#include <mutex>
 #include <cstdio>
 
 #define _XBUS_CHECK_ARGV() \
@@ -14,14 +22,14 @@
     } \
   } while (0)
 
-static void printData(xbus::Socket& socket, const std::string& data) {
+static void printData(xbus::Socket& socket, std::string_view data) {
   if (xbus::isRequest(data)) {
     auto request = xbus::Request::fromString(data);
     if (request.action == xbus::ACTION_NOTIFY) {
       printf("%s\n", request.toString().c_str());
     } else {
       printf("%s\n", request.toString().c_str());
-      socket.write("ERR,UNSUPPORTED\0");
+      socket.writeFrame("ERR,UNSUPPORTED");
     }
   } else {
     printf("%s\n", xbus::Response::fromString(data).toString().c_str());
@@ -33,31 +41,304 @@ static void repl(const std::string& sock) {
 
   xbus::Socket socket(sock);
   socket.connect();
-  
+  xbus::FrameReader reader(&socket);
+  std::string_view frame;
+
   while (1) {
     printf("] ");
     std::string input;
     std::getline(std::cin, input);
     if (input.empty()) continue;
     if (input == "/q" || input == "/quit" || input == "/exit") {
-      socket.write("+close");
+      socket.writeFrame("+close");
       break;
     }
-    socket.write(input + '\0');
+    socket.writeFrame(input);
+
+    if (!reader.next(frame)) break;
+    printData(socket, frame);
+
+    while (reader.buffered() && reader.next(frame)) {
+      printData(socket, frame);
+    }
+  }
+}
+
+// Pipelines requests from stdin over one connection.
+// Every request is tagged with its line number, xbusd echoes the tag in response.
+// In coproc mode output is flushed after every line and tags are stripped,
+// so that each input line gets exactly one output line, in order
+// (partial responses of streamed calls are skipped).
+static int pipeline(const std::string& sock, bool coproc) {
+  xbus::Socket socket(sock);
+  socket.connect();
+
+  if (coproc) {
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+  }
 
-    std::string buffer = socket.read(XBUS_READ_SIZE);
+  std::mutex mutex;
+  std::condition_variable drained;
+  int pending = 0;
 
-    if (buffer.empty()) break;
+  std::thread writer([&]() {
+    std::string line;
+    int tag = 0;
+    while (std::getline(std::cin, line)) {
+      if (line.empty()) continue;
+      tag++;
 
-    if (buffer.find('\0') != std::string::npos) {
-      auto dataSplit = xbus::splitString(buffer, '\0');
-      for (auto element : dataSplit) {
-        printData(socket, element);
+      auto request = xbus::RequestView::fromString(line);
+      if (!request.isValid()) {
+        std::unique_lock lock(mutex);
+        drained.wait(lock, [&pending]() { return pending == 0; });
+        printf(coproc ? "ERR,INVALID REQUEST\n" : "ERR,INVALID REQUEST#%d\n", tag);
+        continue;
       }
-    } else {
-      printData(socket, buffer);
+      if (request.object.empty() && request.subject == "close") {
+        break;
+      }
+
+      {
+        std::unique_lock lock(mutex);
+        pending++;
+      }
+
+      char tagBuffer[16];
+      int tagSize = snprintf(tagBuffer, sizeof(tagBuffer), "#%d", tag);
+      iovec iov[3] = {
+        {(void*) line.data(), request.tagOffset},
+        {tagBuffer, (size_t) tagSize},
+        {(void*) "", 1}
+      };
+      socket.writev(iov, 3);
+    }
+    // xbusd closes connection after answering everything that was sent
+    socket.shutdown(SHUT_WR);
+  });
+
+  xbus::FrameReader reader(&socket);
+  std::string_view frame;
+  while (reader.next(frame)) {
+    auto request = xbus::RequestView::fromString(frame);
+    if (request.isValid() && request.action == xbus::ACTION_NOTIFY) {
+      if (!coproc) {
+        printf("%.*s\n", (int) frame.size(), frame.data());
+      }
+      continue;
+    }
+
+    auto response = xbus::ResponseView::fromString(frame);
+    bool partial = response.status == xbus::STATUS_MORE;
+    if (partial && coproc) continue;
+    printf("%.*s\n", (int) (coproc ? response.tagOffset : frame.size()), frame.data());
+    if (partial) continue;
+
+    std::unique_lock lock(mutex);
+    if (--pending == 0) {
+      drained.notify_all();
+    }
+  }
+
+  writer.join();
+  return 0;
+}
+
+struct ReplayCall {
+  std::string frame;       // Request without tag
+  uint64_t timestampNs;    // When xbusd received it
+  bool async = false;      // No response is expected
+  int64_t recordedNs = -1; // Latency seen by xbusd, -1 if response was not recorded
+  int64_t replayedNs = -1;
+};
+
+struct ReplaySession {
+  std::vector<ReplayCall> calls;
+  bool skip = false; // Connection of an object or peer, those are not replayed
+};
+
+// Groups recorded frames by client connection and matches requests with responses,
+// by tag or in order for untagged ones (xbusd answers client's requests in order)
+static std::vector<ReplaySession> loadSessions(const xbus::Journal& journal) {
+  struct Pending {
+    size_t session;
+    std::map<int, size_t> tagged;
+    std::deque<size_t> untagged;
+  };
+  std::vector<ReplaySession> sessions;
+  std::map<int, Pending> open;
+
+  for (auto& record : journal.records()) {
+    if (record.direction == xbus::Journal::CLOSE) {
+      open.erase(record.connection);
+      continue;
+    }
+    auto itr = open.find(record.connection);
+    if (itr == open.end() || record.direction == xbus::Journal::OPEN) {
+      sessions.emplace_back();
+      itr = open.insert_or_assign(record.connection, Pending{sessions.size() - 1}).first;
+    }
+    ReplaySession& session = sessions[itr->second.session];
+    Pending& pending = itr->second;
+
+    if (record.direction == xbus::Journal::IN) {
+      auto request = xbus::RequestView::fromString(record.data);
+      if (!request.isValid()) {
+        session.skip = true; // Responses come from objects
+        continue;
+      }
+      if (request.object.empty() && (request.subject == "register" || request.subject == "peer" || request.subject == "handoff")) {
+        session.skip = true;
+      }
+      ReplayCall call;
+      call.frame = record.data.substr(0, request.tagOffset);
+      call.timestampNs = record.timestampNs;
+      call.async = request.async;
+      if (!call.async) {
+        if (request.tagOffset != record.data.size()) {
+          pending.tagged[request.tag] = session.calls.size();
+        } else {
+          pending.untagged.push_back(session.calls.size());
+        }
+      }
+      session.calls.push_back(std::move(call));
+    } else if (record.direction == xbus::Journal::OUT) {
+      // One record may hold several frames
+      for (auto frame : xbus::splitString(std::string(record.data), '\0')) {
+        if (frame.empty() || xbus::isRequest(frame)) continue;
+        auto response = xbus::ResponseView::fromString(frame);
+        if (response.status == xbus::STATUS_MORE) continue;
+        size_t index = session.calls.size();
+        auto tagged = pending.tagged.find(response.tag);
+        if (response.tagOffset != frame.size() && tagged != pending.tagged.end()) {
+          index = tagged->second;
+          pending.tagged.erase(tagged);
+        } else if (response.tagOffset == frame.size() && !pending.untagged.empty()) {
+          index = pending.untagged.front();
+          pending.untagged.pop_front();
+        }
+        if (index < session.calls.size()) {
+          session.calls[index].recordedNs = record.timestampNs - session.calls[index].timestampNs;
+        }
+      }
+    }
+  }
+
+  sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
+    [](auto& session) { return session.skip || session.calls.empty(); }), sessions.end());
+  return sessions;
+}
+
+// Sends calls of a session over a new connection, at recorded times divided by speed (0 is as fast as possible)
+static void replaySession(const std::string& sock, ReplaySession& session, uint64_t baseNs,
+                          std::chrono::steady_clock::time_point start, double speed) {
+  xbus::Socket socket(sock);
+  socket.connect();
+  auto sentAt = std::make_unique<std::atomic<int64_t>[]>(session.calls.size());
+
+  std::thread receiver([&]() {
+    xbus::FrameReader reader(&socket);
+    std::string_view frame;
+    while (reader.next(frame)) {
+      if (xbus::isRequest(frame)) continue;
+      auto response = xbus::ResponseView::fromString(frame);
+      if (response.status == xbus::STATUS_MORE) continue;
+      if (response.tag > 0 && (size_t) response.tag <= session.calls.size()) {
+        int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+        session.calls[response.tag - 1].replayedNs = now - sentAt[response.tag - 1];
+      }
+    }
+  });
+
+  for (size_t i = 0; i < session.calls.size(); i++) {
+    auto& call = session.calls[i];
+    if (speed > 0) {
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds((int64_t) ((call.timestampNs - baseNs) / speed)));
+    }
+    char tagBuffer[16];
+    int tagSize = call.async ? 0 : snprintf(tagBuffer, sizeof(tagBuffer), "#%zu", i + 1);
+    iovec iov[3] = {
+      {(void*) call.frame.data(), call.frame.size()},
+      {tagBuffer, (size_t) tagSize},
+      {(void*) "", 1}
+    };
+    sentAt[i] = std::chrono::steady_clock::now().time_since_epoch().count();
+    socket.writev(iov, 3);
+  }
+  // xbusd closes connection after answering everything that was sent
+  socket.shutdown(SHUT_WR);
+  receiver.join();
+}
+
+static void printLatency(const char* name, std::vector<int64_t> samples) {
+  if (samples.empty()) {
+    printf("%-10s %8d\n", name, 0);
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  double sum = 0;
+  for (auto sample : samples) {
+    sum += sample;
+  }
+  auto percentile = [&samples](double p) { return samples[(size_t) (p * (samples.size() - 1))] / 1000.0; };
+  printf("%-10s %8zu %10.1f %10.1f %10.1f\n", name, samples.size(), sum / samples.size() / 1000.0, percentile(0.5), percentile(0.99));
+}
+
+// Re-drives client traffic recorded by 'xbusd -r' and compares latencies
+static int replay(const std::string& sock, const std::string& path, double speed) {
+  xbus::Journal journal;
+  journal.open(path);
+  if (journal.dropped()) {
+    xbus::warning("%llu frames were too large for the journal and are missing", (unsigned long long) journal.dropped());
+  }
+  auto sessions = loadSessions(journal);
+  if (sessions.empty()) {
+    xbus::error("No client traffic in '%s'", path.c_str());
+    return 1;
+  }
+
+  uint64_t baseNs = UINT64_MAX;
+  for (auto& session : sessions) {
+    baseNs = std::min(baseNs, session.calls.front().timestampNs);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (auto& session : sessions) {
+    threads.emplace_back([&]() {
+      try {
+        replaySession(sock, session, baseNs, start, speed);
+      } catch (xbus::SocketException& e) {
+        e.print();
+      } catch (xbus::IOException& e) {
+        e.print();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<int64_t> recorded, replayed, difference;
+  size_t calls = 0, lost = 0;
+  for (auto& session : sessions) {
+    for (auto& call : session.calls) {
+      calls++;
+      if (call.async) continue;
+      if (call.recordedNs >= 0) recorded.push_back(call.recordedNs);
+      if (call.replayedNs >= 0) replayed.push_back(call.replayedNs);
+      if (call.replayedNs < 0) lost++;
+      if (call.recordedNs >= 0 && call.replayedNs >= 0) difference.push_back(call.replayedNs - call.recordedNs);
     }
   }
+
+  printf("%zu connections, %zu requests in %.3fs, %zu unanswered\n", sessions.size(), calls, elapsed, lost);
+  printf("%-10s %8s %10s %10s %10s\n", "latency", "count", "mean us", "p50 us", "p99 us");
+  printLatency("recorded", recorded);
+  printLatency("replayed", replayed);
+  printLatency("difference", difference);
+  return 0;
 }
 
 void usage(const char* argv0) {
@@ -74,13 +355,24 @@ void usage(const char* argv0) {
     "  get OBJECT NAME            - Gets a field\n"
     "  set OBJECT NAME VALUE      - Sets a field\n"
     "  send REQUEST               - Send raw request\n"
-    "  wait                       - Wait for an object\n"
+    "  pipe [--coproc]            - Pipeline raw requests from stdin, one per line,\n"
+    "                               responses are tagged with input line number\n"
+    "  wait [-t MS] OBJECT...     - Wait until objects are registered\n"
+    "  replay [-x N|max] FILE     - Replays client traffic recorded by 'xbusd -r FILE',\n"
+    "                               N times faster (default is 1), and compares latencies\n"
+    "  gather [-t MS] [-r count|sum] [-n N] PATTERN NAME [ARGS]\n"
+    "                             - Calls NAME on every object matching glob PATTERN at once,\n"
+    "                               with a deadline (default is 1000 ms), optionally reduced\n"
+    "                               to a count or sum of results, or to the first N of them,\n"
+    "                               NAME? reads the property instead\n"
+    "  watch                      - Print object registrations and unregistrations\n"
     "  listen [OBJECT]            - Listen for notifications\n"
     "  parse_req WHAT REQUEST     - WHAT can be 'object', 'action', 'subject', \n"
     "                               'request', 'async' or number for arg in args\n"
     "  parse_res WHAT RESPONSE    - WHAT can be 'status' or number for arg in args\n"
     "Options:\n"
     "  -s SOCK, --socket SOCK - Unix socket for xbusd\n"
+    "  -P, --priority         - Sends requests with priority flag, ahead of other traffic\n"
     // "  -t T, --timeout T      - \n"
     "  -l LVL, --loglevel LVL - Sets log level (debug, info, warning, error, fatal)\n"
     "If COMMAND is empty - REPL will run\n"
@@ -88,17 +380,28 @@ void usage(const char* argv0) {
     "", XBUS_VERSION, argv0);
 }
 
+// Partial responses of a streamed call are printed as they come, final one is returned
 std::string sendRequest(const std::string& sock, const std::string& request) {
   xbus::Socket socket(sock);
   socket.connect();
-  socket.write(request + '\0');
-  return socket.read(XBUS_READ_SIZE);
+  socket.writeFrame(request);
+  xbus::FrameReader reader(&socket);
+  std::string_view frame;
+  while (reader.next(frame)) {
+    if (xbus::ResponseView::fromString(frame).status != xbus::STATUS_MORE) {
+      return std::string(frame);
+    }
+    printf("%.*s\n", (int) frame.size(), frame.data());
+    fflush(stdout);
+  }
+  return "";
 }
 
 int main(int argc, char** argv) {
   std::string command;
   std::string sock = xbus::SOCKET_PATH;
   int threads = 0;
+  bool priority = false;
 
   int i = 1;
   for (; i < argc; i++) {
@@ -107,6 +410,8 @@ int main(int argc, char** argv) {
       sock = argv[++i];
     } else if (!strcmp("-l", argv[i]) || !strcmp("--loglevel", argv[i])) {
       xbus::setLogLevel(xbus::stringToLogLevel(argv[++i]));
+    } else if (!strcmp("-P", argv[i]) || !strcmp("--priority", argv[i])) {
+      priority = true;
     } else {
       if (command.empty()) {
         command = argv[i];
@@ -130,7 +435,7 @@ int main(int argc, char** argv) {
     printf("xbus v%s\n", XBUS_VERSION);
     return 0;
   } else if (command == "list" || command == "l" || command == "ls") {
-    auto response = xbus::Response::fromString(sendRequest(sock, "+list"));
+    auto response = xbus::Response::fromString(sendRequest(sock, priority ? "+list^" : "+list"));
     if (response.status == "OK") {
       for (auto& x : response.rest) {
         printf("%s\n", x.c_str());
@@ -168,6 +473,7 @@ int main(int argc, char** argv) {
     if (command == "request" || command == "r") {
       request.request = true;
     }
+    request.priority = priority;
 
     printf("%s\n", sendRequest(sock, request.toString()).c_str());
   } else if (command == "get") {
@@ -180,6 +486,7 @@ int main(int argc, char** argv) {
     request.request = true;
     request.object = argv[++i];
     request.subject = argv[++i];
+    request.priority = priority;
 
     printf("%s\n", sendRequest(sock, request.toString()).c_str());
   } else if (command == "set") {
@@ -192,27 +499,149 @@ int main(int argc, char** argv) {
     request.object = argv[++i];
     request.subject = argv[++i];
     request.args = {argv[++i]};
+    request.priority = priority;
 
     printf("%s\n", sendRequest(sock, request.toString()).c_str());
   } else if (command == "send") {
-    if (rest_argc == 1) {
+    if (rest_argc != 1) {
       xbus::error("Usage: send REQUEST\n");
       return 1;
     }
     printf("%s\n", sendRequest(sock, argv[++i]).c_str());
+  } else if (command == "pipe") {
+    bool coproc = false;
+    if (rest_argc == 1 && !strcmp("--coproc", argv[i+1])) {
+      coproc = true;
+    } else if (rest_argc != 0) {
+      xbus::error("Usage: pipe [--coproc]");
+      return 1;
+    }
+    return pipeline(sock, coproc);
+  } else if (command == "replay") {
+    double speed = 1;
+    std::string path;
+    for (i++; i < argc; i++) {
+      if (!strcmp("-x", argv[i]) || !strcmp("--speed", argv[i])) {
+        _XBUS_CHECK_ARGV();
+        if (!strcmp("max", argv[++i])) {
+          speed = 0;
+          continue;
+        }
+        try {
+          speed = std::stod(argv[i]);
+        } catch (...) {
+          speed = -1;
+        }
+        if (speed <= 0) {
+          xbus::error("Invalid number for '%s'", argv[i-1]);
+          return 1;
+        }
+      } else {
+        path = argv[i];
+      }
+    }
+    if (path.empty()) {
+      xbus::error("Usage: replay [-x N|max] FILE");
+      return 1;
+    }
+    try {
+      return replay(sock, path, speed);
+    } catch (xbus::IOException& e) {
+      e.print();
+      return 1;
+    }
   } else if (command == "wait") {
-    xbus::error("Unimplemented");
-    return 1;
+    std::string request = "+await";
+    char delimiter = ':';
+    int timeout = -1;
+    for (i++; i < argc; i++) {
+      if (!strcmp("-t", argv[i]) || !strcmp("--timeout", argv[i])) {
+        _XBUS_CHECK_ARGV();
+        try {
+          timeout = std::stoi(argv[++i]);
+        } catch (...) {
+          xbus::error("Invalid number for '%s'", argv[i-1]);
+          return 1;
+        }
+      } else {
+        request += delimiter;
+        request += argv[i];
+        delimiter = ',';
+      }
+    }
+    if (delimiter == ':') {
+      xbus::error("Usage: wait [-t MS] OBJECT [OBJECT...]");
+      return 1;
+    }
+    if (timeout >= 0) {
+      request += ",timeout=" + std::to_string(timeout);
+    }
+    auto response = xbus::Response::fromString(sendRequest(sock, request));
+    if (response.status != "OK") {
+      xbus::error("%s", response.toString().c_str());
+      return 1;
+    }
+  } else if (command == "gather") {
+    std::vector<std::string> args, options;
+    for (i++; i < argc; i++) {
+      if (!strcmp("-t", argv[i]) || !strcmp("--timeout", argv[i])) {
+        _XBUS_CHECK_ARGV();
+        options.push_back(std::string("timeout=") + argv[++i]);
+      } else if (!strcmp("-r", argv[i]) || !strcmp("--reduce", argv[i])) {
+        _XBUS_CHECK_ARGV();
+        options.push_back(std::string("reduce=") + argv[++i]);
+      } else if (!strcmp("-n", argv[i]) || !strcmp("--first", argv[i])) {
+        _XBUS_CHECK_ARGV();
+        options.push_back(std::string("first=") + argv[++i]);
+      } else {
+        args.push_back(argv[i]);
+      }
+    }
+    if (args.size() < 2 || args.size() > 3) {
+      xbus::error("Usage: gather [-t MS] [-r count|sum] [-n N] PATTERN NAME [ARGS]");
+      return 1;
+    }
+    xbus::Request request;
+    request.action = xbus::ACTION_PROPERTY;
+    request.subject = "gather";
+    request.args = {args[0], args[1]};
+    // NAME? is a read, the flag goes after the options
+    if (args[1].size() > 1 && args[1].back() == '?') {
+      request.args[1].pop_back();
+      request.request = true;
+    }
+    if (args.size() == 3) {
+      for (auto& arg : xbus::splitString(args[2], ',')) {
+        request.args.push_back(arg);
+      }
+    }
+    request.args.insert(request.args.end(), options.begin(), options.end());
+    request.priority = priority;
+    printf("%s\n", sendRequest(sock, request.toString()).c_str());
+  } else if (command == "watch") {
+    xbus::Socket socket(sock);
+    socket.connect();
+    socket.writeFrame("+watch");
+    xbus::FrameReader reader(&socket);
+    std::string_view frame;
+    while (reader.next(frame)) {
+      auto request = xbus::RequestView::fromString(frame);
+      if (request.isValid() && request.action == xbus::ACTION_NOTIFY) {
+        printf("%.*s\n", (int) frame.size(), frame.data());
+        fflush(stdout);
+      }
+    }
   } else if (command == "listen") {
     std::string notification;
     if (rest_argc == 1) {
       notification = argv[++i];
     }
-    while (1) {
-      xbus::Socket socket(sock);
-      socket.connect();
-      std::string buffer = socket.read(XBUS_READ_SIZE);
-      auto request = xbus::Request::fromString(buffer);
+    xbus::Socket socket(sock);
+    socket.connect();
+    xbus::FrameReader reader(&socket);
+    std::string_view frame;
+    while (reader.next(frame)) {
+      auto request = xbus::Request::fromString(frame);
       if (request.action == xbus::ACTION_NOTIFY) {
         if (notification.empty()) {
           printf("%s", request.toString().c_str());
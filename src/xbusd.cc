@@ -3,256 +3,2778 @@
 #include <vector>
 #include <atomic>
 #include <mutex>
-#include <queue>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
 #include <map>
+#include <set>
+#include <deque>
+#include <memory>
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstdint>
 
 #include <signal.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
 
 #include <xbus/xbus.h>
-#include <xbus/utils.h>
+#include <xbus/frame.h>
+#include <xbus/arena.h>
 #include <xbus/log.h>
+#include <xbus/utils.h>
+#include <xbus/io.h>
+#include <xbus/executor.h>
+#include <xbus/journal.h>
+#include <xbus/scan.h>
+#include <xbus/compress.h>
+
+#include <mrt/threads/locked.h>
+#include <mrt/threads/future.h>
+#include <mrt/container_utils.h>
+
+// For use in handlers of type (Request) -> Response
+#define _XBUS_EXPECT_ARGS(n) \
+  do { \
+    if (request.args.size() != n) {\
+      return {"ERR", {"ARGUMENT MISMATCH"}};\
+    } \
+  } while (0)
+
+#define _XBUS_EXPECT_ARGS_MIN(n) \
+  do { \
+    if (request.args.size() < n) {\
+      return {"ERR", {"ARGUMENT MISMATCH"}};\
+    } \
+  } while (0)
+
+#define XBUSD_HASH_VNODES 16
+#define XBUSD_PEER_RETRY  1 // Seconds between attempts to reconnect to peer
+#define XBUSD_LOOP_EVENTS 64
+#define XBUSD_KEY_LISTENER 1 // Event loop keys, connections use generation << 32 | fd
+#define XBUSD_KEY_WAKEUP   2
+#define XBUSD_LISTEN_FDS_START 3 // First descriptor passed by service manager with LISTEN_FDS
+#define XBUSD_STREAM_WINDOW 64 // Partial responses buffered per call before object's connection stops being read
+#define XBUSD_HANDOFF_TIMEOUT 5000 // Milliseconds to wait for connections to go idle before handoff
+#define XBUSD_WORKERS_MIN 2   // Default bounds of adaptive worker pool,
+#define XBUSD_WORKERS_MAX 256 // workers block while waiting for objects to respond
+#define XBUSD_JOURNAL_SIZE 64 // Default size of traffic journal, in megabytes
+#define XBUSD_WAIT_QUEUE 64   // Default number of calls waiting for an object that is at its in-flight limit
+#define XBUSD_HEARTBEAT_MIN 10 // Milliseconds, shortest heartbeat interval
+#define XBUSD_HISTORY_DEPTH 16 // Default number of recent notifications kept per subject
+#define XBUSD_GATHER_TIMEOUT 1000 // Milliseconds, default deadline of +gather
+#define XBUSD_SYMBOLS_MAX 65536 // Names that can be interned, by registration or +intern
+#define XBUSD_SYMBOLS_PER_CLIENT 1024 // Names one connection may add with +intern
+#define XBUSD_EXPECT_TIMEOUT 5000 // Milliseconds, default wait for an object from registry snapshot
+
+#define _XBUS_CHECK_ARGV() \
+  do { \
+    if (i + 1 >= argc) { \
+      xbus::error("'%s' requires an option", argv[i]); \
+      usage(argv[0]); \
+      return 1; \
+    } \
+  } while (0)
+
+
+// Calls made by one +gather, woken whenever one of them is answered
+struct Gather {
+  std::mutex mutex;
+  std::condition_variable answered;
+};
+
+struct ResponseContext {
+  mrt::Future<xbus::Response> response;
+  std::atomic<bool> responseInitialized;
+  int responseTag = 0;
+  int callerFd = -1; // Who gets the response, and with what tag
+  int callerTag = 0;
+  std::mutex streamMutex;
+  std::condition_variable streamChanged;
+  std::deque<xbus::Response> stream; // Partial responses not yet passed to caller
+  bool done = false;
+  bool abandoned = false; // Caller stopped waiting, context is deleted by whoever completes it
+  std::shared_ptr<Gather> gather; // Set for calls of +gather, which only take final responses
+};
+
+// Call that was in flight when the previous xbusd handed its connections over
+struct ResumedCall {
+  int callerTag = 0;
+  std::vector<xbus::Socket*> targets;
+  std::vector<ResponseContext*> contexts;
+};
+
+struct ClientContext {
+  xbus::Socket* socket = nullptr;
+  std::vector<ResponseContext*> responses;
+  bool watching = false; // Receives object lifecycle notifications
+  bool peer = false;     // Link to another xbusd
+  std::string peerId;
+  xbus::FrameReader* reader = nullptr;
+  uint64_t ioKey = 0;
+  bool paused = false;   // Not read until a stream is drained, used by event loop only
+  std::mutex queueMutex;
+  std::deque<std::string> queue; // Requests waiting for a worker
+  std::deque<std::string> urgent; // Priority requests, each handled by its own high priority job
+  int drainers = 0;      // Workers handling this connection's requests
+  bool draining = false; // Queue is being handled, one request at a time, except for peers
+  bool closed = false;
+  std::vector<ResumedCall> resumed;
+  std::atomic<int64_t> lastInput = 0; // Steady clock milliseconds
+  std::atomic<int> pingTag = 0;       // Heartbeat that wasn't answered yet
+  int64_t pingSent = 0;
+  bool conflating = false; // Notifications are written by a worker, only the latest per subject if it falls behind
+  bool compression = false; // Accepts compressed responses, negotiated in +version
+  std::vector<std::pair<std::string, std::string>> conflated; // Subject and notification not written yet, under queueMutex
+  bool flushing = false;
+  size_t interned = 0; // Names this connection added with +intern
+
+  // Socket is closed once the last worker holding the context lets go of it,
+  // so that its descriptor isn't reused by a new connection meanwhile
+  ~ClientContext() {
+    delete reader;
+    delete socket;
+  }
+};
+
+// Prepended to each handoff record, followed by size bytes of payload
+struct HandoffHeader {
+  char kind;     // 'L'isten socket, 'S'ymbols, 'C'lient, 'O'bject, 'P'ending call, 'E'nd
+  uint32_t size;
+};
+
+struct CachedField {
+  std::string value;
+  bool valid = false;
+  uint64_t version = 0;
+};
+
+enum class Balance {
+  NONE,           // Single object, second registration is rejected
+  ROUND_ROBIN,
+  LEAST_IN_FLIGHT,
+  HASH            // Consistent hash on one of the call arguments
+};
+
+struct Replica {
+  xbus::Socket* socket = nullptr;
+  int inFlight = 0;
+  std::vector<xbus::Socket*> channels; // More connections of the same process, calls are striped over all of them
+  size_t nextChannel = 0;
+};
+
+struct ObjectContext {
+  xbus::Socket* peer = nullptr; // Object lives on another xbusd, reachable through this link
+  std::vector<Replica> replicas;
+  Balance balance = Balance::NONE;
+  size_t hashArg = 0;
+  size_t next = 0;
+  std::map<uint32_t, xbus::Socket*> ring;
+  std::map<std::string, CachedField, std::less<>> cache; // Only fields that opted in at registration
+  std::set<std::string, std::less<>> coalesce; // Reads of these subjects are shared by concurrent callers
+  int maxInFlight = 0;  // Calls in flight per replica, 0 is unlimited
+  size_t maxWaiting = 0; // Calls waiting for a replica to have room, callers get ERR,BUSY past that
+  size_t waiting = 0;
+  uint64_t rejected = 0;
+  bool ids = false; // Object dispatches on interned IDs, so frames addressed by ID are passed as they are
+  bool direct = false; // Object takes direct links from callers (+connect_direct)
+};
+
+
+static mrt::Locked<std::map<std::string, ObjectContext, std::less<>>> g_objects;
+static mrt::Locked<std::map<int, std::shared_ptr<ClientContext>>> g_clients;
+
+// Bus requests are interned first, in this order, so that their IDs are the same in every xbusd
+enum BusRequest : uint32_t {
+  BUS_CLOSE = 1, BUS_REGISTER, BUS_VERSION, BUS_PING, BUS_LIST, BUS_FD, BUS_STATS, BUS_PEER, BUS_HANDOFF,
+  BUS_AWAIT, BUS_GATHER, BUS_RESOLVE, BUS_WATCH, BUS_UNWATCH, BUS_CONFLATE, BUS_UNCONFLATE, BUS_HISTORY,
+  BUS_CONNECT_DIRECT, BUS_ACCEPT_DIRECT, BUS_INTERN
+};
+static const char* g_busRequests[] = {
+  "close", "register", "version", "ping", "list", "fd", "stats", "peer", "handoff",
+  "await", "gather", "resolve", "watch", "unwatch", "conflate", "unconflate", "history",
+  "connect_direct", "accept_direct", "intern"
+};
+
+// Object and subject names, interned at registration and by +intern
+static xbus::SymbolTable g_symbols(XBUSD_SYMBOLS_MAX);
+static std::vector<ObjectContext*> g_objectIndex; // By ID of object's name, under g_objects lock
+
+// Signalled on every registration, used by +await
+static std::mutex g_registryMutex;
+static std::condition_variable g_registryChanged;
+
+// Objects from registry snapshot (-S), calls to them wait for registration instead of failing.
+// Local objects that register are added and the file is rewritten, so next start knows them
+static std::string g_snapshot;
+static std::set<std::string> g_expected; // Under g_registryMutex
+static int g_expectTimeout = XBUSD_EXPECT_TIMEOUT;
+
+// Signalled when a call to an object with in-flight limit finishes, or replicas change
+static std::mutex g_slotsMutex;
+static std::condition_variable g_slotFreed;
+static int g_defaultMaxInFlight = 0;
+static size_t g_defaultMaxWaiting = XBUSD_WAIT_QUEUE;
+static std::atomic<uint64_t> g_rejected = 0;
+
+// Read made for the first of concurrent identical requests, the rest wait for its response
+struct SharedRead {
+  bool done = false;
+  xbus::Response response;
+};
+
+static std::mutex g_readsMutex;
+static std::condition_variable g_readDone;
+static std::map<std::string, std::shared_ptr<SharedRead>, std::less<>> g_reads; // By request, without tag
+static std::atomic<uint64_t> g_coalesced = 0;
+
+// Held across picking recipients and writing to them, so that everyone gets notifications in the same
+// order, while g_clients is only held for the picking
+static std::mutex g_broadcastMutex;
+
+// Recent notifications by subject, oldest first, sent to late subscribers with +history
+static std::mutex g_historyMutex;
+static std::map<std::string, std::deque<std::string>, std::less<>> g_history;
+static size_t g_historyDepth = XBUSD_HISTORY_DEPTH;
+static std::atomic<uint64_t> g_conflated = 0; // Notifications replaced by newer ones before being written
+
+// Object ends of direct links, until the object takes them with +accept_direct
+struct DirectLink {
+  int fd;
+  xbus::Socket* object; // Connection the object was asked on, only compared when it closes
+  pid_t pid;            // Of the object, the connection taking the end must come from the same process
+};
+
+static mrt::Locked<std::map<uint64_t, DirectLink>> g_directLinks; // By token
+static std::atomic<uint64_t> g_nextDirectLink = 1;
+
+static std::atomic<int> g_nextTag = 0;
+static std::string g_daemonId;
+
+// One thread reads every connection, requests are queued per connection and handled by workers
+static xbus::IoBackend* g_io = nullptr;
+static xbus::Executor* g_workers = nullptr;
+static int g_wakeup = -1; // eventfd of event loop
+static std::mutex g_loopMutex;
+static std::vector<int> g_adoptQueue;  // Connections to start reading
+static std::vector<int> g_resumeQueue; // Paused connections, whose streams were drained
+static std::atomic<uint32_t> g_ioGeneration = 0;
+static xbus::Journal g_journal; // Traffic recording, if enabled
+
+// Signalled when connection is closed, used by peer dialers
+static std::mutex g_closedMutex;
+static std::condition_variable g_clientClosed;
+
+// Handoff: every thread that touches the registry counts itself busy,
+// and parks once g_handoff is set, so that state can be copied consistently
+static std::atomic<bool> g_handoff = false;
+static std::atomic<int> g_busy = 0;
+static std::mutex g_handoffMutex;
+static std::condition_variable g_handoffResumed;
+static xbus::Socket* g_listener = nullptr;
+static int g_heartbeat = 0; // Milliseconds, 0 if objects are not pinged
+
+
+static void sigpipe_handler(int) {
+  xbus::warning("SIGPIPE");
+}
+
+static int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Context of a connection, created if there is none. Called with g_clients locked
+static ClientContext& clientAt(std::map<int, std::shared_ptr<ClientContext>>& clients, int fd) {
+  auto& ctx = clients[fd];
+  if (!ctx) {
+    ctx = std::make_shared<ClientContext>();
+  }
+  return *ctx;
+}
+
+static void createCtx(xbus::Socket* socket) {
+  g_clients.update([socket](auto& clients) {
+    auto& ctx = clientAt(clients, socket->fd());
+    ctx.socket = socket;
+    ctx.reader = new xbus::FrameReader(socket);
+    ctx.lastInput = nowMs();
+  });
+}
+
+// Context stays valid while it's held, even if the connection is cleaned meanwhile
+static std::shared_ptr<ClientContext> findClient(int fd) {
+  std::shared_ptr<ClientContext> ctx;
+  g_clients.withLocked([fd, &ctx](auto& clients) {
+    auto itr = clients.find(fd);
+    if (itr != clients.end()) {
+      ctx = itr->second;
+    }
+  });
+  return ctx;
+}
+
+// Rebuilds index of objects by ID, called with g_objects locked whenever objects are added or removed
+static void reindexObjects(std::map<std::string, ObjectContext, std::less<>>& objects) {
+  std::fill(g_objectIndex.begin(), g_objectIndex.end(), nullptr);
+  for (auto& p : objects) {
+    uint32_t id = g_symbols.intern(p.first);
+    if (!id) continue;
+    if (id >= g_objectIndex.size()) {
+      g_objectIndex.resize(id + 1);
+    }
+    g_objectIndex[id] = &p.second;
+  }
+}
+
+// Object addressed by ID is found by index, otherwise by name. Called with g_objects locked
+static ObjectContext* findObject(std::map<std::string, ObjectContext, std::less<>>& objects, const xbus::RequestView& request) {
+  if (request.objectId) {
+    return request.objectId < g_objectIndex.size() ? g_objectIndex[request.objectId] : nullptr;
+  }
+  auto itr = objects.find(request.object);
+  return itr == objects.end() ? nullptr : &itr->second;
+}
+
+static void wakeLoop() {
+  uint64_t one = 1;
+  ::write(g_wakeup, &one, sizeof(one));
+}
+
+static void postToLoop(std::vector<int>& queue, int fd) {
+  {
+    std::unique_lock lock(g_loopMutex);
+    queue.push_back(fd);
+  }
+  wakeLoop();
+}
+
+// Tags of forwarded requests must be unique among calls in flight on a connection,
+// as peer links multiplex calls from many clients
+static int nextTag() {
+  int tag;
+  do {
+    tag = ++g_nextTag & 0x7fffffff;
+  } while (!tag);
+  return tag;
+}
+
+static bool isPeer(xbus::Socket* client) {
+  bool peer = false;
+  g_clients.withLocked([client, &peer](auto& clients) {
+    auto itr = clients.find(client->fd());
+    peer = itr != clients.end() && itr->second->peer;
+  });
+  return peer;
+}
+
+// Blocks while handoff is in progress, returns once it was aborted
+static void parkForHandoff() {
+  g_busy--;
+  std::unique_lock lock(g_handoffMutex);
+  g_handoffResumed.wait(lock, []() { return !g_handoff; });
+  g_busy++;
+}
+
+// Request that is waiting for something is put back in front of its connection's queue,
+// so that next xbusd handles it as if it wasn't read yet. Taken back out if handoff is aborted
+static void requeueForHandoff(xbus::Socket* client, std::string_view frame) {
+  auto ctx = findClient(client->fd());
+  {
+    std::unique_lock queueLock(ctx->queueMutex);
+    ctx->queue.emplace_front(frame);
+  }
+  parkForHandoff();
+  {
+    std::unique_lock queueLock(ctx->queueMutex);
+    ctx->queue.pop_front();
+  }
+}
+
+// Response context is registered before the request is written,
+// so that a fast reply can't arrive before anyone waits for it
+static ResponseContext* expectResponse(xbus::Socket* socket, int tag, xbus::Socket* caller = nullptr, int callerTag = 0) {
+  ResponseContext* ctx = new ResponseContext;
+  ctx->responseTag = tag;
+  ctx->callerFd = caller ? caller->fd() : -1;
+  ctx->callerTag = callerTag;
+  ctx->responseInitialized.store(true);
+
+  g_clients.update([socket, ctx](auto& clients) {
+    clientAt(clients, socket->fd()).responses.push_back(ctx);
+  });
+
+  xbus::rdebug("[%d]: expectResponse (%p) tag=%d", socket->fd(), ctx, tag);
+
+  return ctx;
+}
+
+// Final response wakes up the caller, ResponseContext is then owned by it.
+// Returns false if the caller gave up waiting, the context is then left to the one who completed it
+static bool completeResponse(ResponseContext* ctx, const xbus::Response& response) {
+  auto gather = ctx->gather;
+  ctx->response.set(response);
+  ctx->responseInitialized.store(false);
+  std::unique_lock lock(ctx->streamMutex);
+  ctx->done = true;
+  bool abandoned = ctx->abandoned;
+  lock.unlock();
+  ctx->streamChanged.notify_all();
+  if (gather) {
+    std::unique_lock gatherLock(gather->mutex);
+    gather->answered.notify_all();
+  }
+  return !abandoned;
+}
+
+// Forgets a finished call on the object's connection
+static void releaseResponse(int fd, ResponseContext* ctx) {
+  g_clients.update([fd, ctx](auto& clients) {
+    auto itr = clients.find(fd);
+    if (itr == clients.end()) return;
+    auto& responses = itr->second->responses;
+    responses.erase(std::remove(responses.begin(), responses.end(), ctx), responses.end());
+  });
+  delete ctx;
+}
+
+// Partial responses are passed to onChunk as they come. If it fails,
+// the rest of the stream is still drained, so that the object isn't blocked
+static xbus::Response awaitResponse(xbus::Socket* socket, ResponseContext* ctx, const std::function<void(xbus::Response&)>& onChunk) {
+  // Object's socket is gone once the call is failed by its disconnect
+  int fd = socket->fd();
+  bool dropping = false;
+  std::unique_lock lock(ctx->streamMutex);
+  while (1) {
+    // Waiting for a response doesn't hold up handoff, the call is carried over
+    g_busy--;
+    ctx->streamChanged.wait(lock, [ctx]() { return ctx->done || !ctx->stream.empty(); });
+    g_busy++;
+    if (ctx->stream.empty()) break;
+
+    xbus::Response chunk = std::move(ctx->stream.front());
+    bool full = ctx->stream.size() >= XBUSD_STREAM_WINDOW;
+    ctx->stream.pop_front();
+    lock.unlock();
+    if (full) {
+      postToLoop(g_resumeQueue, fd);
+    }
+    if (!dropping) {
+      try {
+        onChunk(chunk);
+      } catch (xbus::IOException& e) {
+        e.print();
+        dropping = true;
+      }
+    }
+    lock.lock();
+  }
+  lock.unlock();
+  xbus::Response response = ctx->response.get();
+
+  xbus::rdebug("[%d]: awaitResponse (%p) tag=%d: got response '%s'", fd, ctx, ctx->responseTag, response.toString().c_str());
+  releaseResponse(fd, ctx);
+  return response;
+}
+
+// FNV-1a
+static uint32_t hashBytes(const void* data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ ((const uint8_t*) data)[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void rebuildRing(ObjectContext& object) {
+  object.ring.clear();
+  if (object.balance != Balance::HASH) return;
+  for (auto& replica : object.replicas) {
+    for (int vnode = 0; vnode < XBUSD_HASH_VNODES; vnode++) {
+      int point[2] = {replica.socket->fd(), vnode};
+      object.ring[hashBytes(point, sizeof(point))] = replica.socket;
+    }
+  }
+}
+
+static void wakeWaiters() {
+  std::unique_lock lock(g_slotsMutex);
+  g_slotFreed.notify_all();
+}
+
+static bool ownsConnection(const Replica& replica, xbus::Socket* socket) {
+  return replica.socket == socket || std::find(replica.channels.begin(), replica.channels.end(), socket) != replica.channels.end();
+}
+
+// Calls to a replica go round-robin over its connections, each of them is read by its own thread in the object
+static xbus::Socket* pickChannel(Replica& replica) {
+  if (replica.channels.empty()) {
+    return replica.socket;
+  }
+  size_t index = replica.nextChannel++ % (replica.channels.size() + 1);
+  return index ? replica.channels[index - 1] : replica.socket;
+}
+
+// Must be called with g_objects locked. Returns nullptr if the replica that should get the call
+// (or every replica, unless calls are hashed) is at the in-flight limit
+static xbus::Socket* pickReplica(ObjectContext& object, const xbus::RequestView& request) {
+  auto full = [&object](Replica& r) { return object.maxInFlight && r.inFlight >= object.maxInFlight; };
+  auto roundRobin = [&object, &full]() {
+    Replica* r = nullptr;
+    for (size_t i = 0; i < object.replicas.size(); i++) {
+      r = &object.replicas[object.next++ % object.replicas.size()];
+      if (!full(*r)) break;
+    }
+    return r;
+  };
+
+  Replica* replica = &object.replicas[0];
+  switch (object.balance) {
+    case Balance::ROUND_ROBIN:
+      replica = roundRobin();
+      break;
+    case Balance::LEAST_IN_FLIGHT:
+      for (auto& r : object.replicas) {
+        if (r.inFlight < replica->inFlight) replica = &r;
+      }
+      break;
+    case Balance::HASH:
+      if (request.args.size() > object.hashArg) {
+        auto arg = request.args[object.hashArg];
+        auto point = object.ring.lower_bound(hashBytes(arg.data(), arg.size()));
+        if (point == object.ring.end()) point = object.ring.begin();
+        for (auto& r : object.replicas) {
+          if (r.socket == point->second) replica = &r;
+        }
+      } else {
+        replica = roundRobin();
+      }
+      break;
+    default:
+      break;
+  }
+  if (full(*replica)) {
+    return nullptr;
+  }
+  replica->inFlight++;
+  return pickChannel(*replica);
+}
+
+static void finishCall(std::string_view name, const std::vector<xbus::Socket*>& targets) {
+  bool waiters = false;
+  g_objects.withLocked([name, &targets, &waiters](auto& objects) {
+    auto itr = objects.find(name);
+    if (itr == objects.end()) return;
+    for (auto& replica : itr->second.replicas) {
+      for (auto target : targets) {
+        if (ownsConnection(replica, target)) {
+          replica.inFlight--;
+          break;
+        }
+      }
+    }
+    waiters = itr->second.waiting > 0;
+  });
+  if (waiters) {
+    wakeWaiters();
+  }
+}
+
+// Parks the caller until a replica of the object has room for the call, the wait is bounded
+// by object's queue length. Returns nullptr if the queue is full (busy) or object is gone
+static xbus::Socket* waitForReplica(const xbus::RequestView& request, xbus::Socket* client, bool& busy) {
+  xbus::Socket* target = nullptr;
+  bool queued = false, gone = false;
+  busy = false;
+
+  std::unique_lock lock(g_slotsMutex);
+  while (1) {
+    g_objects.withLocked([&](auto& objects) {
+      auto found = findObject(objects, request);
+      if (!found || found->peer) {
+        gone = true;
+        return;
+      }
+      auto& object = *found;
+      target = pickReplica(object, request);
+      if (target) {
+        if (queued && object.waiting) object.waiting--;
+      } else if (!queued && object.waiting >= object.maxWaiting) {
+        object.rejected++;
+        busy = true;
+      } else if (!queued) {
+        object.waiting++;
+        queued = true;
+      }
+    });
+    if (target || gone || busy) break;
+
+    if (!g_handoff) {
+      g_busy--;
+      g_slotFreed.wait(lock);
+      g_busy++;
+    }
+
+    if (g_handoff) {
+      // Call is handed off as if it wasn't read yet
+      g_objects.withLocked([&request](auto& objects) {
+        auto object = findObject(objects, request);
+        if (object && object->waiting) object->waiting--;
+      });
+      queued = false;
+      lock.unlock();
+      requeueForHandoff(client, request.frame);
+      lock.lock();
+    }
+  }
+
+  if (busy) {
+    g_rejected++;
+  }
+  return target;
+}
+
+// Registry snapshot is a file with one object name per line, missing file is an empty one
+static bool loadSnapshot(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    return errno == ENOENT;
+  }
+  char* line = nullptr;
+  size_t size = 0;
+  ssize_t length;
+  while ((length = getline(&line, &size, file)) != -1) {
+    std::string name(line, length);
+    while (!name.empty() && isspace(name.back())) {
+      name.pop_back();
+    }
+    if (!name.empty()) {
+      g_expected.insert(name);
+    }
+  }
+  free(line);
+  fclose(file);
+  return true;
+}
+
+// Written to a temporary file and renamed, so a crash never leaves a partial snapshot
+static void saveSnapshot() {
+  std::string temp = g_snapshot + ".tmp";
+  FILE* file = fopen(temp.c_str(), "w");
+  if (!file) {
+    xbus::warning("Can't write registry snapshot '%s'", temp.c_str());
+    return;
+  }
+  for (auto& name : g_expected) {
+    fprintf(file, "%s\n", name.c_str());
+  }
+  if (fclose(file) || rename(temp.c_str(), g_snapshot.c_str())) {
+    xbus::warning("Can't write registry snapshot '%s'", g_snapshot.c_str());
+  }
+}
+
+static void rememberObject(const std::string& name) {
+  if (g_snapshot.empty()) return;
+  std::unique_lock lock(g_registryMutex);
+  if (g_expected.insert(name).second) {
+    saveSnapshot();
+  }
+}
+
+// Parks a call to an object from registry snapshot until the object registers.
+// Returns false if the object isn't expected or didn't register in time
+static bool waitForObject(const xbus::RequestView& request, xbus::Socket* client) {
+  if (g_snapshot.empty()) return false;
+  std::string name(request.object);
+  auto registered = [&name]() {
+    bool found = false;
+    g_objects.withLocked([&name, &found](auto& objects) {
+      found = objects.find(name) != objects.end();
+    });
+    return found;
+  };
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(g_expectTimeout);
+  std::unique_lock lock(g_registryMutex);
+  if (!g_expected.count(name)) return false;
+  xbus::rdebug("[%d]: waiting for expected object '%s'", client->fd(), name.c_str());
+  while (1) {
+    bool done = g_registryChanged.wait_until(lock, deadline, [&registered]() { return g_handoff || registered(); });
+    if (!g_handoff) {
+      return done;
+    }
+    // Next xbusd waits for the object again, if it has the snapshot too
+    lock.unlock();
+    requeueForHandoff(client, request.frame);
+    lock.lock();
+  }
+}
+
+// Sends '!registered:NAME' or '!unregistered:NAME' to clients that asked for it with +watch.
+// Peers are told only about local objects, so that routes don't loop
+static void notifyLifecycle(const std::string& event, const std::string& name, bool local = true) {
+  if (event == "registered") {
+    std::unique_lock lock(g_registryMutex);
+    g_registryChanged.notify_all();
+  }
+
+  // Watchers are written to after g_clients is released, their contexts keep the sockets open until then
+  std::string notification = "!" + event + ":" + name;
+  std::vector<std::shared_ptr<ClientContext>> held;
+  std::vector<xbus::Socket*> watchers;
+  std::unique_lock lock(g_broadcastMutex);
+  g_clients.withLocked([&](auto& clients) {
+    for (auto& clientCtx : clients) {
+      if (clientCtx.second->watching && !(clientCtx.second->peer && !local)) {
+        held.push_back(clientCtx.second);
+        watchers.push_back(clientCtx.second->socket);
+      }
+    }
+  });
+  g_io->broadcast(watchers, notification);
+}
+
+static pid_t peerPid(xbus::Socket* socket) {
+  ucred credentials;
+  socklen_t length = sizeof(credentials);
+  if (getsockopt(socket->fd(), SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1) {
+    return -1;
+  }
+  return credentials.pid;
+}
+
+// +register:NAME,channel=ID - adds connection to the replica of NAME registered on connection ID,
+// calls to the replica are then striped over its connections. Both must belong to one process
+static xbus::Response registerChannel(const xbus::Request& request, xbus::Socket* client, int primary) {
+  auto& name = request.args[0];
+  auto findReplica = [&name, primary](auto& objects) -> Replica* {
+    auto itr = objects.find(name);
+    if (itr == objects.end() || itr->second.peer) return nullptr;
+    for (auto& replica : itr->second.replicas) {
+      if (replica.socket->fd() == primary) return &replica;
+    }
+    return nullptr;
+  };
+
+  xbus::Response response = {"ERR", {"NO SUCH REPLICA", name}};
+  g_objects.withLocked([&](auto& objects) {
+    if (auto replica = findReplica(objects)) {
+      pid_t pid = peerPid(client);
+      response = pid != -1 && pid == peerPid(replica->socket) ? xbus::Response{"OK"} : xbus::Response{"ERR", {"NOT SAME PROCESS"}};
+    }
+  });
+  if (response.status != "OK") {
+    return response;
+  }
+
+  // Answered before the connection is given calls
+  response.tag = request.tag;
+  client->writeFrame(response.toString());
+  size_t channels = 0;
+  g_objects.withLocked([&](auto& objects) {
+    if (auto replica = findReplica(objects)) {
+      replica->channels.push_back(client);
+      channels = replica->channels.size() + 1;
+    }
+  });
+  xbus::rinfo("[%d]: register '%s' (channel %zu of [%d])", client->fd(), name.c_str(), channels, primary);
+  return {""};
+}
+
+// +connect_direct:NAME - creates a socket pair, answers OK with one end attached (SCM_RIGHTS) and asks
+// a replica of NAME with +direct:TOKEN to fetch the other one, so that the caller can talk to it without xbusd.
+// Only for local objects that registered with 'direct', and only if xbusd keeps nothing for them:
+// calls over the link would bypass limits, coalescing and the field cache
+static xbus::Response connectDirect(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS(1);
+  xbus::Socket* object = nullptr;
+  bool found = false;
+  g_objects.withLocked([&](auto& objects) {
+    auto itr = objects.find(request.args[0]);
+    found = itr != objects.end();
+    if (!found) return;
+    auto& o = itr->second;
+    if (!o.peer && o.direct && !o.maxInFlight && o.coalesce.empty() && o.cache.empty()) {
+      object = o.replicas[o.next++ % o.replicas.size()].socket;
+    }
+  });
+  if (!object) {
+    return {"ERR", {found ? "NO DIRECT LINK" : "NO SUCH OBJECT"}};
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+    xbus::rerror("[%d]: socketpair failed: %s", client->fd(), strerror(errno));
+    return {"ERR", {"NO DIRECT LINK"}};
+  }
+  uint64_t token = g_nextDirectLink++;
+  pid_t pid = peerPid(object);
+  g_directLinks.update([token, fds, object, pid](auto& links) {
+    links[token] = {fds[1], object, pid};
+  });
+
+  xbus::Response response = {"OK"};
+  response.tag = request.tag;
+  try {
+    object->writeFrame("+direct:" + std::to_string(token));
+    client->sendFd(response.toString() + '\0', fds[0]);
+  } catch (xbus::IOException& e) {
+    e.print();
+  }
+  ::close(fds[0]);
+  xbus::rinfo("[%d]: direct link %llu to '%s' [%d]", client->fd(), (unsigned long long) token, request.args[0].c_str(), object->fd());
+  return {""};
+}
+
+// +accept_direct:TOKEN - answers OK with the object end of a direct link attached
+static xbus::Response acceptDirect(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS(1);
+  uint64_t token = strtoull(request.args[0].c_str(), nullptr, 10);
+  DirectLink link = {-1, nullptr, -1};
+  g_directLinks.update([token, &link](auto& links) {
+    auto itr = links.find(token);
+    if (itr != links.end()) {
+      link = itr->second;
+      links.erase(itr);
+    }
+  });
+  if (link.fd == -1) {
+    return {"ERR", {"NO SUCH LINK"}};
+  }
+
+  // Whoever knows the token must still come from the object's process
+  pid_t pid = peerPid(client);
+  xbus::Response response = {"ERR", {"NOT SAME PROCESS"}};
+  if (pid != -1 && pid == link.pid) {
+    response = {"OK"};
+  }
+  response.tag = request.tag;
+  try {
+    client->sendFd(response.toString() + '\0', response.status == "OK" ? link.fd : -1);
+  } catch (xbus::IOException& e) {
+    e.print();
+  }
+  ::close(link.fd);
+  return {""};
+}
+
+// Replicas must cache the same fields, the values themselves are filled in later
+static bool sameCachedFields(const ObjectContext& a, const ObjectContext& b) {
+  return std::equal(a.cache.begin(), a.cache.end(), b.cache.begin(), b.cache.end(),
+    [](auto& x, auto& y) { return x.first == y.first; });
+}
+
+static xbus::Response registerObject(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS_MIN(1);
+
+  ObjectContext object;
+  int channelOf = -1;
+  object.maxInFlight = g_defaultMaxInFlight;
+  object.maxWaiting = g_defaultMaxWaiting;
+  for (size_t i = 1; i < request.args.size(); i++) {
+    auto& option = request.args[i];
+    if (option.rfind("cache=", 0) == 0) {
+      object.cache[option.substr(6)];
+    } else if (option.rfind("coalesce=", 0) == 0) {
+      object.coalesce.insert(option.substr(9));
+    } else if (option == "ids") {
+      object.ids = true;
+    } else if (option == "direct") {
+      object.direct = true;
+    } else if (option.rfind("channel=", 0) == 0) {
+      try {
+        channelOf = std::stoi(option.substr(8));
+      } catch (...) {
+        return {"ERR", {"INVALID OPTION", option}};
+      }
+    } else if (option == "group=rr") {
+      object.balance = Balance::ROUND_ROBIN;
+    } else if (option == "group=least") {
+      object.balance = Balance::LEAST_IN_FLIGHT;
+    } else if (option == "group=hash") {
+      object.balance = Balance::HASH;
+    } else if (option.rfind("key=", 0) == 0) {
+      try {
+        object.hashArg = std::stoul(option.substr(4));
+      } catch (...) {
+        return {"ERR", {"INVALID OPTION", option}};
+      }
+    } else if (option.rfind("limit=", 0) == 0 || option.rfind("queue=", 0) == 0) {
+      try {
+        size_t value = std::stoul(option.substr(6));
+        if (option[0] == 'l') {
+          object.maxInFlight = value;
+        } else {
+          object.maxWaiting = value;
+        }
+      } catch (...) {
+        return {"ERR", {"INVALID OPTION", option}};
+      }
+    } else {
+      return {"ERR", {"UNKNOWN OPTION", option}};
+    }
+  }
+  if (channelOf != -1) {
+    return registerChannel(request, client, channelOf);
+  }
+
+  auto& name = request.args[0];
+  xbus::Response response = {"OK"};
+  size_t replicas = 1;
+  bool created = false;
+
+  g_objects.withLocked([&](auto& objects) {
+    auto itr = objects.find(name);
+    // Local object shadows one from a peer
+    if (itr == objects.end() || itr->second.peer) {
+      object.replicas.push_back({client});
+      rebuildRing(object);
+      objects[name] = std::move(object);
+      reindexObjects(objects);
+      created = true;
+      return;
+    }
+    auto& group = itr->second;
+    bool registered = std::find_if(group.replicas.begin(), group.replicas.end(),
+      [client](auto& replica) { return replica.socket == client; }) != group.replicas.end();
+    if (object.balance == Balance::NONE || registered) {
+      response = {"ERR", {"ALREADY REGISTERED", name}};
+    } else if (group.balance != object.balance || group.hashArg != object.hashArg
+            || group.maxInFlight != object.maxInFlight || group.maxWaiting != object.maxWaiting
+            || group.coalesce != object.coalesce || group.ids != object.ids
+            || group.direct != object.direct || !sameCachedFields(group, object)) {
+      response = {"ERR", {"GROUP MISMATCH", name}};
+    } else {
+      group.replicas.push_back({client});
+      rebuildRing(group);
+      replicas = group.replicas.size();
+    }
+  });
+
+  if (response.status != "OK") {
+    return response;
+  }
+  xbus::rinfo("[%d]: register '%s' (replica %zu)", client->fd(), name.c_str(), replicas);
+
+  // Answered before waiting calls are let through, so that none reaches the object ahead of it
+  response.tag = request.tag;
+  client->writeFrame(response.toString());
+
+  // New replica can take calls that wait for the group
+  if (!created) {
+    wakeWaiters();
+  } else {
+    notifyLifecycle("registered", name);
+    rememberObject(name);
+  }
+  return {""};
+}
+
+static void registerRemote(const std::string& name, xbus::Socket* link) {
+  bool created = false;
+  g_objects.withLocked([&name, link, &created](auto& objects) {
+    if (objects.find(name) != objects.end()) return;
+    objects[name].peer = link;
+    reindexObjects(objects);
+    created = true;
+  });
+  if (created) {
+    xbus::rinfo("[%d]: register remote '%s'", link->fd(), name.c_str());
+    notifyLifecycle("registered", name, false);
+  }
+}
+
+static void unregisterRemote(const std::string& name, xbus::Socket* link) {
+  bool removed = false;
+  g_objects.withLocked([&name, link, &removed](auto& objects) {
+    auto itr = objects.find(name);
+    if (itr == objects.end() || itr->second.peer != link) return;
+    objects.erase(itr);
+    reindexObjects(objects);
+    removed = true;
+  });
+  if (removed) {
+    notifyLifecycle("unregistered", name, false);
+  }
+}
+
+static std::vector<std::string> localObjects() {
+  std::vector<std::string> names;
+  g_objects.withLocked([&names](auto& objects) {
+    for (auto& p : objects) {
+      if (!p.second.peer) {
+        names.push_back(p.first);
+      }
+    }
+  });
+  return names;
+}
+
+// Marks connection as a link to daemon `id`, at most one link per daemon is allowed
+static bool addPeer(xbus::Socket* link, const std::string& id) {
+  bool added = true;
+  g_clients.withLocked([link, &id, &added](auto& clients) {
+    for (auto& p : clients) {
+      if (p.second->peerId == id) {
+        added = false;
+        return;
+      }
+    }
+    auto& ctx = clientAt(clients, link->fd());
+    ctx.peer = true;
+    ctx.peerId = id;
+    ctx.watching = true;
+  });
+  return added;
+}
+
+// +peer:ID[,OBJECT...] - sent by other xbusd, replies with own id and local objects
+static xbus::Response acceptPeer(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS_MIN(1);
+
+  if (request.args[0] == g_daemonId) {
+    return {"ERR", {"SELF"}};
+  }
+  if (!addPeer(client, request.args[0])) {
+    return {"ERR", {"ALREADY PEERED", request.args[0]}};
+  }
+
+  xbus::rinfo("[%d]: peer '%s'", client->fd(), request.args[0].c_str());
+  for (size_t i = 1; i < request.args.size(); i++) {
+    registerRemote(request.args[i], client);
+  }
+
+  auto names = localObjects();
+  names.insert(names.begin(), g_daemonId);
+  return {"OK", std::move(names)};
+}
+
+// Parks the caller until all objects are registered, or timeout expires
+static xbus::Response awaitObjects(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS_MIN(1);
+
+  std::vector<std::string> names;
+  int timeout = -1;
+  for (auto& arg : request.args) {
+    if (arg.rfind("timeout=", 0) == 0) {
+      try {
+        timeout = std::stoi(arg.substr(8));
+      } catch (...) {
+        return {"ERR", {"INVALID OPTION", arg}};
+      }
+    } else {
+      names.push_back(arg);
+    }
+  }
+
+  std::vector<std::string> missing;
+  auto ready = [&names, &missing]() {
+    missing.clear();
+    g_objects.withLocked([&names, &missing](auto& objects) {
+      for (auto& name : names) {
+        if (objects.find(name) == objects.end()) {
+          missing.push_back(name);
+        }
+      }
+    });
+    return missing.empty();
+  };
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  std::unique_lock lock(g_registryMutex);
+  while (1) {
+    auto done = [&ready]() { return g_handoff || ready(); };
+    if (timeout < 0) {
+      g_registryChanged.wait(lock, done);
+    } else if (!g_registryChanged.wait_until(lock, deadline, done)) {
+      missing.insert(missing.begin(), "TIMEOUT");
+      return {"ERR", missing};
+    }
+    if (!g_handoff) {
+      return {"OK"};
+    }
+
+    // Next xbusd continues waiting, as if the client sent +await again
+    xbus::Request again = request;
+    again.args = names;
+    if (timeout >= 0) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      again.args.push_back("timeout=" + std::to_string(std::max<long>(left.count(), 0)));
+    }
+    lock.unlock();
+    requeueForHandoff(client, again.toString());
+    lock.lock();
+  }
+}
+
+// Waits until all threads are parked or waiting for responses from objects
+static bool waitQuiet() {
+  auto answered = []() {
+    bool found = false;
+    g_clients.withLocked([&found](auto& clients) {
+      for (auto& p : clients) {
+        for (auto ctx : p.second->responses) {
+          std::unique_lock lock(ctx->streamMutex);
+          found |= !ctx->responseInitialized || !ctx->stream.empty();
+        }
+      }
+    });
+    return found;
+  };
+
+  int stable = 0;
+  for (int waited = 0; waited < XBUSD_HANDOFF_TIMEOUT; waited += 10) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    stable = !answered() && g_busy == 0 ? stable + 1 : 0;
+    if (stable == 2) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void sendHandoffRecord(xbus::Socket* link, char kind, std::string_view payload, int fd = -1) {
+  HandoffHeader header = {kind, (uint32_t) payload.size()};
+  std::string data((const char*) &header, sizeof(header));
+  data.append(payload);
+  link->sendFd(data, fd);
+}
+
+static void sendState(xbus::Socket* link) {
+  sendHandoffRecord(link, 'L', "", g_listener->fd());
+
+  // Clients keep using IDs they resolved, so they are interned in the same order before anything else
+  std::string symbols;
+  for (auto& name : g_symbols.names()) {
+    symbols += name + "\n";
+  }
+  sendHandoffRecord(link, 'S', symbols);
+
+  g_clients.withLocked([link](auto& clients) {
+    for (auto& p : clients) {
+      if (p.first == link->fd()) continue;
+      auto& ctx = *p.second;
+      // Input that wasn't handled yet, in order it came
+      std::string payload = std::to_string(p.first) + "\n" + (ctx.watching ? "1" : "0") + (ctx.peer ? "1" : "0") + (ctx.conflating ? "1" : "0") + (ctx.compression ? "1" : "0") + "\n" + ctx.peerId + "\n";
+      for (auto& frame : ctx.urgent) {
+        payload.append(frame);
+        payload.push_back('\0');
+      }
+      for (auto& frame : ctx.queue) {
+        payload.append(frame);
+        payload.push_back('\0');
+      }
+      if (ctx.reader) {
+        payload.append(ctx.reader->pending());
+      }
+      sendHandoffRecord(link, 'C', payload, p.first);
+    }
+    for (auto& p : clients) {
+      for (auto ctx : p.second->responses) {
+        std::unique_lock lock(ctx->streamMutex);
+        if (ctx->abandoned) continue;
+        lock.unlock();
+        sendHandoffRecord(link, 'P', std::to_string(p.first) + "\n" + std::to_string(ctx->responseTag) + "\n" +
+          std::to_string(ctx->callerFd) + "\n" + std::to_string(ctx->callerTag));
+      }
+    }
+  });
+
+  g_objects.withLocked([link](auto& objects) {
+    for (auto& p : objects) {
+      auto& object = p.second;
+      std::string replicas, cache, coalesce;
+      // Replica's channels follow its connection, separated by commas
+      for (auto& replica : object.replicas) {
+        replicas += std::to_string(replica.socket->fd());
+        for (auto channel : replica.channels) {
+          replicas += "," + std::to_string(channel->fd());
+        }
+        replicas += " ";
+      }
+      for (auto& field : object.cache) {
+        cache += field.first + " ";
+      }
+      for (auto& subject : object.coalesce) {
+        coalesce += subject + " ";
+      }
+      sendHandoffRecord(link, 'O', p.first + "\n" + std::to_string(object.peer ? object.peer->fd() : -1) + "\n" +
+        std::to_string((int) object.balance) + "\n" + std::to_string(object.hashArg) + "\n" + replicas + "\n" + cache + "\n" +
+        std::to_string(object.maxInFlight) + "\n" + std::to_string(object.maxWaiting) + "\n" + coalesce + "\n" +
+        (object.ids ? "1" : "0") + "\n" + (object.direct ? "1" : "0"));
+    }
+  });
+
+  sendHandoffRecord(link, 'E', std::to_string(g_nextTag.load()));
+}
+
+// +handoff - sent by new xbusd started with -u. It gets listening socket, all connections,
+// registry and calls in flight, then this process exits
+static xbus::Response handoff(xbus::Socket* client) {
+  if (g_handoff.exchange(true)) {
+    return {"ERR", {"BUSY"}};
+  }
+  xbus::rinfo("[%d]: handoff requested", client->fd());
+
+  wakeLoop();
+  {
+    std::unique_lock lock(g_registryMutex);
+    g_registryChanged.notify_all();
+  }
+  wakeWaiters();
+  {
+    std::unique_lock lock(g_readsMutex);
+    g_readDone.notify_all();
+  }
+
+  g_busy--;
+  if (waitQuiet()) {
+    try {
+      sendState(client);
+      char ack[8];
+      if (client->read(ack, sizeof(ack)) > 0) {
+        xbus::info("handed off to new xbusd, exiting");
+        fflush(stdout);
+        _exit(0);
+      }
+    } catch (xbus::IOException& e) {
+      e.print();
+    }
+  }
+
+  xbus::rwarning("[%d]: handoff aborted", client->fd());
+  {
+    std::unique_lock lock(g_handoffMutex);
+    g_handoff = false;
+  }
+  g_handoffResumed.notify_all();
+  g_busy++;
+  return {"ERR", {"HANDOFF FAILED"}};
+}
+
+// +version[:NAME][,compress=lz] - compression is accepted by echoing it back
+static xbus::Response negotiateVersion(const xbus::Request& request, xbus::Socket* client) {
+  xbus::Response response = {"OK", {XBUS_VERSION}};
+  if (std::find(request.args.begin(), request.args.end(), XBUS_COMPRESSION) != request.args.end()) {
+    g_clients.update([client](auto& clients) {
+      clientAt(clients, client->fd()).compression = true;
+    });
+    response.rest.push_back(XBUS_COMPRESSION);
+  }
+  return response;
+}
+
+// Compressed responses are forwarded as they came, only callers that didn't negotiate compression get them expanded
+static void expandFor(xbus::Socket* client, xbus::Response& response) {
+  if (!xbus::isCompressed(response)) return;
+  bool accepted = false;
+  g_clients.withLocked([client, &accepted](auto& clients) {
+    auto itr = clients.find(client->fd());
+    accepted = itr != clients.end() && itr->second->compression;
+  });
+  if (!accepted) {
+    xbus::expandResponse(response);
+  }
+}
+
+// +stats:NAME - admission state of an object
+static xbus::Response objectStats(const std::string& name) {
+  xbus::Response response = {"ERR", {"NO SUCH OBJECT"}};
+  g_objects.withLocked([&name, &response](auto& objects) {
+    auto itr = objects.find(name);
+    if (itr == objects.end() || itr->second.peer) return;
+    auto& object = itr->second;
+    int inFlight = 0;
+    size_t channels = 0;
+    for (auto& replica : object.replicas) {
+      inFlight += replica.inFlight;
+      channels += replica.channels.size() + 1;
+    }
+    response = {"OK", {
+      "replicas=" + std::to_string(object.replicas.size()),
+      "channels=" + std::to_string(channels),
+      "in_flight=" + std::to_string(inFlight),
+      "limit=" + std::to_string(object.maxInFlight),
+      "waiting=" + std::to_string(object.waiting),
+      "queue=" + std::to_string(object.maxWaiting),
+      "rejected=" + std::to_string(object.rejected)
+    }};
+  });
+  return response;
+}
+
+static void forwardRequest(xbus::Socket* object, const xbus::RequestView& request, int tag) {
+  char tagBuffer[16];
+  int tagSize = snprintf(tagBuffer, sizeof(tagBuffer), "#%d", tag);
+  iovec iov[3] = {
+    {(void*) request.frame.data(), request.tagOffset},
+    {tagBuffer, (size_t) tagSize},
+    {(void*) "", 1}
+  };
+  object->writev(iov, 3);
+}
+
+// Calls a property of every object whose name matches a glob, all at once. Replies are streamed
+// as MORE,NAME,STATUS[,REST...] in the order they come, objects that didn't answer by the deadline
+// get ERR,TIMEOUT. Final response is OK,N with the number of successful replies, or the reduction
+static xbus::Response gatherCalls(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS_MIN(2);
+
+  int timeout = XBUSD_GATHER_TIMEOUT;
+  size_t first = 0; // Stop after that many successful replies
+  std::string reduce, args;
+  // Gather that is a read (+gather:PATTERN,NAME[,OPTION ...]?) reads the property of every object,
+  // the flag ends the arguments, so it comes after the options
+  const std::string& name = request.args[1];
+  bool read = request.request;
+  for (size_t i = 2; i < request.args.size(); i++) {
+    auto& arg = request.args[i];
+    if (arg == "reduce=count" || arg == "reduce=sum") {
+      reduce = arg.substr(7);
+    } else if (arg.rfind("timeout=", 0) == 0 || arg.rfind("first=", 0) == 0) {
+      try {
+        if (arg[0] == 't') {
+          timeout = std::stoi(arg.substr(8));
+        } else {
+          first = std::stoul(arg.substr(6));
+        }
+      } catch (...) {
+        return {"ERR", {"INVALID OPTION", arg}};
+      }
+    } else {
+      args += (args.empty() ? ":" : ",") + arg;
+    }
+  }
+
+  struct Call {
+    std::string name;
+    std::string frame;
+    xbus::Socket* target = nullptr;
+    ResponseContext* ctx = nullptr;
+    xbus::Response reply;
+  };
+  auto gather = std::make_shared<Gather>();
+  std::vector<Call> calls;
+  xbus::Arena arena;
+
+  g_objects.withLocked([&](auto& objects) {
+    for (auto& p : objects) {
+      if (fnmatch(request.args[0].c_str(), p.first.c_str(), 0) != 0) continue;
+      Call call;
+      call.name = p.first;
+      call.frame = p.first + "+" + name + args + (read ? "?" : "");
+      if (p.second.peer) {
+        call.target = p.second.peer;
+      } else if (!(call.target = pickReplica(p.second, xbus::RequestView::fromString(call.frame, &arena)))) {
+        call.reply = {"ERR", {"BUSY"}};
+        p.second.rejected++;
+        g_rejected++;
+      }
+      calls.push_back(std::move(call));
+    }
+  });
+
+  size_t succeeded = 0;
+  double sum = 0;
+  bool dropping = false;
+  auto emit = [&](const std::string& name, xbus::Response reply) {
+    // Replies are merged into one stream and reduced here, so they can't stay compressed
+    xbus::expandResponse(reply);
+    if (reply.status == "OK") {
+      succeeded++;
+      if (!reply.rest.empty()) {
+        char* end;
+        double value = strtod(reply.rest[0].c_str(), &end);
+        sum += *end ? 0 : value;
+      }
+    }
+    if (!reduce.empty() || dropping || (first && (reply.status != "OK" || succeeded > first))) return;
+    xbus::Response chunk = {xbus::STATUS_MORE, {name, reply.status}};
+    chunk.rest.insert(chunk.rest.end(), reply.rest.begin(), reply.rest.end());
+    chunk.tag = request.tag;
+    try {
+      client->writeFrame(chunk.toString());
+    } catch (xbus::IOException& e) {
+      e.print();
+      dropping = true;
+    }
+  };
+  auto finish = [](Call& call, const xbus::Response& reply) {
+    if (call.reply.status.empty()) {
+      call.reply = reply;
+    }
+    finishCall(call.name, {call.target});
+    call.ctx = nullptr;
+  };
+  // Call that won't be waited for anymore is released, or left to whoever completes it
+  auto abandon = [](Call& call) {
+    std::unique_lock lock(call.ctx->streamMutex);
+    if (call.ctx->done) {
+      lock.unlock();
+      releaseResponse(call.target->fd(), call.ctx);
+    } else {
+      call.ctx->abandoned = true;
+    }
+  };
+
+  // Calls that couldn't be sent are answered right away, not at the deadline
+  size_t pending = 0;
+  for (auto& call : calls) {
+    if (!call.target) {
+      emit(call.name, call.reply);
+      continue;
+    }
+    call.ctx = expectResponse(call.target, nextTag(), client, request.tag);
+    call.ctx->gather = gather;
+    try {
+      forwardRequest(call.target, xbus::RequestView::fromString(call.frame, &arena), call.ctx->responseTag);
+      pending++;
+    } catch (xbus::IOException& e) {
+      abandon(call);
+      finish(call, {"ERR", {"OBJECT GONE"}});
+      emit(call.name, call.reply);
+    }
+  }
+
+  // Replies are taken as they come, not in order of calls
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  std::vector<Call*> answered;
+  auto takeAnswered = [&calls, &answered]() {
+    answered.clear();
+    for (auto& call : calls) {
+      if (!call.ctx) continue;
+      std::unique_lock lock(call.ctx->streamMutex);
+      if (call.ctx->done) {
+        answered.push_back(&call);
+      }
+    }
+    return !answered.empty();
+  };
+  while (pending && !(first && succeeded >= first)) {
+    {
+      std::unique_lock lock(gather->mutex);
+      if (!gather->answered.wait_until(lock, deadline, takeAnswered)) break;
+    }
+    for (auto call : answered) {
+      auto reply = call->ctx->response.get();
+      releaseResponse(call->target->fd(), call->ctx);
+      finish(*call, reply);
+      emit(call->name, call->reply);
+      pending--;
+    }
+  }
+
+  // Calls that are still out are answered to nobody
+  for (auto& call : calls) {
+    if (!call.ctx) continue;
+    abandon(call);
+    finish(call, {"ERR", {"TIMEOUT"}});
+    if (!first) {
+      emit(call.name, call.reply);
+    }
+  }
+
+  if (reduce == "sum") {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.15g", sum);
+    return {"OK", {buffer}};
+  }
+  return {"OK", {std::to_string(first ? std::min(first, succeeded) : succeeded)}};
+}
+
+static void cleanClient(xbus::Socket* client);
+
+// Worker task, writes notifications queued for a conflating connection.
+// While it's blocked on a slow reader, newer notifications replace queued ones of the same subject
+static void flushConflated(void* arg) {
+  xbus::Socket* client = (xbus::Socket*) arg;
+  g_busy++;
+  auto ctx = findClient(client->fd());
+  bool closed = false;
+  while (1) {
+    if (g_handoff) {
+      parkForHandoff();
+      continue;
+    }
+
+    std::unique_lock lock(ctx->queueMutex);
+    if (ctx->conflated.empty()) {
+      ctx->flushing = false;
+      closed = --ctx->drainers == 0 && ctx->closed && ctx->queue.empty();
+      break;
+    }
+    auto notifications = std::move(ctx->conflated);
+    ctx->conflated.clear();
+    lock.unlock();
+
+    try {
+      for (auto& notification : notifications) {
+        client->writeFrame(notification.second);
+      }
+    } catch (xbus::IOException& e) {
+      e.print();
+    }
+  }
+
+  if (closed) {
+    cleanClient(client);
+  }
+  g_busy--;
+}
+
+// Keeps notification for +history and delivers it to everyone but the sender, returns number of recipients.
+// Conflating connections get it from their own worker task, so that a slow reader doesn't hold up the rest
+static int publishNotification(const xbus::Request& request, xbus::Socket* sender, bool fromPeer) {
+  std::string notification = request.toString();
+  if (g_historyDepth) {
+    std::unique_lock lock(g_historyMutex);
+    auto& recent = g_history[request.subject];
+    recent.push_back(notification);
+    if (recent.size() > g_historyDepth) {
+      recent.pop_front();
+    }
+  }
+
+  // Recipients are written to after g_clients is released, so that a slow one doesn't hold up
+  // client lookups; their contexts keep the sockets open until then
+  int count = 0;
+  std::vector<xbus::Socket*> flush, recipients;
+  std::vector<std::shared_ptr<ClientContext>> held;
+  std::unique_lock broadcast(g_broadcastMutex);
+  g_clients.withLocked([&](auto& clients) {
+    for (auto& clientCtx : clients) {
+      auto& ctx = *clientCtx.second;
+      if (ctx.socket == sender || (fromPeer && ctx.peer)) continue;
+      count++;
+      if (!ctx.conflating) {
+        held.push_back(clientCtx.second);
+        recipients.push_back(ctx.socket);
+        continue;
+      }
+
+      std::unique_lock lock(ctx.queueMutex);
+      if (ctx.closed) continue;
+      auto queued = std::find_if(ctx.conflated.begin(), ctx.conflated.end(),
+        [&request](auto& p) { return p.first == request.subject; });
+      if (queued != ctx.conflated.end()) {
+        queued->second = notification;
+        g_conflated++;
+      } else {
+        ctx.conflated.emplace_back(request.subject, notification);
+      }
+      if (!ctx.flushing) {
+        ctx.flushing = true;
+        ctx.drainers++;
+        flush.push_back(ctx.socket);
+      }
+    }
+  });
+  g_io->broadcast(recipients, notification);
+  broadcast.unlock();
+
+  for (auto socket : flush) {
+    g_workers->submit(flushConflated, socket);
+  }
+  return count;
+}
+
+// Writes up to N recent notifications of a subject to the caller, oldest first
+static xbus::Response sendHistory(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS_MIN(1);
+  size_t limit = SIZE_MAX;
+  if (request.args.size() > 1) {
+    try {
+      limit = std::stoul(request.args[1]);
+    } catch (...) {
+      return {"ERR", {"INVALID ARGUMENT", request.args[1]}};
+    }
+  }
+
+  std::vector<std::string> notifications;
+  {
+    std::unique_lock lock(g_historyMutex);
+    auto itr = g_history.find(request.args[0]);
+    if (itr != g_history.end()) {
+      size_t skip = itr->second.size() - std::min(limit, itr->second.size());
+      notifications.assign(itr->second.begin() + skip, itr->second.end());
+    }
+  }
+  for (auto& notification : notifications) {
+    client->writeFrame(notification);
+  }
+  return {"OK", {std::to_string(notifications.size())}};
+}
+
+static xbus::Response busStats() {
+  size_t clients = 0, objects = 0, waiting = 0;
+  g_clients.withLocked([&clients](auto& c) { clients = c.size(); });
+  g_objects.withLocked([&objects, &waiting](auto& o) {
+    objects = o.size();
+    for (auto& p : o) {
+      waiting += p.second.waiting;
+    }
+  });
+  auto workers = g_workers->stats();
+  return {"OK", {
+    std::string("backend=") + g_io->name(),
+    "clients=" + std::to_string(clients),
+    "objects=" + std::to_string(objects),
+    "workers=" + std::to_string(workers.threads),
+    "workers_min=" + std::to_string(workers.minThreads),
+    "workers_max=" + std::to_string(workers.maxThreads),
+    "busy=" + std::to_string(workers.busy),
+    "queued=" + std::to_string(workers.queued),
+    "latency_us=" + std::to_string(workers.latencyUs),
+    "waiting=" + std::to_string(waiting),
+    "rejected=" + std::to_string(g_rejected.load()),
+    "coalesced=" + std::to_string(g_coalesced.load()),
+    "conflated=" + std::to_string(g_conflated.load())
+  }};
+}
+
+// Interns names, replies with their IDs in the same order
+// +resolve:NAME[,NAME ...] - IDs of names that registered objects, or objects about to register, interned
+static xbus::Response resolveNames(const xbus::Request& request) {
+  _XBUS_EXPECT_ARGS_MIN(1);
+  std::vector<std::string> ids;
+  for (auto& name : request.args) {
+    uint32_t id = g_symbols.find(name);
+    if (!id) {
+      return {"ERR", {"UNKNOWN NAME", name}};
+    }
+    ids.push_back(std::to_string(id));
+  }
+  return {"OK", ids};
+}
+
+// +intern:NAME[,NAME ...] - sent by an object for its properties and fields before it registers.
+// Interned names stay for the daemon's lifetime, so every connection may only add a few
+static xbus::Response internNames(const xbus::Request& request, xbus::Socket* client) {
+  _XBUS_EXPECT_ARGS_MIN(1);
+  size_t added = 0;
+  for (auto& name : request.args) {
+    if (name.empty() || name[0] == '$') {
+      return {"ERR", {"INVALID NAME", name}};
+    }
+    added += !g_symbols.find(name);
+  }
+  bool allowed = false;
+  g_clients.update([client, added, &allowed](auto& clients) {
+    auto& ctx = clientAt(clients, client->fd());
+    if (ctx.interned + added <= XBUSD_SYMBOLS_PER_CLIENT) {
+      ctx.interned += added;
+      allowed = true;
+    }
+  });
+  if (!allowed) {
+    return {"ERR", {"TOO MANY NAMES"}};
+  }
+
+  std::vector<std::string> ids;
+  for (auto& name : request.args) {
+    uint32_t id = g_symbols.intern(name);
+    if (!id) {
+      return {"ERR", {"TOO MANY NAMES"}};
+    }
+    ids.push_back(std::to_string(id));
+  }
+  return {"OK", ids};
+}
+
+static xbus::Response handleBusRequest(const xbus::Request& request, xbus::Socket* client) {
+  xbus::Response response = {"ERR", {"UNKNOWN ACTION"}};
+  if (request.action == xbus::ACTION_PROPERTY) {
+    uint32_t id = request.subjectId ? request.subjectId : g_symbols.find(request.subject);
+    switch (id) {
+      case BUS_CLOSE:
+        return {""};
+      case BUS_REGISTER:
+        response = registerObject(request, client);
+        break;
+      case BUS_VERSION:
+        response = negotiateVersion(request, client);
+        break;
+      case BUS_PING:
+        response = {"OK"};
+        break;
+      case BUS_LIST:
+        g_objects.withLocked([&response](auto& objects) {
+          std::vector<std::string> objectNames;
+          for (auto& p : objects) {
+            objectNames.push_back(p.first);
+          }
+          response = {"OK", objectNames};
+        });
+        break;
+      case BUS_FD:
+        response = {"OK", {std::to_string(client->fd())}};
+        break;
+      case BUS_STATS:
+        if (request.args.size() == 1) {
+          response = objectStats(request.args[0]);
+        } else {
+          response = busStats();
+        }
+        break;
+      case BUS_PEER:
+        response = acceptPeer(request, client);
+        break;
+      case BUS_HANDOFF:
+        response = handoff(client);
+        break;
+      case BUS_AWAIT:
+        response = awaitObjects(request, client);
+        break;
+      case BUS_GATHER:
+        response = gatherCalls(request, client);
+        break;
+      case BUS_RESOLVE:
+        response = resolveNames(request);
+        break;
+      case BUS_WATCH:
+      case BUS_UNWATCH: {
+        bool watching = id == BUS_WATCH;
+        g_clients.update([client, watching](auto& clients) {
+          clientAt(clients, client->fd()).watching = watching;
+        });
+        response = {"OK"};
+        break;
+      }
+      case BUS_CONFLATE:
+      case BUS_UNCONFLATE: {
+        bool conflating = id == BUS_CONFLATE;
+        g_clients.update([client, conflating](auto& clients) {
+          clientAt(clients, client->fd()).conflating = conflating;
+        });
+        response = {"OK"};
+        break;
+      }
+      case BUS_HISTORY:
+        response = sendHistory(request, client);
+        break;
+      case BUS_CONNECT_DIRECT:
+        response = connectDirect(request, client);
+        break;
+      case BUS_ACCEPT_DIRECT:
+        response = acceptDirect(request, client);
+        break;
+      case BUS_INTERN:
+        response = internNames(request, client);
+        break;
+      default:
+        response = {"ERR", {"UNKNOWN PROPERTY"}};
+        break;
+    }
+  } else if (request.action == xbus::ACTION_NOTIFY) {
+    // Notifications from a peer are already delivered to other peers by it,
+    // so they only go to local clients, and are not replied to
+    bool fromPeer = isPeer(client);
+    if (fromPeer && request.args.size() == 1 && request.subject == "registered") {
+      registerRemote(request.args[0], client);
+      return {""};
+    } else if (fromPeer && request.args.size() == 1 && request.subject == "unregistered") {
+      unregisterRemote(request.args[0], client);
+      return {""};
+    }
+
+    int count = publishNotification(request, client, fromPeer);
+    if (fromPeer) {
+      return {""};
+    }
+    response = {"OK", {"SENT", std::to_string(count)}};
+  } else if (request.action == xbus::ACTION_FIELD) {
+    // Object pushes new value of its cached field
+    _XBUS_EXPECT_ARGS(1);
+    bool updated = false;
+    g_objects.withLocked([&request, &updated, client](auto& objects) {
+      for (auto& p : objects) {
+        bool owner = std::find_if(p.second.replicas.begin(), p.second.replicas.end(),
+          [client](auto& replica) { return replica.socket == client; }) != p.second.replicas.end();
+        auto field = p.second.cache.find(request.subject);
+        if (owner && field != p.second.cache.end()) {
+          field->second.value = request.args[0];
+          field->second.valid = true;
+          field->second.version++;
+          updated = true;
+        }
+      }
+    });
+    if (request.async) {
+      return {""};
+    }
+    response = updated ? xbus::Response{"OK"} : xbus::Response{"ERR", {"NOT CACHED"}};
+  }
+  return response;
+}
+
+// Fills or invalidates cached field from the object's response,
+// unless the field was set or pushed since the request was forwarded
+static void updateCache(const xbus::RequestView& request, xbus::Response response, uint64_t version) {
+  // Cached value is what a get returns, not how the object happened to send it
+  xbus::expandResponse(response);
+  g_objects.withLocked([&](auto& objects) {
+    auto object = findObject(objects, request);
+    if (!object) return;
+    auto field = object->cache.find(request.subject);
+    if (field == object->cache.end() || field->second.version != version) return;
+    if (response.status != "OK") {
+      field->second.valid = false;
+    } else if (request.request && response.rest.size() == 1) {
+      field->second.value = response.rest[0];
+      field->second.valid = true;
+    } else if (!request.request && request.args.size() == 1) {
+      field->second.value = request.args[0];
+      field->second.valid = true;
+    }
+  });
+}
+
+// Waits for the response to the read made by the first of identical requests
+static xbus::Response joinRead(const xbus::RequestView& request, xbus::Socket* client, const std::shared_ptr<SharedRead>& read) {
+  std::unique_lock lock(g_readsMutex);
+  while (1) {
+    if (!read->done && !g_handoff) {
+      g_busy--;
+      g_readDone.wait(lock, [&read]() { return read->done || g_handoff; });
+      g_busy++;
+    }
+    if (read->done) {
+      g_coalesced++;
+      return read->response;
+    }
+    lock.unlock();
+    requeueForHandoff(client, request.frame);
+    lock.lock();
+  }
+}
+
+static void finishRead(const xbus::RequestView& request, const std::shared_ptr<SharedRead>& read, const xbus::Response& response) {
+  {
+    std::unique_lock lock(g_readsMutex);
+    read->response = response;
+    read->done = true;
+    auto itr = g_reads.find(request.frame.substr(0, request.tagOffset));
+    if (itr != g_reads.end() && itr->second == read) {
+      g_reads.erase(itr);
+    }
+  }
+  g_readDone.notify_all();
+}
+
+// Broadcast set succeeds only if every replica accepted it
+static xbus::Response collectResponses(xbus::Socket* client, int tag, const std::vector<xbus::Socket*>& targets, const std::vector<ResponseContext*>& contexts) {
+  auto forwardChunk = [client, tag](xbus::Response& chunk) {
+    chunk.tag = tag;
+    expandFor(client, chunk);
+    client->writeFrame(chunk.toString());
+  };
+  xbus::Response response = {"ERR"};
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto reply = awaitResponse(targets[i], contexts[i], forwardChunk);
+    xbus::rdebug("[%d]: recv response from %d: '%s'", client->fd(), targets[i]->fd(), reply.toString().c_str());
+    if (i == 0 || (response.status == "OK" && reply.status != "OK")) {
+      response = std::move(reply);
+    }
+  }
+  return response;
+}
+
+// Frame of a request addressed by ID, with names of its object and subject put back
+static std::string namedFrame(const xbus::RequestView& request) {
+  auto frame = request.frame;
+  size_t index = xbus::findDelimiter(frame, "+-!");
+  while (index < frame.size() && !xbus::isNameChar(frame[index]) && frame[index] != '$') {
+    index++;
+  }
+  if (index < frame.size() && frame[index] == '$') {
+    index++;
+  }
+  while (index < frame.size() && xbus::isNameChar(frame[index])) {
+    index++;
+  }
+  std::string named;
+  named.reserve(request.object.size() + request.action.size() + request.subject.size() + frame.size() - index);
+  named.append(request.object).append(request.action).append(request.subject).append(frame.substr(index));
+  return named;
+}
+
+static void handleRequest(const xbus::RequestView& request, xbus::Socket* client) {
+  xbus::rinfo("[%d]: recv '%.*s'", client->fd(), (int) request.frame.size(), request.frame.data());
+
+  xbus::Response response = {"ERR"};
+  if (request.object.empty()) {
+    response = handleBusRequest(request.toRequest(), client);
+    if (response.status.empty()) {
+      return;
+    }
+  } else {
+    std::vector<xbus::Socket*> targets;
+    bool found = false, cached = false, hit = false, full = false, busy = false, joined = false, rewrite = false;
+    uint64_t version = 0;
+    std::shared_ptr<SharedRead> read;
+
+    // Notifications and field sets go to every replica, the rest to one of them
+    bool broadcast = request.action == xbus::ACTION_NOTIFY || (request.action == xbus::ACTION_FIELD && !request.request);
+
+    auto route = [&](auto& objects) {
+      auto itr = findObject(objects, request);
+      if (!itr) return;
+      found = true;
+      auto& object = *itr;
+      // IDs mean nothing to peers and to objects that didn't opt in
+      rewrite = (request.objectId || request.subjectId) && (object.peer || !object.ids);
+
+      if (object.peer) {
+        targets.push_back(object.peer);
+        return;
+      }
+
+      if (request.action == xbus::ACTION_FIELD) {
+        auto field = object.cache.find(request.subject);
+        if (field != object.cache.end()) {
+          cached = true;
+          if (request.request && field->second.valid) {
+            response = {"OK", {field->second.value}};
+            hit = true;
+            return;
+          } else if (!request.request) {
+            field->second.valid = false;
+            field->second.version++;
+          }
+          version = field->second.version;
+        }
+      }
+
+      if (request.request && object.coalesce.count(request.subject)) {
+        auto key = request.frame.substr(0, request.tagOffset);
+        std::unique_lock lock(g_readsMutex);
+        auto shared = g_reads.find(key);
+        if (shared != g_reads.end()) {
+          read = shared->second;
+          joined = true;
+          return;
+        }
+        read = std::make_shared<SharedRead>();
+        g_reads.emplace(key, read);
+      }
+
+      if (broadcast) {
+        for (auto& replica : object.replicas) {
+          replica.inFlight++;
+          targets.push_back(replica.socket);
+        }
+      } else if (auto target = pickReplica(object, request)) {
+        targets.push_back(target);
+      } else {
+        full = true;
+      }
+    };
+    g_objects.withLocked(route);
+    if (!found && waitForObject(request, client)) {
+      g_objects.withLocked(route);
+    }
+
+    if (full) {
+      if (auto target = waitForReplica(request, client, busy)) {
+        targets.push_back(target);
+      } else {
+        found = busy;
+      }
+    }
+
+    std::string frame;
+    xbus::RequestView named;
+    if (rewrite) {
+      frame = namedFrame(request);
+      named = xbus::RequestView::fromString(frame);
+    }
+    auto& forwarded = rewrite ? named : request;
+
+    if (!found) {
+      response = {"ERR", {"NO SUCH OBJECT"}};
+    } else if (joined) {
+      response = joinRead(request, client, read);
+    } else if (busy) {
+      response = {"ERR", {"BUSY"}};
+    } else if (hit) {
+      xbus::rdebug("[%d]: cache hit '%.*s'", client->fd(), (int) request.frame.size(), request.frame.data());
+    } else if (request.action == xbus::ACTION_NOTIFY) {
+      for (auto target : targets) {
+        forwardRequest(target, forwarded, nextTag());
+      }
+      response = {"OK", {"SENT"}};
+    } else {
+      std::vector<ResponseContext*> contexts;
+      int tag = nextTag();
+      try {
+        for (auto target : targets) {
+          contexts.push_back(expectResponse(target, tag, client, request.tag));
+          forwardRequest(target, forwarded, tag);
+        }
+      } catch (xbus::IOException& e) {
+        if (read) {
+          finishRead(request, read, {"ERR", {"OBJECT GONE"}});
+        }
+        throw;
+      }
+      response = collectResponses(client, request.tag, targets, contexts);
+      if (cached) {
+        updateCache(request, response, version);
+      }
+    }
+
+    // Identical reads that came in meanwhile get the same response
+    if (read && !joined) {
+      finishRead(request, read, response);
+    }
+
+    if (!targets.empty()) {
+      finishCall(request.object, targets);
+    }
+  }
+  // Peers don't expect replies to notifications
+  if (request.action == xbus::ACTION_NOTIFY && isPeer(client)) {
+    return;
+  }
+  // Caller's tag is echoed, so that pipelined requests can be matched with responses
+  response.tag = request.tag;
+  expandFor(client, response);
+  client->writeFrame(response.toString());
+}
+
+static void cleanClient(xbus::Socket* client) {
+  int fd = client->fd();
+  std::vector<std::string> unregistered;
+  g_objects.withLocked([client, &unregistered](auto& objects) {
+    size_t count = objects.size();
+    for (auto it = objects.begin(); it != objects.end();) {
+      if (it->second.peer) {
+        it = it->second.peer == client ? objects.erase(it) : std::next(it);
+        continue;
+      }
+      auto& replicas = it->second.replicas;
+      replicas.erase(std::remove_if(replicas.begin(), replicas.end(),
+        [client](auto& replica) { return replica.socket == client; }), replicas.end());
+      for (auto& replica : replicas) {
+        auto& channels = replica.channels;
+        channels.erase(std::remove(channels.begin(), channels.end(), client), channels.end());
+      }
+      if (replicas.empty()) {
+        unregistered.push_back(it->first);
+        it = objects.erase(it);
+      } else {
+        rebuildRing(it->second);
+        ++it;
+      }
+    }
+    if (objects.size() != count) {
+      reindexObjects(objects);
+    }
+  });
+
+  // Direct links the object didn't take yet are closed, callers see them broken and go through xbusd
+  g_directLinks.update([client](auto& links) {
+    for (auto itr = links.begin(); itr != links.end();) {
+      if (itr->second.object == client) {
+        ::close(itr->second.fd);
+        itr = links.erase(itr);
+      } else {
+        ++itr;
+      }
+    }
+  });
+
+  std::vector<ResponseContext*> pending;
+  std::shared_ptr<ClientContext> ctx;
+  g_clients.withLocked([client, &pending, &ctx](auto& clients) {
+    auto itr = clients.find(client->fd());
+    if (itr != clients.end()) {
+      ctx = std::move(itr->second);
+      pending = std::move(ctx->responses);
+      clients.erase(itr);
+    }
+  });
+
+  // Callers waiting for this connection to answer are failed right away
+  for (auto call : pending) {
+    if (!completeResponse(call, {"ERR", {"OBJECT GONE"}})) {
+      delete call;
+    }
+  }
+  if (!pending.empty()) {
+    xbus::rwarning("[%d]: failed %zu pending calls", fd, pending.size());
+  }
+
+  if (xbus::Journal* journal = xbus::Journal::recording()) {
+    journal->record(xbus::Journal::CLOSE, fd);
+  }
+  // Socket goes with its context, unless a worker still holds that
+  if (ctx) {
+    ctx.reset();
+  } else {
+    delete client;
+  }
+
+  {
+    std::unique_lock lock(g_closedMutex);
+    g_clientClosed.notify_all();
+  }
+  // Calls waiting for objects that are gone fail
+  if (!unregistered.empty()) {
+    wakeWaiters();
+  }
+
+  for (auto& name : unregistered) {
+    notifyLifecycle("unregistered", name);
+  }
+
+  xbus::rinfo("[%d] disconnected", fd);
+}
+
+// Finishes calls carried over from previous xbusd, before any new input is processed
+static void resumeCalls(xbus::Socket* client) {
+  std::vector<ResumedCall> resumed;
+  g_clients.update([client, &resumed](auto& clients) {
+    std::swap(resumed, clientAt(clients, client->fd()).resumed);
+  });
+  for (auto& call : resumed) {
+    auto response = collectResponses(client, call.callerTag, call.targets, call.contexts);
+    response.tag = call.callerTag;
+    expandFor(client, response);
+    client->writeFrame(response.toString());
+  }
+}
+
+// Names of a request addressed by IDs are looked up once, the frame is still forwarded as it came
+static void dispatchRequest(std::string_view frame, xbus::Socket* client, xbus::Arena& arena) {
+  auto request = xbus::RequestView::fromString(frame, &arena);
+  if (request.objectId) {
+    request.object = g_symbols.name(request.objectId);
+  }
+  if (request.subjectId) {
+    request.subject = g_symbols.name(request.subjectId);
+  }
+  if ((request.objectId && request.object.empty()) || (request.subjectId && request.subject.empty())) {
+    xbus::Response response = {"ERR", {"UNKNOWN ID"}};
+    response.tag = request.tag;
+    client->writeFrame(response.toString());
+    return;
+  }
+  handleRequest(request, client);
+}
 
-#include <mrt/threads/pool.h>
-#include <mrt/threads/task.h>
-#include <mrt/threads/locked.h>
-#include <mrt/threads/future.h>
-#include <mrt/container_utils.h>
+// Worker task, handles queued requests of a connection in order.
+// Calls from a peer are multiplexed, so every one of them gets its own task
+static void drainClient(void* arg) {
+  xbus::Socket* client = (xbus::Socket*) arg;
+  g_busy++;
+  auto ctx = findClient(client->fd());
+  try {
+    resumeCalls(client);
+  } catch (xbus::IOException& e) {
+    e.print();
+  }
 
-// For use in handlers of type (Request) -> Response
-#define _XBUS_EXPECT_ARGS(n) \
-  do { \
-    if (request.args.size() != n) {\
-      return {"ERR", {"ARGUMENT MISMATCH"}};\
-    } \
-  } while (0)
+  xbus::Arena arena;
+  bool closed = false;
+  while (1) {
+    // Requests that weren't taken yet go to the next xbusd
+    if (g_handoff) {
+      parkForHandoff();
+      continue;
+    }
 
-#define _XBUS_CHECK_ARGV() \
-  do { \
-    if (i + 1 >= argc) { \
-      xbus::error("'%s' requires an option", argv[i]); \
-      usage(argv[0]); \
-      return 1; \
-    } \
-  } while (0)
+    std::unique_lock lock(ctx->queueMutex);
+    if (ctx->queue.empty()) {
+      ctx->draining = false;
+      closed = --ctx->drainers == 0 && ctx->closed;
+      break;
+    }
+    std::string frame = std::move(ctx->queue.front());
+    ctx->queue.pop_front();
+    lock.unlock();
 
+    arena.reset();
+    try {
+      dispatchRequest(frame, client, arena);
+    } catch (xbus::IOException& e) {
+      e.print();
+    }
 
-struct ResponseContext {
-  mrt::Future<xbus::Response> response;
-  std::atomic<bool> responseInitialized;
-  int responseTargetFd = 0;
-};
+    if (ctx->peer) {
+      lock.lock();
+      closed = --ctx->drainers == 0 && ctx->closed && ctx->queue.empty();
+      break;
+    }
+  }
 
-struct ClientContext {
-  xbus::Socket* socket = nullptr;
-  std::vector<ResponseContext*> responses;
-};
+  if (closed) {
+    cleanClient(client);
+  }
+  g_busy--;
+}
 
+// Tagged priority request overtakes requests queued on its connection, and calls in progress on it
+static void drainUrgent(void* arg) {
+  xbus::Socket* client = (xbus::Socket*) arg;
+  g_busy++;
+  auto ctx = findClient(client->fd());
+  while (g_handoff) {
+    parkForHandoff();
+  }
 
-static mrt::Locked<std::map<std::string, xbus::Socket*>> g_objects;
-static mrt::Locked<std::map<int, ClientContext>> g_clients;
+  std::unique_lock lock(ctx->queueMutex);
+  std::string frame = std::move(ctx->urgent.front());
+  ctx->urgent.pop_front();
+  lock.unlock();
 
+  xbus::Arena arena;
+  try {
+    dispatchRequest(frame, client, arena);
+  } catch (xbus::IOException& e) {
+    e.print();
+  }
 
-static void sigpipe_handler(int) {
-  xbus::warning("SIGPIPE");
+  lock.lock();
+  bool closed = --ctx->drainers == 0 && ctx->closed && ctx->queue.empty();
+  lock.unlock();
+  if (closed) {
+    cleanClient(client);
+  }
+  g_busy--;
 }
 
-static void createCtx(xbus::Socket* socket) {
-  g_clients.update([socket](auto& clients) {
-    clients[socket->fd()].socket = socket;
-  });
+// Only tagged priority requests overtake the queue, as their caller can tell responses apart.
+// Untagged ones keep their place, the queue is then drained on the high priority lane
+static void enqueueRequest(ClientContext* ctx, std::string_view frame, bool priority, bool tagged) {
+  bool schedule = false;
+  bool overtake = priority && tagged;
+  {
+    std::unique_lock lock(ctx->queueMutex);
+    if (overtake) {
+      ctx->urgent.emplace_back(frame);
+      ctx->drainers++;
+    } else {
+      ctx->queue.emplace_back(frame);
+      if (ctx->peer || !ctx->draining) {
+        ctx->draining = !ctx->peer;
+        ctx->drainers++;
+        schedule = true;
+      }
+    }
+  }
+  if (overtake) {
+    g_workers->submit(drainUrgent, ctx->socket, xbus::Executor::HIGH);
+  } else if (schedule) {
+    g_workers->submit(drainClient, ctx->socket, priority ? xbus::Executor::HIGH : xbus::Executor::NORMAL);
+  }
 }
 
-static xbus::Response awaitResponse(xbus::Socket* socket, int targetFd) {
-  ResponseContext* ctx = new ResponseContext;
+// Only objects that negotiated compression send compressed responses, a payload of anyone else
+// that merely starts with the marker is packed here, so that expandFor() gives it back as it was
+static xbus::Response fromObject(ClientContext* ctx, const xbus::ResponseView& view) {
+  auto response = view.toResponse();
+  if (!ctx->compression && xbus::isCompressed(response)) {
+    xbus::compressResponse(response, 0);
+  }
+  return response;
+}
 
-  g_clients.update([socket, ctx](auto& clients) {
-    clients[socket->fd()].responses.push_back(ctx);
-  });
+// Response frames are matched with pending calls right away, in the event loop
+static bool matchResponse(ClientContext* ctx, std::string_view frame, xbus::Arena& arena) {
+  auto response = xbus::ResponseView::fromString(frame, &arena);
+  ResponseContext* matched = nullptr;
 
-  xbus::rdebug("[%d]: awaitResponse (%p) fd=%d", socket->fd(), ctx, targetFd);
+  int ping = ctx->pingTag;
+  if (ping && response.tag == ping) {
+    ctx->pingTag = 0;
+    return true;
+  }
 
-  ctx->responseTargetFd = targetFd;
-  ctx->responseInitialized.store(true);
-  xbus::Response response = ctx->response.get();
+  g_clients.withLocked([ctx, &response, &matched](auto& clients) {
+    auto itr = std::find_if(ctx->responses.begin(), ctx->responses.end(),
+      [&response](auto element) {
+        return element->responseTag == response.tag;
+      });
 
-  xbus::rdebug("[%d]: awaitResponse (%p) fd=%d: got response '%s'", socket->fd(), ctx, targetFd, response.toString().c_str());
-  
-  g_clients.update([socket, targetFd](auto& clients) {
-    clients[socket->fd()].responses.erase(
-      std::remove_if(clients[socket->fd()].responses.begin(), clients[socket->fd()].responses.end(),
-        [targetFd](auto element) {
-          return element->responseTargetFd == targetFd;
-        }),
-      clients[socket->fd()].responses.end()
-    );
+    if (itr != ctx->responses.end()) {
+      matched = *itr;
+    }
   });
-  delete ctx;
 
-  return response;
+  if (!matched) {
+    return false;
+  }
+
+  // Context stays alive until final response, which only the event loop can deliver
+  if (response.status == xbus::STATUS_MORE && matched->gather) {
+    // +gather collects final responses only
+  } else if (response.status == xbus::STATUS_MORE) {
+    std::unique_lock lock(matched->streamMutex);
+    matched->stream.push_back(fromObject(ctx, response));
+    bool full = matched->stream.size() >= XBUSD_STREAM_WINDOW;
+    lock.unlock();
+    matched->streamChanged.notify_all();
+    // Object is read again once caller catches up
+    if (full && !ctx->paused) {
+      ctx->paused = true;
+      g_io->pause(ctx->socket->fd(), ctx->ioKey);
+    }
+  } else if (!completeResponse(matched, fromObject(ctx, response))) {
+    releaseResponse(ctx->socket->fd(), matched);
+  }
+
+  xbus::rdebug("[%d] got response '%.*s'", ctx->socket->fd(), (int) frame.size(), frame.data());
+  return true;
 }
 
-static xbus::Response handleBusRequest(xbus::Request request, xbus::Socket* client) {
-  xbus::Response response = {"ERR", {"UNKNOWN ACTION"}};
-  if (request.action == xbus::ACTION_PROPERTY) {
-    if (request.subject == "close") {
-      return {""};
-    } else if (request.subject == "register") {
-      _XBUS_EXPECT_ARGS(1);
-      if (g_objects.get().find(request.args[0]) != g_objects.get().end()) {
-        response = {"ERR", {"ALREADY REGISTERED", request.args[0]}};
-      } else {
-        xbus::rinfo("[%d]: register '%s'", client->fd(), request.args[0].c_str());
-        g_objects.update([request, client](auto& objects) { objects[request.args[0]] = client; });
-        response = {"OK"};
-      }
-    } else if (request.subject == "version") {
-      response = {"OK", {XBUS_VERSION}};
-    } else if (request.subject == "list") {
-      g_objects.withLocked([&response](auto& objects) {
-        std::vector<std::string> objectNames;
-        for (auto& p : objects) {
-          objectNames.push_back(p.first);
-        }
-        response = {"OK", objectNames};
-      });
-    } else if (request.subject == "fd") {
-      response = {"OK", {std::to_string(client->fd())}};
+static void processInput(ClientContext* ctx) {
+  static xbus::Arena arena;
+  std::string_view frame;
+  if (g_heartbeat) {
+    ctx->lastInput = nowMs();
+  }
+
+  while (!ctx->paused && ctx->reader->tryNext(frame)) {
+    arena.reset();
+    if (xbus::Journal* journal = xbus::Journal::recording()) {
+      journal->record(xbus::Journal::IN, ctx->socket->fd(), frame);
+    }
+
+    if (matchResponse(ctx, frame, arena)) {
+      continue;
+    }
+
+    auto request = xbus::RequestView::fromString(frame, &arena);
+    if (request.isValid()) {
+      enqueueRequest(ctx, frame, request.priority, request.tag != 0);
     } else {
-      response = {"ERR", {"UNKNOWN PROPERTY"}};
+      xbus::rerror("[%d]: unrecognized response '%.*s', discarding", ctx->socket->fd(), (int) frame.size(), frame.data());
     }
-  } else if (request.action == xbus::ACTION_NOTIFY) {
-    int count = 0;
-    g_clients.withLocked([&count, client, request](auto& clients) {
-      for (auto& clientCtx : clients) {
-        if (clientCtx.second.socket != client) {
-          clientCtx.second.socket->write(request.toString() + '\0');
-          count++;
-        }
-      }
-    });
-    response = {"OK", {"SENT", std::to_string(count)}};
   }
-  return response;
 }
 
-static void handleRequest(xbus::Request request, xbus::Socket* client) {
-  xbus::rinfo("[%d]: recv '%s'", client->fd(), request.toString().c_str());
+// Requests that are already queued are still handled, connection is cleaned after that
+static void closeClient(ClientContext* ctx) {
+  g_io->remove(ctx->socket->fd(), ctx->ioKey);
+  bool clean;
+  {
+    std::unique_lock lock(ctx->queueMutex);
+    ctx->closed = true;
+    clean = ctx->drainers == 0;
+  }
+  if (clean) {
+    cleanClient(ctx->socket);
+  }
+}
 
-  xbus::Response response = {"ERR"};
-  if (request.object == "") {
-    response = handleBusRequest(request, client);
-    if (response.status.empty()) {
-      return;
-    }
-  } else {
-    xbus::rinfo("[%d]: remote '%s'", client->fd(), request.toString().c_str());
-    if (g_objects.get().find(request.object) == g_objects.get().end()) {
-      response = {"ERR", {"NO SUCH OBJECT"}};
+static void adoptClient(ClientContext* ctx) {
+  int fd = ctx->socket->fd();
+  ctx->ioKey = (uint64_t) ++g_ioGeneration << 32 | (uint32_t) fd;
+  g_io->receive(fd, ctx->ioKey);
+  processInput(ctx);
+}
+
+static void onInput(const xbus::IoEvent& event) {
+  auto ctx = findClient(event.key & 0xffffffff);
+  if (!ctx || ctx->ioKey != event.key) {
+    g_io->release(event);
+    return;
+  }
+
+  bool open = true;
+  try {
+    if (event.readable) {
+      open = ctx->reader->fill();
+    } else if (event.size > 0) {
+      ctx->reader->push({event.data, (size_t) event.size});
     } else {
-      request.tag = client->fd();
-      g_objects.get()[request.object]->write(request.toString() + '\0');
-      if (request.action == xbus::ACTION_NOTIFY) {
-        response = {"OK", {"SENT"}};
-      } else {
-        response = awaitResponse(g_objects.get()[request.object], client->fd());
-        response.tag = 0;
-        xbus::rdebug("[%d]: recv response from %d: '%s'", client->fd(), g_objects.get()[request.object]->fd(), response.toString().c_str());
-      }
+      open = false;
     }
+  } catch (xbus::IOException& e) {
+    e.print();
+    open = false;
+  }
+  g_io->release(event);
+
+  processInput(ctx.get());
+  if (!open) {
+    closeClient(ctx.get());
   }
-  client->write(response.toString() + '\0');
 }
 
-static void cleanClient(xbus::Socket* client) {
-  int fd = client->fd();
-  g_objects.withLocked([client](auto& objects) {
-    for (auto it = objects.begin(); it != objects.end(); ++it) {
-      if (it->second == client) {
-        objects.erase(it);
-        break;
+// Connections stop being read before handoff. Input the backend already received
+// is still processed, so that it is carried over with the rest of the state
+static void parkLoop() {
+  std::vector<std::pair<int, uint64_t>> keys;
+  g_clients.withLocked([&keys](auto& clients) {
+    for (auto& p : clients) {
+      if (p.second->ioKey) {
+        keys.push_back({p.first, p.second->ioKey});
       }
     }
   });
+  g_io->pause(g_listener->fd(), XBUSD_KEY_LISTENER);
+  for (auto& key : keys) {
+    g_io->pause(key.first, key.second);
+  }
 
-  g_clients.withLocked([client](auto& clients) {
-    auto itr = clients.find(client->fd());
-    if (itr != clients.end()) {
-      clients.erase(itr);
+  xbus::IoEvent events[XBUSD_LOOP_EVENTS];
+  while (!g_io->settled()) {
+    int count = g_io->wait(events, XBUSD_LOOP_EVENTS);
+    for (int i = 0; i < count; i++) {
+      if (events[i].key != XBUSD_KEY_LISTENER && events[i].key != XBUSD_KEY_WAKEUP) {
+        onInput(events[i]);
+      }
     }
-  });
+  }
 
-  delete client;
+  parkForHandoff();
 
-  xbus::rinfo("[%d] disconnected", fd);
+  g_io->resume(g_listener->fd(), XBUSD_KEY_LISTENER);
+  for (auto& key : keys) {
+    auto ctx = findClient(key.first);
+    if (ctx && ctx->ioKey == key.second && !ctx->paused) {
+      g_io->resume(key.first, key.second);
+    }
+  }
+}
+
+static void onWakeup() {
+  uint64_t count;
+  ::read(g_wakeup, &count, sizeof(count));
+
+  if (g_handoff) {
+    parkLoop();
+  }
+
+  std::vector<int> adopt, resume;
+  {
+    std::unique_lock lock(g_loopMutex);
+    std::swap(adopt, g_adoptQueue);
+    std::swap(resume, g_resumeQueue);
+  }
+  for (int fd : adopt) {
+    auto ctx = findClient(fd);
+    if (ctx) {
+      adoptClient(ctx.get());
+    }
+  }
+  for (int fd : resume) {
+    auto ctx = findClient(fd);
+    if (ctx && ctx->paused && !ctx->closed) {
+      ctx->paused = false;
+      g_io->resume(fd, ctx->ioKey);
+      processInput(ctx.get());
+    }
+  }
 }
 
-static void handleClient(xbus::Socket* client) try {
+static void acceptClient() {
+  xbus::Socket* client = g_listener->accept();
+  if (!client) return;
+  if (client->fd() == -1) {
+    delete client;
+    return;
+  }
+  xbus::info("new client: %d", client->fd());
+  if (xbus::Journal* journal = xbus::Journal::recording()) {
+    journal->record(xbus::Journal::OPEN, client->fd());
+  }
   createCtx(client);
+  adoptClient(findClient(client->fd()).get());
+}
+
+// Pings objects that didn't send anything for a heartbeat interval. One that doesn't answer
+// within another interval is disconnected, which fails calls pending on it
+static void heartbeat() {
+  while (1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(std::max(g_heartbeat / 4, 1)));
+    if (g_handoff) continue;
+
+    std::vector<int> objects;
+    g_objects.withLocked([&objects](auto& o) {
+      for (auto& p : o) {
+        for (auto& replica : p.second.replicas) {
+          objects.push_back(replica.socket->fd());
+        }
+      }
+    });
+
+    int64_t now = nowMs();
+    // Socket stays valid while clients are locked, writes that would block are skipped
+    g_clients.withLocked([&objects, now](auto& clients) {
+      for (int fd : objects) {
+        auto itr = clients.find(fd);
+        if (itr == clients.end() || itr->second->closed) continue;
+        auto& ctx = *itr->second;
+        if (ctx.pingTag) {
+          if (now - ctx.pingSent >= g_heartbeat) {
+            xbus::rwarning("[%d]: object doesn't answer heartbeat, disconnecting", fd);
+            ctx.socket->shutdown();
+            ctx.pingTag = 0;
+          }
+        } else if (now - ctx.lastInput >= g_heartbeat) {
+          auto lock = ctx.socket->lockWrites(false);
+          if (!lock.owns_lock()) continue;
+          int tag = nextTag();
+          std::string ping = "+ping^#" + std::to_string(tag);
+          if (::send(fd, ping.c_str(), ping.size() + 1, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) ping.size() + 1) {
+            ctx.pingSent = now;
+            ctx.pingTag = tag;
+          }
+        }
+      }
+    });
+  }
+}
 
-  std::queue<std::string> requestsQueue;
+// Reads every connection, matches responses with pending calls and queues requests for workers
+static void eventLoop() {
+  xbus::IoEvent events[XBUSD_LOOP_EVENTS];
+  g_busy++;
+  while (1) {
+    int count = g_io->wait(events, XBUSD_LOOP_EVENTS);
+    for (int i = 0; i < count; i++) {
+      if (events[i].key == XBUSD_KEY_LISTENER) {
+        acceptClient();
+      } else if (events[i].key == XBUSD_KEY_WAKEUP) {
+        onWakeup();
+      } else {
+        onInput(events[i]);
+      }
+    }
+  }
+}
 
-  std::string buffer;
+// Keeps a link to peer daemon at path, reconnecting when it breaks
+static void dialPeer(std::string path) {
   while (1) {
-    buffer = client->read(XBUS_READ_SIZE);
+    xbus::Socket* link = new xbus::Socket(path);
+    try {
+      link->connect();
+    } catch (xbus::SocketException& e) {
+      delete link;
+      std::this_thread::sleep_for(std::chrono::seconds(XBUSD_PEER_RETRY));
+      continue;
+    }
 
-    if (buffer.empty()) {
-      break;
+    xbus::Request hello;
+    hello.action = xbus::ACTION_PROPERTY;
+    hello.subject = "peer";
+    hello.args = localObjects();
+    hello.args.insert(hello.args.begin(), g_daemonId);
+
+    createCtx(link);
+    xbus::FrameReader* reader = findClient(link->fd())->reader;
+    std::string_view frame;
+    xbus::Response response;
+    try {
+      link->writeFrame(hello.toString());
+      if (reader->next(frame)) {
+        response = xbus::Response::fromString(frame);
+      }
+    } catch (xbus::IOException& e) {
+      e.print();
     }
 
-    if (buffer.find('\0') != std::string::npos) {
-      auto requests = xbus::splitString(buffer, '\0');
-      for (auto r : requests) {
-        requestsQueue.push(r);
+    if (response.status == "OK" && !response.rest.empty() && addPeer(link, response.rest[0])) {
+      xbus::rinfo("[%d]: linked to peer '%s'", link->fd(), response.rest[0].c_str());
+      for (size_t i = 1; i < response.rest.size(); i++) {
+        registerRemote(response.rest[i], link);
       }
+      int fd = link->fd();
+      postToLoop(g_adoptQueue, fd);
+
+      std::unique_lock lock(g_closedMutex);
+      g_clientClosed.wait(lock, [fd, link]() {
+        auto ctx = findClient(fd);
+        return !ctx || ctx->socket != link;
+      });
     } else {
-      requestsQueue.push(buffer);
-    }
-
-    while (!requestsQueue.empty()) {
-      if (!g_clients.get()[client->fd()].responses.empty()) {
-        auto response = xbus::Response::fromString(requestsQueue.front());
-        xbus::rdebug("[%d] got response '%s'", client->fd(), response.toString().c_str());
-
-        g_clients.update([&requestsQueue, &response, client](auto& clients) {
-          auto itr = std::find_if(clients[client->fd()].responses.begin(), clients[client->fd()].responses.end(),
-            [&response](auto element) {
-              return element->responseTargetFd == response.tag;
-            });
-
-          if (itr != clients[client->fd()].responses.end()) {
-            (*itr)->response.set(response);
-            (*itr)->responseInitialized.store(false);
-            requestsQueue.pop();
-          } else {
-            xbus::rerror("[%d]: unrecognized response '%s', discarding", client->fd(), response.toString().c_str());
-            requestsQueue.pop();
+      xbus::rdebug("peer '%s' rejected link: '%s'", path.c_str(), response.toString().c_str());
+      cleanClient(link);
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(XBUSD_PEER_RETRY));
+  }
+}
+
+static bool readHandoffRecord(xbus::Socket& link, HandoffHeader& header, std::string& payload, int& fd) {
+  size_t size = link.recvFd((char*) &header, sizeof(header), fd);
+  if (size == 0) {
+    return false;
+  }
+  while (size < sizeof(header)) {
+    size_t chunk = link.read((char*) &header + size, sizeof(header) - size);
+    if (chunk == 0) return false;
+    size += chunk;
+  }
+  payload.resize(header.size);
+  for (size = 0; size < header.size;) {
+    size_t chunk = link.read(payload.data() + size, header.size - size);
+    if (chunk == 0) return false;
+    size += chunk;
+  }
+  return true;
+}
+
+static std::vector<std::string> splitLines(const std::string& str, size_t count) {
+  std::vector<std::string> lines;
+  size_t begin = 0;
+  for (size_t i = 0; i + 1 < count; i++) {
+    size_t end = str.find('\n', begin);
+    if (end == std::string::npos) break;
+    lines.push_back(str.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  lines.push_back(str.substr(std::min(begin, str.size())));
+  lines.resize(count);
+  return lines;
+}
+
+// Counterpart of handoff(), returns listening socket taken over from xbusd at path
+static xbus::Socket* takeOver(const std::string& path) {
+  xbus::Socket link(path);
+  link.connect();
+  link.writeFrame("+handoff");
+
+  xbus::Socket* listener = nullptr;
+  std::map<int, xbus::Socket*> sockets; // By fd in the old process
+  std::map<std::pair<int, int>, size_t> calls;
+
+  HandoffHeader header = {0, 0};
+  std::string payload;
+  int fd;
+  while (readHandoffRecord(link, header, payload, fd)) {
+    // Old xbusd replies with a plain response if it refused
+    if (!listener && (header.kind != 'L' || fd == -1)) {
+      break;
+    } else if (header.kind == 'L') {
+      listener = new xbus::Socket(fd);
+    } else if (header.kind == 'S') {
+      auto names = xbus::splitString(payload, '\n');
+      for (size_t i = 0; i < names.size(); i++) {
+        if (!names[i].empty() && g_symbols.intern(names[i]) != i + 1) {
+          xbus::warning("symbol '%s' got a different ID", names[i].c_str());
+        }
+      }
+    } else if (header.kind == 'C') {
+      auto fields = splitLines(payload, 4);
+      xbus::Socket* socket = new xbus::Socket(fd);
+      sockets[std::stoi(fields[0])] = socket;
+      g_clients.update([&](auto& clients) {
+        auto& ctx = clientAt(clients, socket->fd());
+        ctx.socket = socket;
+        ctx.watching = fields[1][0] == '1';
+        ctx.peer = fields[1][1] == '1';
+        ctx.conflating = fields[1].size() > 2 && fields[1][2] == '1';
+        ctx.compression = fields[1].size() > 3 && fields[1][3] == '1';
+        ctx.peerId = fields[2];
+        ctx.reader = new xbus::FrameReader(socket);
+        if (!fields[3].empty()) {
+          ctx.reader->push(fields[3]);
+        }
+      });
+    } else if (header.kind == 'P') {
+      auto fields = splitLines(payload, 4);
+      int tag = std::stoi(fields[1]), callerFd = std::stoi(fields[2]);
+      xbus::Socket* target = sockets[std::stoi(fields[0])];
+      xbus::Socket* caller = sockets[callerFd];
+      if (!target || !caller) continue;
+      auto ctx = expectResponse(target, tag, caller, std::stoi(fields[3]));
+      // Replicas of one broadcast call share the tag
+      g_clients.update([&](auto& clients) {
+        auto& resumed = clientAt(clients, caller->fd()).resumed;
+        auto itr = calls.find({callerFd, tag});
+        if (itr == calls.end()) {
+          itr = calls.insert({{callerFd, tag}, resumed.size()}).first;
+          resumed.push_back({ctx->callerTag});
+        }
+        resumed[itr->second].targets.push_back(target);
+        resumed[itr->second].contexts.push_back(ctx);
+      });
+    } else if (header.kind == 'O') {
+      auto fields = splitLines(payload, 11);
+      ObjectContext object;
+      int peerFd = std::stoi(fields[1]);
+      object.peer = peerFd == -1 ? nullptr : sockets[peerFd];
+      object.balance = (Balance) std::stoi(fields[2]);
+      object.hashArg = std::stoul(fields[3]);
+      for (auto& replica : xbus::splitString(fields[4], ' ')) {
+        auto connections = xbus::splitString(replica, ',');
+        if (connections.empty() || !sockets[std::stoi(connections[0])]) continue;
+        object.replicas.push_back({sockets[std::stoi(connections[0])]});
+        for (size_t i = 1; i < connections.size(); i++) {
+          if (sockets[std::stoi(connections[i])]) {
+            object.replicas.back().channels.push_back(sockets[std::stoi(connections[i])]);
           }
-        });
-        continue;
+        }
       }
-      if (xbus::isRequest(requestsQueue.front())) {
-        xbus::Request request = xbus::Request::fromString(requestsQueue.front());
-        requestsQueue.pop();
-        handleRequest(request, client);
-      } else {
-        xbus::rerror("[%d]: unexpected response: '%s', discarding", client->fd(), requestsQueue.front().c_str());
-        requestsQueue.pop();
+      // Cached values aren't carried over, they are refilled on first read
+      for (auto& field : xbus::splitString(fields[5], ' ')) {
+        if (!field.empty()) {
+          object.cache[field];
+        }
       }
+      // Limits are not sent by older xbusd
+      if (!fields[6].empty()) {
+        object.maxInFlight = std::stoi(fields[6]);
+        object.maxWaiting = std::stoul(fields[7]);
+      }
+      for (auto& subject : xbus::splitString(fields[8], ' ')) {
+        if (!subject.empty()) {
+          object.coalesce.insert(subject);
+        }
+      }
+      object.ids = fields[9] == "1";
+      object.direct = fields[10] == "1";
+      rebuildRing(object);
+      g_objects.update([&fields, &object](auto& objects) {
+        objects[fields[0]] = std::move(object);
+        reindexObjects(objects);
+      });
+    } else if (header.kind == 'E') {
+      g_nextTag = std::stoi(payload);
+      break;
     }
   }
 
-  cleanClient(client);
-} catch (xbus::SocketException& e) {
-  e.print();
-  cleanClient(client);
-  return;
-} catch (xbus::IOException& e) {
-  e.print();
-  cleanClient(client);
-  return;
+  if (header.kind != 'E' || !listener) {
+    xbus::error("Handoff from '%s' failed", path.c_str());
+    return nullptr;
+  }
+
+  link.writeFrame("OK");
+  xbus::info("Took over %zu connections from '%s'", sockets.size(), path.c_str());
+  return listener;
+}
+
+// Listening socket passed by service manager (LISTEN_FDS, socket activation), or -1.
+// Clients can connect and send requests before xbusd runs, they wait in socket's queue
+static int inheritedListener(std::string& path) {
+  const char* pid = getenv("LISTEN_PID");
+  const char* fds = getenv("LISTEN_FDS");
+  if (!pid || !fds || atoi(pid) != getpid() || atoi(fds) < 1) {
+    return -1;
+  }
+  // Not passed on to processes started by xbusd
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  int fd = XBUSD_LISTEN_FDS_START;
+  sockaddr_un addr;
+  socklen_t length = sizeof(addr);
+  if (getsockname(fd, (sockaddr*) &addr, &length) == -1 || addr.sun_family != AF_UNIX || !addr.sun_path[0]) {
+    xbus::warning("Inherited socket is not a Unix socket with a path, ignoring it");
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  path = addr.sun_path;
+  return fd;
 }
 
 void usage(const char* argv0) {
@@ -262,17 +2784,38 @@ void usage(const char* argv0) {
     "Options:\n"
     "  -h, --help             - Shows this message\n"
     "  -v, --version          - Shows version\n"
-    "  -t N, --threads N      - Specify the number of threads (default is equal to hardware concurency)\n"
+    "  -t N, --threads N      - Specify the number of worker threads\n"
+    "  -t MIN:MAX             - Grow and shrink worker threads with load, between MIN and MAX (default is 2:256)\n"
     "  -s SOCK, --socket SOCK - Unix socket for deamon\n"
+    "  -p SOCK, --peer SOCK   - Link to another xbusd, can be repeated\n"
+    "  -u, --upgrade          - Take over from xbusd running on SOCK, without dropping connections\n"
+    "  -b NAME, --backend NAME - I/O backend of event loop (epoll, uring), default is epoll\n"
+    "  -a CPUS, --affinity CPUS - Pin worker threads to CPUS, like 0-3,6\n"
+    "  -m N[:Q], --max-in-flight N[:Q] - Default limit of calls in flight per object replica (default is 0, unlimited)\n"
+    "                         and of calls waiting for it (default is 64), callers get ERR,BUSY past that\n"
+    "  -k MS, --heartbeat MS  - Ping objects that are idle for MS, disconnect ones that don't answer within MS\n"
+    "  -r FILE[:MB], --record FILE[:MB] - Record traffic to journal FILE, a ring of MB megabytes (default is 64)\n"
+    "  -n N, --history N      - Notifications kept per subject for +history (default is 16, 0 disables)\n"
+    "  -S FILE[:MS], --snapshot FILE[:MS] - Registry snapshot, calls to objects listed in FILE wait up to MS\n"
+    "                         for them to register (default is 5000), objects that register are added\n"
     "  -l LVL, --loglevel LVL - Sets log level (debug, info, warning, error, fatal)\n"
     "", XBUS_VERSION, argv0);
 }
 
 int main(int argc, char ** argv) {
   signal(SIGPIPE, sigpipe_handler);
+  for (auto name : g_busRequests) {
+    g_symbols.intern(name);
+  }
 
   std::string sock = xbus::SOCKET_PATH;
-  int threads = 0;
+  std::vector<std::string> peers;
+  std::string backend = "epoll";
+  std::vector<int> cpus;
+  bool upgrade = false;
+  std::string journal;
+  size_t journalSize = XBUSD_JOURNAL_SIZE;
+  size_t minThreads = XBUSD_WORKERS_MIN, maxThreads = XBUSD_WORKERS_MAX;
 
   for (int i = 1; i < argc; i++) {
     if (!strcmp("-v", argv[i]) || !strcmp("--version", argv[i])) {
@@ -284,14 +2827,98 @@ int main(int argc, char ** argv) {
     } else if (!strcmp("-t", argv[i]) || !strcmp("--threads", argv[i])) {
       _XBUS_CHECK_ARGV();
       try {
-        threads = std::stoi(argv[++i]);
+        std::string limits = argv[++i];
+        size_t colon = limits.find(':');
+        minThreads = std::stoul(limits.substr(0, colon));
+        maxThreads = colon == std::string::npos ? minThreads : std::stoul(limits.substr(colon + 1));
       } catch (...) {
         xbus::error("Invalid number for '%s'", argv[i-1]);
         return 1;
       }
+      if (!minThreads || maxThreads < minThreads) {
+        xbus::error("Invalid number for '%s'", argv[i-1]);
+        return 1;
+      }
     } else if (!strcmp("-s", argv[i]) || !strcmp("--socket", argv[i])) {
       _XBUS_CHECK_ARGV();
       sock = argv[++i];
+    } else if (!strcmp("-u", argv[i]) || !strcmp("--upgrade", argv[i])) {
+      upgrade = true;
+    } else if (!strcmp("-a", argv[i]) || !strcmp("--affinity", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      try {
+        cpus = xbus::Executor::parseCpus(argv[++i]);
+      } catch (...) {
+        xbus::error("Invalid CPU list for '%s'", argv[i-1]);
+        return 1;
+      }
+    } else if (!strcmp("-m", argv[i]) || !strcmp("--max-in-flight", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      try {
+        std::string limits = argv[++i];
+        size_t colon = limits.find(':');
+        g_defaultMaxInFlight = std::stoul(limits.substr(0, colon));
+        if (colon != std::string::npos) {
+          g_defaultMaxWaiting = std::stoul(limits.substr(colon + 1));
+        }
+      } catch (...) {
+        xbus::error("Invalid number for '%s'", argv[i-1]);
+        return 1;
+      }
+    } else if (!strcmp("-k", argv[i]) || !strcmp("--heartbeat", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      try {
+        g_heartbeat = std::stoi(argv[++i]);
+      } catch (...) {
+        g_heartbeat = -1;
+      }
+      if (g_heartbeat < XBUSD_HEARTBEAT_MIN) {
+        xbus::error("Invalid number for '%s'", argv[i-1]);
+        return 1;
+      }
+    } else if (!strcmp("-n", argv[i]) || !strcmp("--history", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      try {
+        g_historyDepth = std::stoul(argv[++i]);
+      } catch (...) {
+        xbus::error("Invalid number for '%s'", argv[i-1]);
+        return 1;
+      }
+    } else if (!strcmp("-S", argv[i]) || !strcmp("--snapshot", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      g_snapshot = argv[++i];
+      size_t colon = g_snapshot.rfind(':');
+      if (colon != std::string::npos) {
+        try {
+          g_expectTimeout = std::stoi(g_snapshot.substr(colon + 1));
+        } catch (...) {
+          g_expectTimeout = -1;
+        }
+        if (g_expectTimeout < 0) {
+          xbus::error("Invalid number for '%s'", argv[i-1]);
+          return 1;
+        }
+        g_snapshot.resize(colon);
+      }
+    } else if (!strcmp("-r", argv[i]) || !strcmp("--record", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      journal = argv[++i];
+      size_t colon = journal.rfind(':');
+      if (colon != std::string::npos) {
+        try {
+          journalSize = std::stoul(journal.substr(colon + 1));
+        } catch (...) {
+          xbus::error("Invalid number for '%s'", argv[i-1]);
+          return 1;
+        }
+        journal.resize(colon);
+      }
+    } else if (!strcmp("-b", argv[i]) || !strcmp("--backend", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      backend = argv[++i];
+    } else if (!strcmp("-p", argv[i]) || !strcmp("--peer", argv[i])) {
+      _XBUS_CHECK_ARGV();
+      peers.push_back(argv[++i]);
     } else if (!strcmp("-l", argv[i]) || !strcmp("--loglevel", argv[i])) {
       _XBUS_CHECK_ARGV();
       xbus::setLogLevel(xbus::stringToLogLevel(argv[++i]));
@@ -303,19 +2930,87 @@ int main(int argc, char ** argv) {
 
   printf("xbus v%s\n", XBUS_VERSION);
 
-  xbus::Socket socket(sock);
+  g_wakeup = eventfd(0, EFD_CLOEXEC);
+  if (g_wakeup == -1) {
+    xbus::error("eventfd failed");
+    return 1;
+  }
+
+  // Created before taking over, as the loop runs on this thread
+  g_io = xbus::IoBackend::create(backend);
+  if (!g_io) {
+    xbus::warning("I/O backend '%s' is not available, using epoll", backend.c_str());
+    g_io = xbus::IoBackend::create("epoll");
+  }
+  xbus::info("I/O backend: %s", g_io->name());
+
+  if (upgrade) {
+    try {
+      g_listener = takeOver(sock);
+    } catch (xbus::SocketException& e) {
+      e.print();
+    } catch (xbus::IOException& e) {
+      e.print();
+    }
+    if (!g_listener) {
+      return 1;
+    }
+  } else if (int fd = inheritedListener(sock); fd != -1) {
+    g_listener = new xbus::Socket(fd);
+    xbus::info("Listening on inherited socket '%s'", sock.c_str());
+  } else {
+    g_listener = new xbus::Socket(sock);
+    remove(sock.c_str());
+    g_listener->bind();
+    g_listener->listen();
+  }
 
-  remove(sock.c_str());
+  if (!g_snapshot.empty()) {
+    if (!loadSnapshot(g_snapshot)) {
+      xbus::error("Can't read registry snapshot '%s'", g_snapshot.c_str());
+      return 1;
+    }
+    xbus::info("Expecting %zu objects from '%s'", g_expected.size(), g_snapshot.c_str());
+  }
 
-  socket.bind();
-  socket.listen();
+  g_daemonId = sock;
+  // Started after taking over, traffic of handoff itself is not recorded
+  if (!journal.empty()) {
+    try {
+      g_journal.create(journal, journalSize << 20);
+    } catch (xbus::IOException& e) {
+      e.print();
+      return 1;
+    }
+    xbus::Journal::setRecording(&g_journal);
+    xbus::info("Recording traffic to '%s'", journal.c_str());
+  }
+  g_workers = new xbus::Executor(minThreads, cpus, XBUS_EXECUTOR_SPIN, maxThreads);
+  g_io->watch(g_listener->fd(), XBUSD_KEY_LISTENER);
+  g_io->watch(g_wakeup, XBUSD_KEY_WAKEUP);
 
-  mrt::ThreadPool<mrt::Task<xbus::Socket*>> pool;
+  // Connections carried over from previous xbusd, calls in flight are finished first
+  std::vector<std::shared_ptr<ClientContext>> carried;
+  g_clients.withLocked([&carried](auto& clients) {
+    for (auto& p : clients) {
+      carried.push_back(p.second);
+    }
+  });
+  for (auto ctx : carried) {
+    if (!ctx->resumed.empty()) {
+      ctx->drainers = 1;
+      ctx->draining = true;
+      g_workers->submit(drainClient, ctx->socket);
+    }
+    adoptClient(ctx.get());
+  }
 
-  while (1) {
-    xbus::Socket* client = socket.accept();
-    if (!client) continue;
-    xbus::info("new client: %d", client->fd());
-    pool.addTask({handleClient, client});
+  for (auto& peer : peers) {
+    std::thread(dialPeer, peer).detach();
   }
+  if (g_heartbeat) {
+    std::thread(heartbeat).detach();
+  }
+
+  eventLoop();
 }